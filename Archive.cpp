@@ -3,12 +3,17 @@
 #include "Utils.h"
 #include "ThreadPool.h"
 #include "Comp.h"
+#include "HashBatch.h"
 using namespace Utils;
 
 #include <string>
 #include <fstream>
 #include <filesystem>
 #include <queue>
+#include <thread>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
 namespace fs = std::filesystem;
 
 //////////////////////////////////////////////////////////////////////
@@ -23,6 +28,7 @@ Archive::Archive(RepoInfo *repo, const string &name) {
     IDPath         = ArchDirPath + "/" + PHATBAK_ARCH_ID;
     FinishedPath   = ArchDirPath + "/" + PHATBAK_ARCH_FINISHED;
     ListPath       = ArchDirPath + "/List";
+    TreePath       = ArchDirPath + "/Tree";
     LogPath        = ArchDirPath + "/PhatBak.log";
     OptionsPath    = ArchDirPath + "/Options";
     FinfoDirPath   = ArchDirPath + "/FInfo";
@@ -41,7 +47,7 @@ Archive::~Archive() {
     delete ChunkBlocks;
 
     LogFile .close();
-    ListFile.close();
+    ListFile.Close();
 }
 
 FileListEntry Archive::ParseListLine (const string &ListLine, u64 LineNo) {
@@ -57,6 +63,7 @@ FileListEntry Archive::ParseListLine (const string &ListLine, u64 LineNo) {
     Res.Name          = FirstCut[0];
     Res.CompFlag      = CompFlagUnComp;
     Res.Stats.st_mode = 0;
+    Res.Stats.st_ino  = 0;
     Res.LinkTarget    = "";
     Res.FInfoIdx      = INT64_MIN; // most negative possible
     Res.LineNo        = LineNo;
@@ -72,11 +79,15 @@ FileListEntry Archive::ParseListLine (const string &ListLine, u64 LineNo) {
         else if (Name == "gid"  ) Res.Stats.st_gid  =               strtoull (Val.c_str(), NULL, 16);
         else if (Name == "size" ) Res.Stats.st_size =               strtoull (Val.c_str(), NULL, 10);
         else if (Name == "mtime") Res.Stats.st_mtim = NsToTimeSpec (strtoull (Val.c_str(), NULL, 16));
-        else if (Name == "U" || Name == "C") {
+        else if (Name == "ino"  ) Res.Stats.st_ino  =               strtoull (Val.c_str(), NULL, 16);
+        else if (Name.size() == 1 && Comp::IsCompFlag (Name[0])) {
                                   Res.FInfoIdx      =               strtoull (Val.c_str(), NULL, 10);
                                   Res.CompFlag      =               Name[0];
                                   }
         else if (Name == "acl")  Res.Acl            =                         Val.c_str();
+        else if (Name == "ref")  Res.RefArch        =                         Val;
+        else if (Name == "data") Res.Inline         = Base64Decode           (Val);
+        else if (Name == "dig")  Res.Digest         =                         Val;
         else
             THROW_PBEXCEPTION_FMT ("Illegal entry in %s:%llu : %s", ListPath.c_str(), LineNo, RHSTok.c_str());
     }
@@ -93,8 +104,38 @@ FileListEntry Archive::ParseListLine (const string &ListLine, u64 LineNo) {
 }
 
 //////////////////////////////////////////////////////////////////////
-ArchiveRead::ArchiveRead (RepoInfo *repo, const string &name) : Archive (repo, name) {
+// one chunk line of a finfo block
+// blocks held by an earlier archive (BlockRefs) are qualified with its name
+// and end with the checksum of the block file when there is one
+// (always after a name with a ":" in it, 0 if there's none, so the name doesn't read as one)
+// a delta chunk is followed by the chain of chunks it's encoded against
+static string FInfoBlock (char CompFlag, i64 BlockIdx, const RefArchive *Ref, u64 Sum) {
+    string Block = string("") + CompFlag + "-" + to_string (BlockIdx);
+    if (Ref)
+        Block += "@" + Ref->Name;
+    if (Sum || (Ref && Ref->Name.find (':') != string::npos))
+        Block += ":" + SumStr (Sum);
+    return Block;
+}
+static string FInfoLine (char CompFlag, i64 BlockIdx, const RefArchive *Ref, u64 Sum, const string &Hash
+                        ,const vector <ChunkInfo> &Delta = {}) {
+    string Line = FInfoBlock (CompFlag, BlockIdx, Ref, Sum) + " " + Hash;
+    for (auto &Link : Delta)
+        Line += " " + FInfoBlock (Link.CompFlag, Link.ChunkIdx, Link.Ref, Link.Sum);
+    return Line + "\n";
+}
+
+ArchiveRead::ArchiveRead (RepoInfo *repo, const string &name) : Archive (repo, name), SumsChecked (0), SumsMissing (0) {
     DBGCTOR;
+    SharedChunks = false;
+    RawByChoice  = false;
+
+    // blocks without an archive reference are in this archive
+    Self.Name        = Name;
+    Self.No          = 0;
+    Self.FInfoBlocks = FInfoBlocks;
+    Self.ChunkBlocks = ChunkBlocks;
+    NextRefNo        = 1;
 
     if (!fs::is_directory (ArchDirPath))
         ERROR ("Archive %s is not a directory\n", ArchDirPath.c_str());
@@ -106,14 +147,50 @@ ArchiveRead::ArchiveRead (RepoInfo *repo, const string &name) : Archive (repo, n
     // get options used in the archive
     ParseOptions ();
 
+    // small blocks may have been compressed with trained dictionaries
+    Comp::LoadDicts (ExtraDirPath);
+
     // get ready to read file list
-    ListFile = OpenReadStream (ListPath);
+    ListFile.OpenRead (ListPath);
 }
 
 ArchiveRead::~ArchiveRead() {
     DBGDTOR;
-    for (auto Itr : HLinkSyncs)
-        delete Itr.second;
+    HLinkSyncs.ForEach ([](const BlockKey &Key, HLinkSyncRec *&HLS) {
+        delete HLS;
+    });
+    RefArchs.ForEach ([](const string &RefName, RefArchive *&Ref) {
+        delete Ref->FInfoBlocks;
+        delete Ref->ChunkBlocks;
+        delete Ref;
+    });
+}
+
+// archive holding blocks referenced by a List or FInfo entry ("" for this archive)
+const RefArchive *ArchiveRead::GetRef (const string &RefName) {
+    if (RefName == "" || RefName == Name)
+        return &Self;
+    RefArchive **Found = RefArchs.Find (RefName);
+    if (Found)
+        return *Found;
+
+    string RefDirPath = Repo->Name + "/" + RefName;
+    if (!fs::is_directory (RefDirPath))
+        THROW_PBEXCEPTION_FMT ("Archive %s refers to blocks in missing archive %s", Name.c_str(), RefDirPath.c_str());
+
+    bool        Inserted;
+    RefArchive *NewRef  = new RefArchive;
+    NewRef->Name        = RefName;
+    NewRef->No          = NextRefNo++;
+    NewRef->FInfoBlocks = new BlockList (RefDirPath + "/FInfo");
+    NewRef->ChunkBlocks = new BlockList (RefDirPath + "/Chunks");
+    RefArchive *Ref = *RefArchs.Insert (RefName, NewRef, Inserted);
+    if (!Inserted) {
+        delete NewRef->FInfoBlocks;
+        delete NewRef->ChunkBlocks;
+        delete NewRef;
+    }
+    return Ref;
 }
 
 void ArchiveRead::ParseOptions () {
@@ -121,8 +198,11 @@ void ArchiveRead::ParseOptions () {
     O = ::O;
 
     // extract options from the archive file
+    // not CompType or CompLevel: every block says how it was compressed,
+    // so new blocks of an archive based on this one use whatever the command line says
+    // (but for recompress, below)
     fstream OptsFile = OpenReadStream (OptionsPath);
-    string OptLine;
+    string OptLine, ArchCompType, ArchCompLevel;
     while (getline (OptsFile, OptLine)) {
         // split into name/value pairs
         vecstr Toks = SplitStr (OptLine, "=");
@@ -144,11 +224,26 @@ void ArchiveRead::ParseOptions () {
         else if (OptName == "BlockNumModulus") O.BlockNumModulus = stoull               (OptVal);
         else if (OptName == "ChunkSize"      ) O.ChunkSize       = stoull               (OptVal);
         else if (OptName == "HashType"       ) O.HashType        = HashNameToEnum       (OptVal);
-        else if (OptName == "CompType"       ) O.CompType        = Comp::CompNameToEnum (OptVal);
-        else if (OptName == "CompLevel"      ) O.CompLevel       = stoull               (OptVal);
+        else if (OptName == "Dedup"          ) SharedChunks     |= stoull               (OptVal);
+        else if (OptName == "DetectMoves"    ) SharedChunks     |= stoull               (OptVal);
+        else if (OptName == "SharedChunks"   ) SharedChunks     |= stoull               (OptVal);
+        else if (OptName == "BlockRefs"      ) O.BlockRefs      |= stoull               (OptVal);
+        else if (OptName == "DeferComp"      ) RawByChoice      |= stoull               (OptVal);
+        else if (OptName == "CompType"       ) ArchCompType      =                      (OptVal);
+        else if (OptName == "CompLevel"      ) ArchCompLevel     =                      (OptVal);
+        else if (OptName == "InlineSize" && O.InlineSize == Opts::InlineUnset) O.InlineSize = stoull (OptVal);
     }
 
     OptsFile.close();
+    RawByChoice |= ArchCompType == CompNames [CompType_NONE];
+
+    // recompress gives the blocks the compression the archive was created for (see --DeferComp)
+    // unless the command line asks for another
+    if (O.Operation == Opts::DoRecompress && !O.CompGiven && ArchCompType.size()) {
+        O.CompType = Comp::CompNameToEnum (ArchCompType);
+        if (ArchCompLevel.size())
+            O.CompLevel = stoi (ArchCompLevel);
+    }
 
     // apply modified options to global
     // TBD: make sure everyone is using the correct options then get rid of this
@@ -177,28 +272,30 @@ void ArchiveRead::DoExtractJob (const string &ListLine, u64 LineNo) {
     bool          DoHLink = false;
     HLinkSyncRec *HLS     = NULL;
     if (AF->ListEntry.FInfoIdx != INT64_MIN) {
-        HLinkSyncsMtx.lock();
-
-        DoHLink = HLinkSyncs.count (AF->ListEntry.FInfoIdx) != 0;
-        if (DoHLink) {
-            HLS = HLinkSyncs[AF->ListEntry.FInfoIdx];
-        } else  {
-            HLS = new HLinkSyncRec;
-            HLinkSyncs [AF->ListEntry.FInfoIdx] = HLS;
+        BlockKey      Key   = {AF->ListEntry.FInfoIdx, AF->Ref ? AF->Ref->No : 0};
+        HLinkSyncRec **Found = HLinkSyncs.Find (Key);
+        if (Found) {
+            HLS     = *Found;
+            DoHLink = true;
+        } else {
+            bool          Inserted;
+            HLinkSyncRec *NewHLS = new HLinkSyncRec;
+            HLS     = *HLinkSyncs.Insert (Key, NewHLS, Inserted);
+            DoHLink = !Inserted;
+            if (!Inserted)
+                delete NewHLS;
         }
-
-        HLinkSyncsMtx.unlock();
     }
 
     // wait for target to exist
     if (DoHLink) {
         HLS->Lock.WaitIdle();
-        AF->ListEntry.LinkTarget = HLinkSyncs[AF->ListEntry.FInfoIdx]->Name;
+        AF->ListEntry.LinkTarget = HLS->Name;
     }
 
     // create extracted file
     LiveFile *LF = new LiveFile (AF->ListEntry,
-                                 AF->Chunks, ChunkBlocks,
+                                 AF->Chunks, ChunkBlocks, &ChunkReader,
                                  DirAttribs, &DirAttribsMtx,
                                  DoHLink);
 
@@ -218,7 +315,7 @@ void ArchiveRead::DoExtract () {
     // parse and extract all the entries in the list
     u64 LineNo = 0;
     string ListLine;
-    while (getline (ListFile, ListLine)) {
+    while (ListFile.GetLine (ListLine)) {
         LineNo ++;
 
         function <void()> Task = [=, this](){DoExtractJob (ListLine, LineNo);};
@@ -244,7 +341,7 @@ void ArchiveRead::DoList () {
     // create a list of files with first-order info
     string Line;
     u64 LineCount = 0;
-    while (getline (ListFile, Line)) {
+    while (ListFile.GetLine (Line)) {
         LineCount ++;
 
         FileListEntry FLE = ParseListLine (Line, LineCount);
@@ -252,7 +349,7 @@ void ArchiveRead::DoList () {
     }
 }
 
-static void FindBlockFiles (const string &Dir, const string &TopDir, map <i64, bool> &BlockMap, mutex &BlockMapMtx) {
+static void FindBlockFiles (const string &Dir, const string &TopDir, ConcMap <i64, bool> &BlockMap) {
     vecstr SubDirs, SubFiles;
     SlurpDir (Dir, SubDirs, SubFiles);
     for (auto File: SubFiles) {
@@ -262,99 +359,197 @@ static void FindBlockFiles (const string &Dir, const string &TopDir, map <i64, b
         i64 BlockIdx = strtoll (File.c_str(), NULL, 10);
 
         // remember this block
-        BlockMapMtx.lock();
-        if (BlockMap.count (BlockIdx))
+        if (!BlockMap.Insert (BlockIdx, 1))
             WARN ("Block #%ld seen twice in %s\n", BlockIdx, TopDir.c_str());
-        BlockMap [BlockIdx] = 1;
-        BlockMapMtx.unlock();
     }
 
     // do subdirs
     for (auto SubDir: SubDirs) {
-        function <void()> Task = [=,&BlockMap,&BlockMapMtx]() {
-            FindBlockFiles (Dir + "/" + SubDir, TopDir, BlockMap, BlockMapMtx);
+        function <void()> Task = [=,&BlockMap]() {
+            FindBlockFiles (Dir + "/" + SubDir, TopDir, BlockMap);
         };
         ThreadPool.Execute (Task);
     }
 }
 
 void ArchiveRead::DoTestJob (const string ListLine, u64 LineCount
-                            ,map <i64, bool> &FInfosMap, map <i64, bool> &ChunksMap
-                            ,mutex &FInfosMapMtx, mutex &ChunksMapMtx
+                            ,ConcMap <BlockKey, bool, BlockKeyHash> &FInfosMap, ConcMap <BlockKey, bool, BlockKeyHash> &ChunksMap
+                            ,ConcMap <BlockKey, bool, BlockKeyHash> &DeltaMap
+                            ,MerkleBuilder *Tested
                             ) {
 
     FileListEntry ListEntry = ParseListLine (ListLine, LineCount);
     if (O.ShowFiles)
         printf ("%s\n", ListEntry.Name.c_str());
+    if (Tested)
+        Tested->Add (ListEntry);
+
+    // contents kept in the list only need to unpack to the right size (and digest)
+    if (ListEntry.Inline.size()) {
+        ArchFileRead AF (this, ListEntry);
+        if (AF.ListEntry.Inline.size() != (u64) ListEntry.Stats.st_size)
+            WARN ("Size mismatch on inline data of %s:%lu\n", ListPath.c_str(), LineCount);
+        if (ListEntry.Digest.size() && InlineDigest (O.HashType, AF.ListEntry.Inline) != ListEntry.Digest)
+            WARN ("Digest mismatch on inline data of %s:%lu\n", ListPath.c_str(), LineCount);
+        return;
+    }
+
     if (ListEntry.FInfoIdx < 0)
         return;
 
-    FInfosMapMtx.lock();
-    bool DoFileCheck = FInfosMap.count(ListEntry.FInfoIdx) == 0;
-    FInfosMap[ListEntry.FInfoIdx] = 1;
-    FInfosMapMtx.unlock();
+    bool DoFileCheck = FInfosMap.Insert ({ListEntry.FInfoIdx, GetRef (ListEntry.RefArch)->No}, 1);
     if (!DoFileCheck)
         return; // another thread has done (or is doing) the check
 
     auto AF = new ArchFileRead (this, ListEntry);
+    if (ListEntry.Digest.size() && ChunksDigest (O.HashType, AF->Chunks) != ListEntry.Digest)
+        WARN ("Digest mismatch on FInfo block #%ld of %s\n", ListEntry.FInfoIdx, AF->Ref->Name.c_str());
     for (auto Chunk : AF->Chunks) {
-        ChunksMapMtx.lock();
-        ChunksMap[Chunk.ChunkIdx] = 1;
-        ChunksMapMtx.unlock();
+        // a chunk referenced from more than one file only needs checking once
+        if (!ChunksMap.Insert ({Chunk.ChunkIdx, Chunk.Ref->No}, 1))
+            continue;
+
+        // blocks a delta chunk is encoded against are checked through it
+        // a quick test needs checksums for all of them, else the chunk is checked in full
+        // (a link shared with other chunks only has its checksum checked once)
+        bool Quick = O.QuickTest && Chunk.Sum;
+        vector <ChunkInfo> NewLinks;
+        for (auto &Link : Chunk.Delta) {
+            if (DeltaMap.Insert ({Link.ChunkIdx, Link.Ref->No}, 1))
+                NewLinks.push_back (Link);
+            Quick &= Link.Sum != 0;
+        }
 
         function <void()> Task = [=,this]() {
-            // grab the chunk
-            string ChunkData;
-            ChunkBlocks->SlurpBlock (Chunk.ChunkIdx, ChunkData);
-
-            // handle decompress
-            string *SelData = &ChunkData;
-            string DeCompressed;
-            if (Chunk.CompFlag != CompFlagUnComp) {
-                Comp::DeCompress (Chunk.CompFlag, ChunkData, DeCompressed);
-                SelData = &DeCompressed;
+            if (Quick) {
+                TestSum (Chunk);
+                for (auto &Link : NewLinks)
+                    TestSum (Link);
+                return;
             }
+            if (O.QuickTest)
+                SumsMissing ++;
+
+            // grab the chunk
+            BufRef ChunkData;
+            ChunkReader.Read (Chunk, ChunkBlocks, ChunkData);
 
             // check hash
-            string ChunkDataHash = HashStr (O.HashType, *SelData);
+            string ChunkDataHash = HashStr (O.HashType, ChunkData);
             if (ChunkDataHash != Chunk.Hash)
-                WARN ("Hash mismatch on data chunk #%ld\n", Chunk.ChunkIdx);
+                WARN ("Hash mismatch on data chunk #%ld of %s\n", Chunk.ChunkIdx, Chunk.Ref->Name.c_str());
         };
         ThreadPool.Execute (Task);
     }
     delete AF;
 }
 
-void ArchiveRead::DoTest () {
-    // test all files in the archive
+// the stored bytes of a block are as they were written
+void ArchiveRead::TestSum (const ChunkInfo &Chunk) {
+    BufRef Stored;
+    Chunk.Ref->ChunkBlocks->SlurpBlock (Chunk.ChunkIdx, Stored);
+    SumsChecked ++;
+    if (StoredSum (Stored) != Chunk.Sum)
+        WARN ("Checksum mismatch on stored chunk #%ld of %s\n", Chunk.ChunkIdx, Chunk.Ref->Name.c_str());
+}
+
+// a scope of paths, without any that are inside another
+// (sorted, so a directory comes before what's in it)
+static vecstr TrimScope (vecstr Scope) {
+    sort (Scope.begin(), Scope.end());
+    vecstr Trimmed;
+    for (auto &Path : Scope) {
+        bool Inside = false;
+        for (auto &Kept : Trimmed)
+            Inside |= InSubtree (Path, Kept);
+        if (!Inside)
+            Trimmed.push_back (Path);
+    }
+    return Trimmed;
+}
+
+static bool InScope (const string &Name, const vecstr &Scope) {
+    for (auto &Path : Scope)
+        if (InSubtree (Name, Path))
+            return true;
+    return false;
+}
+
+void ArchiveRead::DoTest (const vecstr &Scope) {
+    // test all files in the archive, or those in scope
     // record all used finfo and chunk blocks
-    map <i64, bool> UsedFInfosMap   , UsedChunksMap   ;
-    mutex           UsedFInfosMapMtx, UsedChunksMapMtx;
+    // and work out the tree again from what's tested, if there's one to check against
+    // (archives from before the tree have nothing)
+    vecstr Paths = TrimScope (Scope.size() ? Scope : vecstr {"/"});
+    MerkleBuilder *Tested = NULL;
+    if (fs::exists (TreePath)) {
+        Tested = new MerkleBuilder (O.HashType, (fs::temp_directory_path() / ("PhatBak_Tree_" + to_string (getpid()))).string());
+        Tested->SetLimit (((u64) O.MemBudgetMiB << 20) / 4);
+    }
+    ConcMap <BlockKey, bool, BlockKeyHash> UsedFInfosMap, UsedChunksMap, UsedDeltaMap;
     string Line;
     u64 LineCount = 0;
-    while (getline (ListFile, Line)) {
+    while (ListFile.GetLine (Line)) {
         LineCount ++;
+        if (!InScope (Line.substr (0, Line.find (ListRecSep)), Paths))
+            continue;
         function <void()> Task = [&,this,Line,LineCount]() {
-            DoTestJob (Line, LineCount, UsedFInfosMap, UsedChunksMap, UsedFInfosMapMtx, UsedChunksMapMtx);
+            DoTestJob (Line, LineCount, UsedFInfosMap, UsedChunksMap, UsedDeltaMap, Tested);
         };
         ThreadPool.Execute (Task);
     }
     ThreadPool.WaitIdle();
 
+    if (O.QuickTest)
+        printf ("Quick test: %lu blocks checked against their checksums, %lu chunks without one checked in full\n"
+               ,SumsChecked.load(), SumsMissing.load());
+
+    // the tree hashes in scope must be what was stored
+    if (Tested) {
+        MerkleTree Tree (TreePath);
+        MerkleTree::Entry E;
+        u64 Nodes = 0, Stored = 0;
+        Tested->Finish ();
+        Tested->ForEach ([&](const string &Path, const string &Hash) {
+            if (!InScope (Path, Paths))
+                return;
+            Nodes ++;
+            if (!Tree.Find (Path, E)) {
+                WARN ("%s is missing from %s\n", Path.c_str(), TreePath.c_str());
+            } else if (E.Hash != Hash) {
+                WARN ("Tree hash mismatch on %s\n", Path.c_str());
+            }
+        });
+        for (auto &Path : Paths) {
+            Stored += Tree.Find (Path, E);
+            string End = SubtreeEnd (Path);
+            for (size_t Off = Tree.Below (Path); Tree.At (Off, E) && E.Path < End; Off = E.Next)
+                Stored ++;
+        }
+        if (Stored != Nodes)
+            WARN ("%s has %lu entries in scope, the list has %lu\n", TreePath.c_str(), Stored, Nodes);
+        delete Tested;
+    }
+
+    // blocks belong to files out of scope too
+    if (Scope.size())
+        return;
+
     // find existing block files
-    map <i64, bool> FoundFInfosMap   , FoundChunksMap   ;
-    mutex           FoundFInfosMapMtx, FoundChunksMapMtx;
-    FindBlockFiles (FinfoDirPath, FinfoDirPath, FoundFInfosMap, FoundFInfosMapMtx);
-    FindBlockFiles (ChunkDirPath, ChunkDirPath, FoundChunksMap, FoundChunksMapMtx);
+    ConcMap <i64, bool> FoundFInfosMap, FoundChunksMap;
+    FindBlockFiles (FinfoDirPath, FinfoDirPath, FoundFInfosMap);
+    FindBlockFiles (ChunkDirPath, ChunkDirPath, FoundChunksMap);
     ThreadPool.WaitIdle();
 
     // make sure all finfo and chunk blocks are used
-    for (auto Itr : FoundFInfosMap)
-        if (!UsedFInfosMap.count(Itr.first))
-            ERROR ("Unused FInfo block found: %ld\n", Itr.first);
-    for (auto Itr : FoundChunksMap)
-        if (!UsedChunksMap.count(Itr.first))
-            ERROR ("Unused Chunk block found: %ld\n", Itr.first);
+    FoundFInfosMap.ForEach ([&](const i64 &Idx, bool &Found) {
+        if (!UsedFInfosMap.Contains ({Idx, 0}))
+            ERROR ("Unused FInfo block found: %ld\n", Idx);
+    });
+    FoundChunksMap.ForEach ([&](const i64 &Idx, bool &Found) {
+        if (!UsedChunksMap.Contains ({Idx, 0}) && !UsedDeltaMap.Contains ({Idx, 0}))
+            ERROR ("Unused Chunk block found: %ld\n", Idx);
+    });
 }
 
 void ArchiveRead::DoCompareJob (const FileListEntry &ListEntry) {
@@ -376,31 +571,30 @@ void ArchiveRead::DoCompareJob (const FileListEntry &ListEntry) {
 
             // open the live file for reading data
             LF->OpenRead();
+            if (AF->ListEntry.Inline.size()) {
+                string LFData;
+                LF->ReadChunk (LFData, AF->ListEntry.Inline.size());
+                if (LFData != AF->ListEntry.Inline)
+                    WARN ("Contents of archived file don't match: %s\n", ListEntry.Name.c_str());
+            }
             for (auto Chunk : AF->Chunks) { 
                 // grab the chunk
-                string ChunkData;
-                ChunkBlocks->SlurpBlock (Chunk.ChunkIdx, ChunkData);
-
-                // handle decompress
-                string *SelData = &ChunkData;
-                string DeCompressed;
-                if (Chunk.CompFlag != CompFlagUnComp) {
-                    Comp::DeCompress (Chunk.CompFlag, ChunkData, DeCompressed);
-                    SelData = &DeCompressed;
-                }
+                BufRef ChunkData;
+                ChunkReader.Read (Chunk, ChunkBlocks, ChunkData);
 
                 // check hash
-                string ChunkDataHash = HashStr (O.HashType, *SelData);
+                string ChunkDataHash = HashStr (O.HashType, ChunkData);
                 if (ChunkDataHash != Chunk.Hash)
                     WARN ("Hash mismatch on data chunk #%ld\n", Chunk.ChunkIdx);
 
                 // compare data
-                string LFChunkData;
-                if (!LF->ReadChunk (LFChunkData)) {
+                // chunks may vary in size, so read just as much as was archived
+                BufRef LFChunkData;
+                if (!LF->ReadChunk (LFChunkData, ChunkData.Size())) {
                     WARN ("Unexpected end of read data from: %s\n", ListEntry.Name.c_str());
                     break;
                 }
-                if (*SelData != LFChunkData) {
+                if (ChunkData != LFChunkData) {
                     WARN ("Contents of archived file don't match: %s\n", ListEntry.Name.c_str());
                     break;
                 }
@@ -425,7 +619,7 @@ void ArchiveRead::DoCompare () {
     // compare all files in the archive
     string Line;
     u64 LineCount = 0;
-    while (getline (ListFile, Line)) {
+    while (ListFile.GetLine (Line)) {
         LineCount ++;
         FileListEntry ListEntry = ParseListLine (Line, LineCount);
 
@@ -449,26 +643,439 @@ void ArchiveRead::DoCompare () {
     ThreadPool.WaitIdle();
 }
 
+// walks two trees together, looking only into directories whose hashes differ
+class TreeDiff {
+    public:
+    const MerkleTree &A, &B;
+    u64 Added    = 0;
+    u64 Removed  = 0;
+    u64 Modified = 0;
+
+    TreeDiff (const MerkleTree &a, const MerkleTree &b) : A (a), B (b) {}
+
+    // an entry and everything below it, all added or all removed
+    void Whole (const MerkleTree &T, const string &Path, char Sign, u64 &Count) {
+        MerkleTree::Entry E;
+        if (T.Find (Path, E)) {
+            printf ("%c %s\n", Sign, Path.c_str());
+            Count ++;
+        }
+        string End = SubtreeEnd (Path);
+        for (size_t Off = T.Below (Path); T.At (Off, E) && E.Path < End; Off = E.Next) {
+            printf ("%c %s\n", Sign, E.Path.c_str());
+            Count ++;
+        }
+    }
+
+    // the entries directly in a directory, jumping over whatever is deeper
+    vector <MerkleTree::Entry> Children (const MerkleTree &T, const string &Path) {
+        vector <MerkleTree::Entry> Found;
+        string Begin = SubtreeBegin (Path);
+        string End   = SubtreeEnd   (Path);
+        MerkleTree::Entry E;
+        size_t Off = T.Below (Path);
+        while (T.At (Off, E) && E.Path < End) {
+            size_t Slash = E.Path.find ('/', Begin.size());
+            if (Slash == string::npos) {
+                Found.push_back (E);
+                Off = E.Next;
+            } else {
+                Off = T.Lower (SubtreeEnd (E.Path.substr (0, Slash)));
+            }
+        }
+        return Found;
+    }
+
+    void Node (const string &Path) {
+        MerkleTree::Entry EA, EB;
+        bool InA = A.Find (Path, EA);
+        bool InB = B.Find (Path, EB);
+        if (!InA && !InB)
+            return;
+        if (!InB || !InA) {
+            Whole (InA ? A : B, Path, InA ? '-' : '+', InA ? Removed : Added);
+            return;
+        }
+        if (EA.Hash == EB.Hash)
+            return;
+
+        // a file that became a directory (or the other way round) is a whole new entry
+        bool Dir = EA.Own.size();
+        if (Dir != (EB.Own.size() != 0)) {
+            Whole (A, Path, '-', Removed);
+            Whole (B, Path, '+', Added);
+            return;
+        }
+        if (!Dir || EA.Own != EB.Own) {
+            printf ("M %s\n", Path.c_str());
+            Modified ++;
+        }
+        if (!Dir)
+            return;
+
+        // merge the entries of both, by name
+        auto CA = Children (A, Path);
+        auto CB = Children (B, Path);
+        size_t i = 0, j = 0;
+        while (i < CA.size() || j < CB.size()) {
+            if (j == CB.size() || (i < CA.size() && CA[i].Path < CB[j].Path))
+                Whole (A, CA[i++].Path, '-', Removed);
+            else if (i == CA.size() || CB[j].Path < CA[i].Path)
+                Whole (B, CB[j++].Path, '+', Added);
+            else {
+                if (CA[i].Hash != CB[j].Hash)
+                    Node (CA[i].Path);
+                i++;
+                j++;
+            }
+        }
+    }
+};
+
+// what changed from this archive to Other, in scope
+void ArchiveRead::DoDiff (ArchiveRead *Other, const vecstr &Scope) {
+    if (O.HashType != Other->O.HashType)
+        ERROR ("Archives %s and %s use different hash types\n", Name.c_str(), Other->Name.c_str());
+    for (auto Arch : {this, Other})
+        if (!fs::exists (Arch->TreePath))
+            ERROR ("%s doesn't exist (archive made before trees were kept)\n", Arch->TreePath.c_str());
+
+    MerkleTree From (TreePath);
+    MerkleTree To   (Other->TreePath);
+    TreeDiff   Diff (From, To);
+    for (auto &Path : TrimScope (Scope.size() ? Scope : vecstr {"/"}))
+        Diff.Node (Path);
+
+    printf ("%lu added, %lu removed, %lu modified (%lu tree lines read)\n"
+           ,Diff.Added, Diff.Removed, Diff.Modified, From.Reads + To.Reads);
+}
+
+// spreads the reads of recompress over time, at most Rate MiB/s (0 for no limit)
+class RateLimit {
+    mutex Mtx;
+    u64   Rate;  // bytes per second
+    u64   Next;  // time (ns) when the bytes taken so far have been paid for
+
+    public:
+    RateLimit (u64 MiBs) : Rate (MiBs << 20), Next (0) {}
+
+    void Take (u64 Bytes) {
+        if (!Rate)
+            return;
+        u64 Now = TimeNowNs ();
+        Mtx.lock();
+        Next = max (Next, Now) + Bytes * 1000000000 / Rate;
+        u64 Until = Next;
+        Mtx.unlock();
+        this_thread::sleep_for (chrono::nanoseconds (Until - Now));
+    }
+};
+
+static nlink_t LinkCount (const string &Path) {
+    struct stat Stats;
+    if (stat (Path.c_str(), &Stats))
+        THROW_PBEXCEPTION_IO ("Can't stat %s", Path.c_str());
+    return Stats.st_nlink;
+}
+
+// true if an archive was made referring to blocks of others by name
+static bool UsesBlockRefs (const string &ArchDir) {
+    string OptionsPath = ArchDir + "/Options";
+    if (!fs::exists (OptionsPath))
+        return false;
+    fstream OptsFile = OpenReadStream (OptionsPath);
+    string OptLine;
+    bool Res = false;
+    while (getline (OptsFile, OptLine)) {
+        vecstr Toks = SplitStr (OptLine, "=");
+        if (Toks.size() == 2 && TrimStr (Toks[0]) == "BlockRefs")
+            Res |= stoull (TrimStr (Toks[1]));
+    }
+    return Res;
+}
+
+// delete block files no entry of the list uses
+static u64 RemoveUnused (BlockList *Blocks, ConcMap <i64, RecompRec> &UsedMap) {
+    ConcMap <i64, bool> FoundMap;
+    FindBlockFiles (Blocks->TopDir, Blocks->TopDir, FoundMap);
+    ThreadPool.WaitIdle();
+
+    u64 Count = 0;
+    FoundMap.ForEach ([&](const i64 &Idx, bool &Found) {
+        if (!UsedMap.Contains (Idx)) {
+            fs::remove (Blocks->Idx2FileName (Idx));
+            Count ++;
+        }
+    });
+    return Count;
+}
+
+// put the new block of an entry into its list line
+static string ReplaceListFInfo (const string &Line, const FileListEntry &Entry, const RecompRec &Rec) {
+    size_t Begin = Line.find (ListRecSep) + strlen (ListRecSep);
+    size_t End   = min (Line.find (ListRecSep, Begin), Line.size());
+    string Old   = string (" ") + Entry.CompFlag + ">" + to_string (Entry.FInfoIdx);
+    for (size_t Pos = Line.find (Old, Begin); Pos < End; Pos = Line.find (Old, Pos + 1)) {
+        size_t After = Pos + Old.size();
+        if (After == End || Line[After] == ' ')
+            return Line.substr (0, Pos) + " " + Rec.NewFlag + ">" + to_string (Rec.NewIdx) + Line.substr (After);
+    }
+    THROW_PBEXCEPTION_FMT ("Can't find FInfo block in line %llu of %s", Entry.LineNo, Line.c_str());
+}
+
+// find the finfo blocks of this archive and the chunks they use
+void ArchiveRead::DoRecompressScan (const string ListLine, u64 LineCount
+                                   ,ConcMap <i64, RecompRec> &FInfosMap, ConcMap <i64, RecompRec> &ChunksMap
+                                   ) {
+    FileListEntry ListEntry = ParseListLine (ListLine, LineCount);
+    if (ListEntry.FInfoIdx < 0 || GetRef (ListEntry.RefArch) != &Self)
+        return;
+
+    if (!FInfosMap.Insert (ListEntry.FInfoIdx, {ListEntry.CompFlag, ListEntry.CompFlag, -1, 0}))
+        return; // hard link to a file already seen
+
+    ArchFileRead AF (this, ListEntry);
+    for (auto &Chunk : AF.Chunks) {
+        if (Chunk.Ref == &Self)
+            ChunksMap.Insert (Chunk.ChunkIdx, {Chunk.CompFlag, Chunk.CompFlag, -1, 0});
+        for (auto &Link : Chunk.Delta)
+            if (Link.Ref == &Self)
+                ChunksMap.Insert (Link.ChunkIdx, {Link.CompFlag, Link.CompFlag, -1, 0});
+    }
+}
+
+// compress the blocks an archive holds uncompressed (create --DeferComp)
+// replacements go to new block files, so a crash before the new list is in place loses nothing
+// blocks hard-linked from other archives are left alone, they'd no longer be shared
+void ArchiveRead::DoRecompress () {
+    if (O.CompType == CompType_NONE)
+        ERROR ("Recompress needs a CompType\n");
+
+    // blocks referred to by name don't show in the link counts
+    vecstr SubDirs, SubFiles;
+    SlurpDir (Repo->Name, SubDirs, SubFiles);
+    for (auto &SubDir : SubDirs)
+        if (SubDir != Name && UsesBlockRefs (Repo->Name + "/" + SubDir))
+            ERROR ("Can't recompress %s, archive %s may refer to its blocks (BlockRefs)\n", Name.c_str(), SubDir.c_str());
+
+    fstream Log (LogPath.c_str(), fstream::out | fstream::app);
+    Log << "Recompress Started At: " << NsToText (TimeNowNs ()) << endl;
+
+    // find every block the list uses
+    ConcMap <i64, RecompRec> FInfosMap, ChunksMap;
+    string Line;
+    u64 LineCount = 0;
+    while (ListFile.GetLine (Line)) {
+        LineCount ++;
+        function <void()> Task = [&,this,Line,LineCount]() {
+            DoRecompressScan (Line, LineCount, FInfosMap, ChunksMap);
+        };
+        ThreadPool.Execute (Task);
+    }
+    ThreadPool.WaitIdle();
+
+    // an earlier run that didn't finish left blocks the list doesn't use:
+    // its new blocks if it stopped before replacing the list, else the old ones
+    string MarkPath = ExtraDirPath + "/Recompress";
+    if (fs::exists (MarkPath)) {
+        u64 Strays = RemoveUnused (FInfoBlocks, FInfosMap) + RemoveUnused (ChunkBlocks, ChunksMap);
+        Log << "Recompress Cleanup: " << Strays << " blocks left by an unfinished run removed\n";
+    }
+
+    // new blocks go above all existing ones
+    FInfoBlocks->ReverseAlloc();
+    ChunkBlocks->ReverseAlloc();
+    ThreadPool.WaitIdle();
+    Touch (MarkPath);
+
+    // compress raw chunks
+    RateLimit    Rate (O.RecompRate);
+    atomic <u64> RawChunks (0), NewChunks (0), SharedChunks (0), RawBytes (0), NewBytes (0);
+    ChunksMap.ForEach ([&](const i64 &Idx, RecompRec &Rec) {
+        if (Rec.Flag != CompFlagUnComp)
+            return;
+        RecompRec *R = &Rec;
+        function <void()> Task = [&,this,Idx,R]() {
+            RawChunks ++;
+            if (LinkCount (ChunkBlocks->Idx2FileName (Idx)) > 1) {
+                SharedChunks ++;
+                return;
+            }
+
+            BufRef Raw;
+            ChunkBlocks->SlurpBlock (Idx, Raw);
+            Rate.Take (Raw.Size());
+            RawBytes += Raw.Size();
+            if (O.CompProbe && !Comp::Compressible (Raw.Data(), Raw.Size())) {
+                NewBytes += Raw.Size();
+                return;
+            }
+
+            BufRef Packed;
+            Comp::Compress (Raw, Packed);
+            if (Packed.Size() >= Raw.Size()) {
+                NewBytes += Raw.Size();
+                return;
+            }
+            R->NewFlag = Comp::CompType2CompFlag (O.CompType);
+            R->NewSum  = StoredSum (Packed);
+            R->NewIdx  = ChunkBlocks->SpitNewBlock (Packed);
+            NewBytes  += Packed.Size();
+            NewChunks ++;
+        };
+        ThreadPool.Execute (Task);
+    });
+    ThreadPool.WaitIdle();
+
+    // rewrite finfos that are raw or name a new chunk
+    atomic <u64> NewFInfos (0);
+    FInfosMap.ForEach ([&](const i64 &Idx, RecompRec &Rec) {
+        RecompRec *R = &Rec;
+        function <void()> Task = [&,this,Idx,R]() {
+            FileListEntry Entry;
+            Entry.FInfoIdx = Idx;
+            Entry.CompFlag = R->Flag;
+            ArchFileRead AF (this, Entry);
+
+            // blocks of delta chains may have been replaced too
+            string FInfo;
+            bool   Changed = false;
+            auto   NewBlock = [&](ChunkInfo &Block) {
+                RecompRec *ChunkRec = Block.Ref == &Self ? ChunksMap.Find (Block.ChunkIdx) : NULL;
+                if (ChunkRec && ChunkRec->NewIdx >= 0) {
+                    Block.CompFlag = ChunkRec->NewFlag;
+                    Block.ChunkIdx = ChunkRec->NewIdx;
+                    Block.Sum      = ChunkRec->NewSum;
+                    Changed        = true;
+                }
+                if (Block.Ref == &Self)
+                    Block.Ref = NULL;
+            };
+            for (auto &Chunk : AF.Chunks) {
+                NewBlock (Chunk);
+                for (auto &Link : Chunk.Delta)
+                    NewBlock (Link);
+                FInfo += FInfoLine (Chunk.CompFlag, Chunk.ChunkIdx, Chunk.Ref, Chunk.Sum, Chunk.Hash, Chunk.Delta);
+            }
+            if (!Changed && (R->Flag != CompFlagUnComp || LinkCount (FInfoBlocks->Idx2FileName (Idx)) > 1))
+                return;
+
+            string Packed;
+            Comp::Compress (FInfo, Packed);
+            if (Packed.size() < FInfo.size()) {
+                R->NewFlag = Comp::CompType2CompFlag (O.CompType);
+                R->NewIdx  = FInfoBlocks->SpitNewBlock (Packed);
+            } else {
+                R->NewFlag = CompFlagUnComp;
+                R->NewIdx  = FInfoBlocks->SpitNewBlock (FInfo);
+            }
+            NewFInfos ++;
+        };
+        ThreadPool.Execute (Task);
+    });
+    ThreadPool.WaitIdle();
+
+    // write the list naming the new finfos
+    string NewListPath = ListPath + ".new";
+    ListStream NewList;
+    NewList.OpenWrite (NewListPath, O.ListFrame, O.CompLevel);
+    ListFile.Rewind();
+    LineCount = 0;
+    while (ListFile.GetLine (Line)) {
+        LineCount ++;
+        FileListEntry Entry = ParseListLine (Line, LineCount);
+        RecompRec *Rec = Entry.FInfoIdx >= 0 && GetRef (Entry.RefArch) == &Self ? FInfosMap.Find (Entry.FInfoIdx) : NULL;
+        if (Rec && Rec->NewIdx >= 0)
+            Line = ReplaceListFInfo (Line, Entry, *Rec);
+        NewList.Write (Line + "\n");
+    }
+    NewList.Close();
+
+    // new blocks must be on disk before the list points to them
+    // and the list must be before the blocks it no longer uses go
+    int ArchFd = open (ArchDirPath.c_str(), O_RDONLY);
+    syncfs (ArchFd);
+    fs::rename (NewListPath, ListPath);
+    syncfs (ArchFd);
+    close (ArchFd);
+
+    // drop the replaced blocks
+    FInfosMap.ForEach ([&](const i64 &Idx, RecompRec &Rec) {
+        if (Rec.NewIdx >= 0)
+            fs::remove (FInfoBlocks->Idx2FileName (Idx));
+    });
+    ChunksMap.ForEach ([&](const i64 &Idx, RecompRec &Rec) {
+        if (Rec.NewIdx >= 0)
+            fs::remove (ChunkBlocks->Idx2FileName (Idx));
+    });
+    fs::remove (MarkPath);
+
+    Log << "Recompress: " << NewChunks << " of " << RawChunks << " raw chunks compressed ("
+        << RawBytes << " bytes to " << NewBytes << "), " << SharedChunks << " left raw as other archives share them, "
+        << NewFInfos << " FInfo blocks rewritten\n";
+    Log << "Recompress Ended At: " << NsToText (TimeNowNs ()) << endl;
+    Log.close();
+}
+
 //////////////////////////////////////////////////////////////////////
 ArchiveBase::ArchiveBase (RepoInfo *repo, const string &name) : ArchiveRead (repo, name) {
     // create a list of files with first-order info
     string Line;
-    u64 LineCount = 0;
-    while (getline (ListFile, Line)) {
+    u64  LineCount = 0;
+    bool Inserted;
+    while (ListFile.GetLine (Line)) {
         LineCount ++;
         FileListEntry FLE = ParseListLine (Line, LineCount);
-        FileMap [FLE.Name] = FLE;
+        FileListEntry *Entry = FileMap.Insert (FLE.Name, FLE, Inserted);
+
+        // index regular files by size and mtime to find them again after a move
+        if (::O.DetectMoves && S_ISREG (FLE.Stats.st_mode) && FLE.Stats.st_size > 0 && FLE.FInfoIdx >= 0) {
+            SizeTime Key = {(u64) FLE.Stats.st_size, TimeSpecToNs (FLE.Stats.st_mtim)};
+            vector <const FileListEntry*> *Cands = MoveMap.Find (Key);
+            if (!Cands)
+                Cands = MoveMap.Insert (Key, {}, Inserted);
+            Cands->push_back (Entry);
+        }
     }
 }
 
+// base file that the live file was probably moved from, NULL if none
+// Sure is set when the inode also matches, so contents don't need checking
+const FileListEntry *ArchiveBase::FindMoved (const LiveFile *LF, bool &Sure) {
+    Sure = false;
+    vector <const FileListEntry*> *Cands = MoveMap.Find ({(u64) LF->Size(), TimeSpecToNs (LF->Stats.st_mtim)});
+    if (!Cands)
+        return NULL;
+
+    string Dir, Leaf;
+    SplitFileName (LF->Name, Dir, Leaf);
+    const FileListEntry *SameLeaf = NULL;
+    for (auto Cand : *Cands) {
+        if (Cand->Stats.st_ino && Cand->Stats.st_ino == LF->Stats.st_ino) {
+            Sure = true;
+            return Cand;
+        }
+        string CandDir, CandLeaf;
+        SplitFileName (Cand->Name, CandDir, CandLeaf);
+        if (!SameLeaf && CandLeaf == Leaf)
+            SameLeaf = Cand;
+    }
+    // the same name in another directory can hold other data (a/Makefile, b/Makefile)
+    // so it's only the likeliest candidate, its contents are still compared
+    return SameLeaf ? SameLeaf : (*Cands)[0];
+}
+
 ArchiveBase::~ArchiveBase () {
 }
 
 //////////////////////////////////////////////////////////////////////
-ArchiveCreate::ArchiveCreate (RepoInfo *repo, const string &name, ArchiveBase *base) : Archive (repo, name) {
+ArchiveCreate::ArchiveCreate (RepoInfo *repo, const string &name, ArchiveBase *base) : Archive (repo, name), Tree (O.HashType, TreePath) {
     DBGCTOR;
     ZeroLenIdx = -1;
     ArchBase    = base;
+    Dedup       = NULL;
+    Dict        = NULL;
+    Levels      = NULL;
 
     // create archive dir
     if (fs::exists (ArchDirPath))
@@ -481,6 +1088,11 @@ ArchiveCreate::ArchiveCreate (RepoInfo *repo, const string &name, ArchiveBase *b
     // create the log file
     LogFile = OpenWriteStream (LogPath);
     LogFile << "Backup Started At: " << O.StartTimeTxt << endl;
+    LogFile << "Hash: " << HashNames[O.HashType] << " (" << HashImplName (O.HashType) << ")\n";
+
+    // no --InlineSize and no base to take it from
+    if (O.InlineSize == Opts::InlineUnset)
+        O.InlineSize = 0;
 
     // create Options file
     O.ArchDirName = Name;
@@ -488,15 +1100,26 @@ ArchiveCreate::ArchiveCreate (RepoInfo *repo, const string &name, ArchiveBase *b
         O.BaseArchive = ArchBase->ArchDirPath;
     fstream OptFile = OpenWriteStream (OptionsPath);
     O.Print (OptFile);
+    // once any file shares a chunk block, archives linking it keep sharing it
+    OptFile << "   SharedChunks    = " << (O.Dedup || O.DetectMoves || (ArchBase && ArchBase->SharedChunks)) << endl;
     OptFile.close();
 
+    // blocks are stored raw, the options keep the type for a later recompress
+    if (O.DeferComp)
+        O.CompType = CompType_NONE;
+
     // create new archive subdirs
     CreateDir (FinfoDirPath);
     CreateDir (ChunkDirPath);
     CreateDir (ExtraDirPath);
 
+    // refer to base blocks by archive name, so names have to survive the list and finfo formats
+    if (O.BlockRefs && ArchBase && ArchBase->Name.find_first_of (" @") != string::npos)
+        THROW_PBEXCEPTION_FMT ("Base archive name (%s) can't be used with BlockRefs", ArchBase->Name.c_str());
+
     // if using a base arch, preload finfo and chunk allocators based on previous files
-    if (ArchBase) {
+    // (not needed with block references: base blocks are never linked into this archive)
+    if (ArchBase && !O.BlockRefs) {
         // initialize the finfo and chunk blocklist allocator based on base files
         FInfoBlocks->ReverseAlloc(ArchBase->FinfoDirPath);
         ChunkBlocks->ReverseAlloc(ArchBase->ChunkDirPath);
@@ -504,8 +1127,60 @@ ArchiveCreate::ArchiveCreate (RepoInfo *repo, const string &name, ArchiveBase *b
         ThreadPool.WaitIdle();
     }
 
+    // blocks linked or referenced from the base may need its dictionaries
+    if (ArchBase && fs::is_directory (ArchBase->ExtraDirPath)) {
+        vecstr SubDirs, SubFiles;
+        SlurpDir (ArchBase->ExtraDirPath, SubDirs, SubFiles);
+        for (auto &File : SubFiles)
+            if (File.substr (0, 4) == "Dict")
+                MakeHardLink (ArchBase->ExtraDirPath + "/" + File, ExtraDirPath + "/" + File);
+    }
+    if (O.DictBelow && O.CompType == CompType_ZTSD)
+        Dict = new DictTrainer (ExtraDirPath);
+    if (O.AdaptMax && O.CompType == CompType_ZTSD)
+        Levels = new LevelControl (O.AdaptMin, O.AdaptMax, O.CompLevel);
+    if (O.DeltaDepth && O.CompType != CompType_ZTSD) {
+        WARN ("Delta chunks need zstd compression, not using them\n");
+        O.DeltaDepth = 0;
+    }
+
+    // set up cross-file dedup
+    DedupKey Key;
+    if (O.Dedup && !DedupIndex::KeyOf (HashStr (O.HashType, ""), Key)) {
+        WARN ("Dedup needs a hash of at least 128 bits, not using it with %s\n", HashNames[O.HashType]);
+        O.Dedup = false;
+    }
+    if (O.Dedup) {
+        Dedup = new DedupIndex (ChunkBlocks->CountAllocated());
+        if (ArchBase)
+            LoadDedup ();
+    }
+
+    // a base block can only be freed when no other file could be using it
+    FreeBaseBlocks = !Dedup && !O.DetectMoves && !O.BlockRefs && !(ArchBase && ArchBase->SharedChunks);
+    MovedFiles     = 0;
+    MovedByContent = 0;
+    RefFiles       = 0;
+    InlineFiles    = 0;
+    ProbeSkips     = 0;
+    HistorySkips   = 0;
+    CompMisses     = 0;
+    DeltaTries     = 0;
+    DeltaChunks    = 0;
+    DeltaRaw       = 0;
+    DeltaStored    = 0;
+    ChunkMem.SetLimit ((u64) O.MemBudgetMiB << 20);
+
+    // the tree's entries may take a quarter of the budget, then they're sorted on disk
+    Tree.SetLimit (ChunkMem.GetLimit() / 4);
+
+    // idle pooled buffers need not outgrow what may be in flight
+    if (ChunkMem.GetLimit())
+        BufPool.SetKeep (ChunkMem.GetLimit());
+
     // prepare the file list for write
-    ListFile = OpenWriteStream (ListPath);
+    // (an uncompressed archive gets a plain text list)
+    ListFile.OpenWrite (ListPath, O.CompType != CompType_NONE ? O.ListFrame : 0, O.CompLevel);
 }
 
 ArchiveCreate::~ArchiveCreate () {
@@ -513,6 +1188,64 @@ ArchiveCreate::~ArchiveCreate () {
 
     ThreadPool.WaitIdle ();
 
+    // the last frame of the list goes out on close, before the archive is marked finished
+    ListFile.Close ();
+
+    // then the tree, which can't be worked out until every entry is in
+    Tree.Finish ();
+    Tree.Write (TreePath);
+    LogFile << "Tree: " << Tree.Size() << " entries, at most about " << (Tree.Bytes() >> 10) << " KiB held"
+            << (Tree.Spills() ? ", sorted on disk in " + to_string (Tree.Spills()) + " runs" : string ()) << "\n";
+
+    LogFile << "Chunk Memory: " << (ChunkMem.Peak >> 20) << " MiB peak in flight of "
+            << (ChunkMem.GetLimit() ? to_string (ChunkMem.GetLimit() >> 20) + " MiB budget" : string ("unlimited budget"))
+            << ", readers waited " << ChunkMem.Waits << " times\n";
+    LogFile << "Chunk Buffers: " << BufPool.Allocs << " allocated (" << (BufPool.Bytes >> 20) << " MiB), "
+            << BufPool.Reuses << " reused\n";
+    if (HashBatch.Batches || HashBatch.Alone)
+        LogFile << "Hash Batches: " << HashBatch.Batched << " chunks hashed in " << HashBatch.Batches
+                << " batches, " << HashBatch.Alone << " alone\n";
+
+    if (O.CompProbe && O.CompType != CompType_NONE)
+        LogFile << "Compression Probe: " << ProbeSkips << " chunks looked incompressible, "
+                << HistorySkips << " skipped after earlier chunks of their file, "
+                << CompMisses << " compressed for no gain\n";
+
+    if (O.DeltaDepth && ArchBase)
+        LogFile << "Delta Chunks: " << DeltaChunks << " of " << DeltaTries << " changed chunks stored against their base chunk ("
+                << DeltaRaw << " bytes in " << DeltaStored << "), " << ArchBase->ChunkReader.Misses
+                << " chain blocks decoded, " << ArchBase->ChunkReader.Hits << " reused\n";
+
+    if (Levels) {
+        LogFile << Levels->Summary();
+        delete Levels;
+    }
+
+    if (Dict) {
+        Dict->Finish ();
+        LogFile << "Dictionary: " << Dict->ID << " (" << Dict->Source << ") for blocks under " << O.DictBelow << " bytes\n";
+        delete Dict;
+    }
+
+    if (O.InlineSize)
+        LogFile << "Inline Files: " << InlineFiles << " files of up to " << O.InlineSize << " bytes kept in the List\n";
+
+    if (O.BlockRefs)
+        LogFile << "Referenced Files: " << RefFiles << " unchanged files use blocks of earlier archives\n";
+
+    if (O.DetectMoves)
+        LogFile << "Moved Files: " << MovedFiles << " (" << MovedByContent << " confirmed by contents)\n";
+
+    if (Dedup) {
+        u64 NewBytes = Dedup->TotalBytes - Dedup->HitBytes;
+        LogFile << "Dedup: " << Dedup->Hits << " of " << Dedup->Lookups << " chunks read were already stored ("
+                << Dedup->HitBytes << " of " << Dedup->TotalBytes << " bytes), "
+                << Dedup->BloomMisses << " new chunks rejected by the bloom filter\n";
+        LogFile.precision(2);
+        LogFile << "Dedup Ratio: " << fixed << (NewBytes ? (double) Dedup->TotalBytes / NewBytes : 1.0) << ":1\n";
+        delete Dedup;
+    }
+
     u64 EndTime = TimeNowNs ();
     string EndTimeStr = NsToText (EndTime);
 
@@ -528,6 +1261,25 @@ ArchiveCreate::~ArchiveCreate () {
     Touch (FinishedPath);
 }
 
+// add every chunk of the base archive to the dedup index
+void ArchiveCreate::LoadDedup () {
+    ConcMap <BlockKey, bool, BlockKeyHash> Seen;
+    ArchBase->FileMap.ForEach ([&](const string &Name, FileListEntry &Entry) {
+        if (Entry.FInfoIdx < 0 || !S_ISREG (Entry.Stats.st_mode) || !Seen.Insert ({Entry.FInfoIdx, ArchBase->GetRef (Entry.RefArch)->No}, 1))
+            return;
+        FileListEntry BaseEntry = Entry;
+        function <void()> Task = [=,this]() {
+            ArchFileRead BaseFile (ArchBase, BaseEntry);
+            for (auto &Chunk : BaseFile.Chunks)
+                if (Chunk.CompFlag != CompFlagDelta) // the index has no room for a delta chain
+                    Dedup->Add (Chunk.Hash, {Chunk.ChunkIdx, Chunk.CompFlag, true, Chunk.Ref, Chunk.Sum});
+        };
+        ThreadPool.Execute (Task);
+    });
+    ThreadPool.WaitIdle();
+    LogFile << "Dedup Index: " << Dedup->Size() << " chunks from base archive\n";
+}
+
 void ArchiveCreate::PushListEntry (const FileListEntry &ListEntry) {
     stringstream SListLine;
     SListLine <<                                  ListEntry.Name           << ListRecSep;
@@ -536,10 +1288,18 @@ void ArchiveCreate::PushListEntry (const FileListEntry &ListEntry) {
     SListLine << "gid>"   << hex <<               ListEntry.Stats.st_gid   << " ";
     SListLine << "size>"  << dec <<               ListEntry.Stats.st_size  << " "; // note: decimal
     SListLine << "mtime>" << hex << TimeSpecToNs (ListEntry.Stats.st_mtim)       ;
+    if (O.DetectMoves && S_ISREG (ListEntry.Stats.st_mode))
+        SListLine << " ino>" << hex << ListEntry.Stats.st_ino;
     if (ListEntry.Acl.size())
         SListLine << " acl>" << ListEntry.Acl;
     if (ListEntry.FInfoIdx != INT64_MIN)
         SListLine << " " << ListEntry.CompFlag << ">" << dec << ListEntry.FInfoIdx;
+    if (ListEntry.RefArch.size())
+        SListLine << " ref>" << ListEntry.RefArch;
+    if (ListEntry.Inline.size())
+        SListLine << " data>" << Base64Encode (ListEntry.Inline);
+    if (ListEntry.Digest.size())
+        SListLine << " dig>" << ListEntry.Digest;
     if (S_ISLNK(ListEntry.Stats.st_mode))
         SListLine << ListRecSep << "slink>" << ListEntry.LinkTarget;
     SListLine << endl;
@@ -548,9 +1308,11 @@ void ArchiveCreate::PushListEntry (const FileListEntry &ListEntry) {
     static mutex LocalMtx;
     LocalMtx.lock();
 
-    ListFile << SListLine.str();
+    ListFile.Write (SListLine.str());
 
     LocalMtx.unlock();
+
+    Tree.Add (ListEntry);
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -569,12 +1331,22 @@ ArchFileRead::ArchFileRead (ArchiveRead *arch, const FileListEntry &listentry) :
     Arch      = arch;
     ListEntry = listentry;
     Name      = ListEntry.Name;
+    Ref       = Arch->GetRef (ListEntry.RefArch);
+
+    // tiny file contents kept in the list are always handed out uncompressed
+    if (ListEntry.Inline.size() && ListEntry.CompFlag != CompFlagUnComp) {
+        string DeCompressed;
+        Comp::DeCompress (Comp::CompFlag2CompType (ListEntry.CompFlag, O), ListEntry.Inline, DeCompressed);
+        ListEntry.Inline   = DeCompressed;
+        ListEntry.CompFlag = CompFlagUnComp;
+    }
 
     // grab data block info
     if (ListEntry.FInfoIdx >= 0) {
         // extract information from the FInfo block
+        // which may be in an earlier archive
         string FInfoPacked;
-        Arch->FInfoBlocks->SlurpBlock (ListEntry.FInfoIdx, FInfoPacked);
+        Ref->FInfoBlocks->SlurpBlock (ListEntry.FInfoIdx, FInfoPacked);
 
         // decompress
         string *SelData = &FInfoPacked;
@@ -588,26 +1360,50 @@ ArchFileRead::ArchFileRead (ArchiveRead *arch, const FileListEntry &listentry) :
         stringstream ss (*SelData);
         string Line;
         while (getline (ss, Line)) {
-            if (  Line.size() < 3
-              || (Line[0] != CompFlagUnComp &&
-                  Line[0] != CompFlagComp
-                 )
-              ||  Line[1] != '-'
-               )
-                THROW_PBEXCEPTION_FMT ("Illegal FInfo format: %s", Line.c_str());
-            char RecType = Line[0];
-            Line.erase (0,2);
             vecstr Parts = SplitStr (Line, " ");
-            if (Parts.size() != 2)
+            if (Parts.size() < 2 || (Parts.size() > 2 && Parts[0][0] != CompFlagDelta))
                 THROW_PBEXCEPTION_FMT ("Illegal FInfo format: %s", Line.c_str());
-            Chunks.emplace_back (RecType,
-                                 stoull (Parts[0].c_str()),
-                                 Parts[1]);
 
+            // a delta chunk's chain follows the hash, nearest base first
+            Chunks.push_back (ParseFInfoBlock (Parts[0], Line));
+            Chunks.back().Hash = Parts[1];
+            for (unsigned i = 2; i < Parts.size(); i++)
+                Chunks.back().Delta.push_back (ParseFInfoBlock (Parts[i], Line));
         }
     }
 }
 
+// one block of an finfo line: flag-idx
+// the index may name the archive holding it: idx@archive
+// else it's in the same archive as the finfo
+// either may be followed by the checksum of the stored block: idx:sum
+ChunkInfo ArchFileRead::ParseFInfoBlock (const string &Token, const string &Line) {
+    // the checksum is after the last ":", archive names may have one too
+    string Block = Token;
+    u64    Sum   = 0;
+    size_t Colon = Token.rfind (':');
+    if (Colon != string::npos) {
+        string SumTxt = Token.substr (Colon+1);
+        if (SumTxt.empty() || SumTxt.size() > 16 || SumTxt.find_first_not_of ("0123456789abcdefABCDEF") != string::npos)
+            THROW_PBEXCEPTION_FMT ("Illegal FInfo checksum: %s", Line.c_str());
+        Block = Token.substr (0, Colon);
+        Sum   = stoull (SumTxt, NULL, 16);
+    }
+    if (  Block.size() < 3
+      || !(Comp::IsCompFlag (Block[0]) || Block[0] == CompFlagDelta)
+      ||  Block[1] != '-'
+       )
+        THROW_PBEXCEPTION_FMT ("Illegal FInfo format: %s", Line.c_str());
+
+    const RefArchive *ChunkRef = Ref;
+    size_t At = Block.find ('@');
+    if (At != string::npos)
+        ChunkRef = Arch->GetRef (Block.substr (At+1));
+    ChunkInfo Chunk (Block[0], stoull (Block.c_str() + 2), "", ChunkRef);
+    Chunk.Sum = Sum;
+    return Chunk;
+}
+
 ArchFileRead::~ArchFileRead () {
     DBGDTOR;
 }
@@ -618,6 +1414,8 @@ ArchFileCreate::ArchFileCreate (ArchiveCreate *arch, LiveFile *lf) : ArchFile (a
     Arch   = arch;
     LF     = lf;
     Name   = LF->Name;
+    CompChunks = 0;
+    RawChunks  = 0;
 }
 
 ArchFileCreate::~ArchFileCreate () {
@@ -625,47 +1423,140 @@ ArchFileCreate::~ArchFileCreate () {
         delete LF;
 }
 
-void ArchFileCreate::HashAndCompressJob (const string &ChunkData
-                                        ,const ChunkInfo *BaseChunkInfo, const BlockList *BaseChunkBlocks
+// a base chunk's delta chain is linked into this archive along with it (or referred to with BlockRefs)
+vector <ChunkInfo> ArchFileCreate::KeepDelta (const ChunkInfo &Chunk) {
+    vector <ChunkInfo> Delta;
+    for (auto &Link : Chunk.Delta) {
+        Delta.push_back (Link);
+        if (O.BlockRefs)
+            continue;
+        Arch->ChunkBlocks->Link (Link.ChunkIdx, Link.Ref->ChunkBlocks->TopDir);
+        Delta.back().Ref = NULL;
+    }
+    return Delta;
+}
+
+void ArchFileCreate::HashAndCompressJob (const BufRef &ChunkData
+                                        ,const map <string, const ChunkInfo*> *BaseChunks, const ChunkInfo *BaseChunk
+                                        ,const BlockList *BaseChunkBlocks
                                         ,HashAndCompressReturn *HACR) {
     // compute hash
-    Hash Hasher (O.HashType);
-    HACR->Hash = Hasher.HashStr(ChunkData);
+    HACR->Hash = HashStr (O.HashType, ChunkData);
+
+    // look for the same data already stored
+    // anywhere in either archive with dedup, else anywhere in the base file
+    ChunkRef Ref;
+    bool     Found = false;
+    const ChunkInfo *FoundBase = NULL; // the base chunk found by hash (not with dedup, which has no deltas)
+    if (Arch->Dedup) {
+        Found = Arch->Dedup->Find (HACR->Hash, ChunkData.Size(), Ref);
+        BaseChunkBlocks = Arch->ArchBase ? Arch->ArchBase->ChunkBlocks : NULL;
+    } else if (BaseChunks) {
+        auto Itr = BaseChunks->find (HACR->Hash);
+        if (Itr != BaseChunks->end()) {
+            Found        = true;
+            Ref.ChunkIdx = Itr->second->ChunkIdx;
+            Ref.CompFlag = Itr->second->CompFlag;
+            Ref.InBase   = true;
+            Ref.Ref      = Itr->second->Ref;
+            Ref.Sum      = Itr->second->Sum;
+            FoundBase    = Itr->second;
+        }
+    }
 
-    // compare to base hash
-    HACR->Keep = 0;
-    if (BaseChunkInfo && HACR->Hash == BaseChunkInfo->Hash) {
+    HACR->Keep = Found;
+    if (Found) {
         // keep cloned chunk
-        HACR->CompFlag = BaseChunkInfo->CompFlag;
-        HACR->BlockIdx = BaseChunkInfo->ChunkIdx;
-        HACR->Keep     = 1;
-
-        // link to base file
-        Arch->ChunkBlocks->Link (BaseChunkInfo->ChunkIdx, BaseChunkBlocks->TopDir);
+        HACR->CompFlag = Ref.CompFlag;
+        HACR->BlockIdx = Ref.ChunkIdx;
+        HACR->Sum      = FoundBase ? FoundBase->Sum : Ref.Sum;
+
+        // refer or link to base archive
+        if (Ref.InBase && O.BlockRefs)
+            HACR->Ref = Ref.Ref;
+        else if (Ref.InBase)
+            Arch->ChunkBlocks->Link (Ref.ChunkIdx, BaseChunkBlocks->TopDir);
+        if (FoundBase)
+            HACR->Delta = KeepDelta (*FoundBase);
     } else {
         // create fresh chunk
-
-        // need to free if marked allocated
-        if (BaseChunkInfo)
-            Arch->ChunkBlocks->Free (BaseChunkInfo->ChunkIdx);
+        const BufRef *SelChunk = &ChunkData;
+        HACR->CompFlag = CompFlagUnComp;
+        BufRef Compressed;
+
+        // a chunk changed in a few places is stored as a delta against the base file's chunk at the same place
+        // unless that makes the chain to decode too long
+        if (BaseChunk && O.DeltaDepth && BaseChunk->Delta.size() < O.DeltaDepth) {
+            BufRef Base;
+            Arch->ArchBase->ChunkReader.Read (*BaseChunk, BaseChunkBlocks, Base);
+            Comp::Compress_Delta (ChunkData, Base, Compressed, O.CompLevel);
+            Arch->DeltaTries ++;
+            if (Compressed.Size() * DeltaGain < ChunkData.Size()) {
+                SelChunk       = &Compressed;
+                HACR->CompFlag = CompFlagDelta;
+                HACR->Delta.push_back (*BaseChunk);
+                HACR->Delta.back().Delta.clear();
+                if (!O.BlockRefs) {
+                    Arch->ChunkBlocks->Link (BaseChunk->ChunkIdx, BaseChunk->Ref->ChunkBlocks->TopDir);
+                    HACR->Delta.back().Ref = NULL;
+                }
+                vector <ChunkInfo> Chain = KeepDelta (*BaseChunk);
+                HACR->Delta.insert (HACR->Delta.end(), Chain.begin(), Chain.end());
+                Arch->DeltaChunks ++;
+                Arch->DeltaRaw    += ChunkData.Size();
+                Arch->DeltaStored += Compressed.Size();
+            }
+        }
 
         // compress the chunk
         // if compression doesn't help, keep it uncompressed
-        const string *SelChunk = &ChunkData;
-        HACR->CompFlag = CompFlagUnComp;
-        string Compressed;
-        if (O.CompType != CompType_NONE) {
-            Comp::Compress (ChunkData, Compressed);
-            if (Compressed.size() < ChunkData.size()) {
-                SelChunk       = &Compressed;
-                HACR->CompFlag =  CompFlagComp;
+        if (HACR->CompFlag == CompFlagUnComp && O.CompType != CompType_NONE) {
+            // once the file's chunks agree, follow them without probing
+            // until then probe each chunk before compressing it
+            // (every ProbeRetry'th chunk of a raw file is probed anyway, in case its data changed)
+            bool TryComp = true;
+            if (O.CompProbe) {
+                if (RawChunks >= ProbeTrust && !CompChunks && RawChunks % ProbeRetry) {
+                    TryComp = false;
+                    Arch->HistorySkips ++;
+                } else if (!(CompChunks >= ProbeTrust && !RawChunks)
+                           && !Comp::Compressible (ChunkData.Data(), ChunkData.Size())) {
+                    TryComp = false;
+                    Arch->ProbeSkips ++;
+                }
+            }
+            if (TryComp) {
+                if (Arch->Dict)
+                    Arch->Dict->Sample (ChunkData.Data(), ChunkData.Size());
+                int Level = Arch->Levels ? Arch->Levels->Get() : O.CompLevel;
+                Comp::Compress (ChunkData, Compressed, Level);
+                if (Arch->Levels)
+                    Arch->Levels->Used (Level);
+                if (Compressed.Size() < ChunkData.Size()) {
+                    SelChunk       = &Compressed;
+                    HACR->CompFlag =  Comp::CompType2CompFlag (O.CompType);
+                } else {
+                    Arch->CompMisses ++;
+                }
             }
+            if (HACR->CompFlag != CompFlagUnComp)
+                CompChunks ++;
+            else
+                RawChunks ++;
         }
 
         // write the chunk to archive
+        HACR->Sum      = StoredSum (*SelChunk);
         HACR->BlockIdx = Arch->ChunkBlocks->SpitNewBlock (*SelChunk);
+        if (Arch->Dedup && HACR->CompFlag != CompFlagDelta)
+            Arch->Dedup->Add (HACR->Hash, {HACR->BlockIdx, HACR->CompFlag, false, NULL, HACR->Sum});
     }
 
+    // the chunk's share of the in-flight budget is free again
+    Arch->ChunkMem.Release (HACR->MemHeld);
+    if (Arch->Levels)
+        Arch->Levels->Done ();
+
     // notify the caller that hash and compress are complete
     HACR->BL.PostIdle();
 }
@@ -679,33 +1570,54 @@ void ArchFileCreate::Create (InodeInfo *Inode) {
     ListEntry.FInfoIdx   = INT64_MIN;
     ListEntry.LineNo     = 0;
 
+    // tiny regular files are kept in the list itself
+    bool Inline = LF->IsFile() && ListEntry.Stats.st_size > 0 && (u64) ListEntry.Stats.st_size <= O.InlineSize;
+    if (Inline)
+        CreateInline ();
+
     // for regular files, either create finfo and chunks or keep cloned base values
-    if (LF->IsFile() && ListEntry.Stats.st_size > 0) {
+    else if (LF->IsFile() && ListEntry.Stats.st_size > 0) {
         ArchiveBase   *BaseArchive = Arch->ArchBase;
         FileListEntry  BaseFileEntry;
         ArchFileRead  *BaseFile        = NULL;
         BlockList     *BaseChunkBlocks = NULL;
+        const RefArchive *BaseRef      = NULL;  // archive actually holding the base finfo
         bool           DoFileRead      = true;
+        bool           Referenced      = false; // unchanged file refers to the base blocks
+        bool           Moved           = false;
+        bool           SureMove        = false;
         if (BaseArchive) {
-            bool UseBase = false;
-            BaseArchive->FileMapMtx.lock();
-            if (BaseArchive->FileMap.count (Name)) {
-                BaseFileEntry = BaseArchive->FileMap[Name];
-                UseBase       = true;
-            }
-            BaseArchive->FileMapMtx.unlock();
-            if (!UseBase)
+            // fall back to a moved or renamed base file with the same size and mtime
+            const FileListEntry *Found = BaseArchive->FileMap.Find (Name);
+            if (!Found && O.DetectMoves && (Found = BaseArchive->FindMoved (LF, SureMove)))
+                Moved = true;
+            // a base kept in the list (or empty) has no finfo to keep or compare with
+            if (Found && Found->FInfoIdx >= 0) {
+                BaseFileEntry = *Found;
+            } else {
                 BaseArchive = NULL;
+                Moved       = false;
+            }
         }
         if (BaseArchive) {
             ListEntry.FInfoIdx = BaseFileEntry.FInfoIdx;
             ListEntry.CompFlag = BaseFileEntry.CompFlag;
-            BaseFile           = new ArchFileRead (BaseArchive, BaseFileEntry);
             BaseChunkBlocks    = BaseArchive->ChunkBlocks;
+            BaseRef            = BaseArchive->GetRef (BaseFileEntry.RefArch);
 
             // if the file stats aren't too different, we don't have to compare file contents
+            // a move only identified by size and mtime has its contents compared against the candidate
             DoFileRead =            ListEntry.Stats.st_size != BaseFileEntry.Stats.st_size
-                || !TimeSpecsEqual (ListEntry.Stats.st_mtim  , BaseFileEntry.Stats.st_mtim);
+                || !TimeSpecsEqual (ListEntry.Stats.st_mtim  , BaseFileEntry.Stats.st_mtim)
+                || (Moved && !SureMove);
+
+            // with block references, an unchanged file just points at the base finfo
+            // no need to read it or to touch this archive's block dirs at all
+            Referenced = O.BlockRefs && !DoFileRead && ListEntry.FInfoIdx >= 0
+                      && !(O.DetectMoves && !Arch->FInfoClaims.Insert ({ListEntry.FInfoIdx, BaseRef->No}, 1));
+            // (unless it's needed for the digest of a base without one)
+            if (!Referenced || BaseFileEntry.Digest.empty())
+                BaseFile = new ArchFileRead (BaseArchive, BaseFileEntry);
         }
 
         string FInfo;
@@ -714,8 +1626,25 @@ void ArchFileCreate::Create (InodeInfo *Inode) {
         if (DoFileRead) {
             // actually read data from live file
 
+            // base chunks by hash, so shifted data still matches
+            // (the dedup index already has every base chunk)
+            map <string, const ChunkInfo*> BaseChunks;
+            if (BaseFile && !Arch->Dedup)
+                for (auto &Chunk : BaseFile->Chunks)
+                    BaseChunks [Chunk.Hash] = &Chunk;
+
+            // the base file's chunks tell how well this file compresses
+            // (not if they were stored raw whatever their data)
+            if (BaseFile && !BaseArchive->RawByChoice)
+                for (auto &Chunk : BaseFile->Chunks)
+                    (Chunk.CompFlag == CompFlagUnComp ? RawChunks : CompChunks) ++;
+
             // async return values from hash and compress
             queue <HashAndCompressReturn *> Returns;
+            vector <i64>                    ChunkIdxs; // chunk blocks of the new finfo
+            vector <const RefArchive *>     ChunkRefs; // ... and their archives (BlockRefs)
+            vector <i64>                    DeltaIdxs; // blocks the delta chunks are encoded against
+            string                          ChunkHashes; // for the digest
             function <void(bool)> CheckReturns = [&](bool Wait) {
                 // process the job return vals
                 while (Returns.size()) {
@@ -727,74 +1656,137 @@ void ArchFileCreate::Create (InodeInfo *Inode) {
                     Return->BL.WaitIdle();
 
                     // add chunk to finfo
-                    FInfo += string("") +            Return->CompFlag
-                             + "-"      + to_string (Return->BlockIdx)
-                             + " "      +            Return->Hash
-                             + "\n";
+                    FInfo += FInfoLine (Return->CompFlag, Return->BlockIdx, Return->Ref, Return->Sum, Return->Hash, Return->Delta);
+                    for (auto &Link : Return->Delta)
+                        DeltaIdxs.push_back (Link.ChunkIdx);
 
-                    // remember if the finfo changes
-                    KeepBaseFinfo &= Return->Keep;
+                    ChunkIdxs.push_back (Return->BlockIdx);
+                    ChunkRefs.push_back (Return->Ref);
+                    ChunkHashes += Return->Hash + "\n";
 
                     delete Return;
                     Returns.pop();
                 }
             };
 
+            // chunk data in flight (with room for a compressed copy) is limited across all files
+            // so reserve a full chunk before reading, then give back what wasn't used
+            // chunks live in pooled buffers, so count what the buffers really hold
+            u64 Copies   = O.CompType != CompType_NONE ? 2 : 1;
+            u64 MaxHeld  = BufPool_t::ClassSize (BufPool_t::SizeClass (O.CDC ? O.ChunkMaxSize() : O.ChunkSize)) * Copies;
+
             // read chunk from live file
-            string ChunkData;
-            u32    ChunkIdx = 0;
+            // counting them to find the base chunk at the same place
+            BufRef ChunkData;
+            u64    NumChunks = 0;
             LF->OpenRead();
-            while (LF->ReadChunk (ChunkData)) {
+            while (1) {
+                Arch->ChunkMem.Acquire (MaxHeld);
+                if (!LF->ReadChunk (ChunkData)) {
+                    Arch->ChunkMem.Release (MaxHeld);
+                    break;
+                }
+                if (Arch->Levels)
+                    Arch->Levels->Read (ChunkData.Size());
                 HashAndCompressReturn *Return = new HashAndCompressReturn;
+                Return->MemHeld = min (ChunkData.Cap() * Copies, MaxHeld);
+                Arch->ChunkMem.Release (MaxHeld - Return->MemHeld);
                 Returns.push (Return);
 
-                ChunkInfo *BaseChunkInfo = BaseArchive && (ChunkIdx < BaseFile->Chunks.size()) ?
-                                           &BaseFile->Chunks[ChunkIdx] : NULL;
-
                 // read, compress, and test the data
-                function <void()> Task = [=,this]() {
-                    HashAndCompressJob (ChunkData, BaseChunkInfo, BaseChunkBlocks, Return);
-                };
+                // the job takes over the chunk data instead of copying it
+                const map <string, const ChunkInfo*> *Base = BaseChunks.size() ? &BaseChunks : NULL;
+                const ChunkInfo *BaseChunk = BaseFile && NumChunks < BaseFile->Chunks.size() ? &BaseFile->Chunks [NumChunks] : NULL;
+                NumChunks ++;
+                auto Task = new function <void()> ([=, this, Data = move (ChunkData)]() {
+                    HashAndCompressJob (Data, Base, BaseChunk, BaseChunkBlocks, Return);
+                });
                 ThreadPool.Execute (Task, 0);
 
                 // process any returns that are ready
                 CheckReturns (0);
-
-                ChunkIdx++;
             }
             LF->Close();
 
             // process the job return vals
             CheckReturns (1);
-
-            // done with base file
-            if (BaseFile)
-                delete BaseFile;
-        } else {
-            // just link the chunks to base archive
-            for (auto &ChunkInfo : BaseFile->Chunks)
-                Arch->ChunkBlocks->Link (ChunkInfo.ChunkIdx, BaseArchive->ChunkBlocks->TopDir);
+            ListEntry.Digest = ChunksDigest (O.HashType, ChunkHashes);
+
+            // the finfo only stays if it lists exactly the same chunks in the same order
+            // base chunks that are no longer used get freed
+            KeepBaseFinfo = BaseFile && ChunkIdxs.size() == BaseFile->Chunks.size();
+            map <i64, bool> Used;
+            for (auto Idx : DeltaIdxs)
+                Used [Idx] = 1;
+            for (unsigned i = 0; i < ChunkIdxs.size(); i++) {
+                Used [ChunkIdxs[i]] = 1;
+                if (KeepBaseFinfo && (ChunkIdxs[i] != BaseFile->Chunks[i].ChunkIdx
+                                      || (O.BlockRefs && ChunkRefs[i] != BaseFile->Chunks[i].Ref)))
+                    KeepBaseFinfo = false;
+            }
+            // (a base file may list a block more than once, it's only freed the first time)
+            if (BaseFile && Arch->FreeBaseBlocks)
+                for (auto &Chunk : BaseFile->Chunks)
+                    if (!Used.count (Chunk.ChunkIdx)) {
+                        Used [Chunk.ChunkIdx] = 1;
+                        Arch->ChunkBlocks->Free (Chunk.ChunkIdx);
+                    }
+        } else if (!Referenced) {
+            // just link the chunks to base archive (or refer to them)
+            for (auto &ChunkInfo : BaseFile->Chunks) {
+                if (!O.BlockRefs)
+                    Arch->ChunkBlocks->Link (ChunkInfo.ChunkIdx, BaseArchive->ChunkBlocks->TopDir);
+                FInfo += FInfoLine (ChunkInfo.CompFlag, ChunkInfo.ChunkIdx, O.BlockRefs ? ChunkInfo.Ref : NULL, ChunkInfo.Sum, ChunkInfo.Hash, KeepDelta (ChunkInfo));
+            }
             KeepBaseFinfo = true;
         }
 
-        if (KeepBaseFinfo) {
+        // unchanged contents, unchanged digest
+        if (!DoFileRead)
+            ListEntry.Digest = BaseFileEntry.Digest.size() ? BaseFileEntry.Digest : ChunksDigest (O.HashType, BaseFile->Chunks);
+
+        if (Moved && KeepBaseFinfo) {
+            Arch->MovedFiles ++;
+            if (!SureMove)
+                Arch->MovedByContent ++;
+        }
+
+        // with move detection, a base finfo can be wanted by more than one file (a moved copy and the original)
+        // only one may keep it or they'd be extracted as hard links - the others get their own copy
+        // (a referenced file has already claimed its finfo)
+        if (KeepBaseFinfo && !Referenced && O.DetectMoves && !Arch->FInfoClaims.Insert ({ListEntry.FInfoIdx, BaseRef->No}, 1))
+            KeepBaseFinfo = false;
+
+        // done with base file
+        if (BaseFile)
+            delete BaseFile;
+
+        if (KeepBaseFinfo && O.BlockRefs) {
+            // just refer to the archive holding the base finfo
+            ListEntry.RefArch = BaseRef->Name;
+            if (Referenced)
+                Arch->RefFiles ++;
+        } else if (KeepBaseFinfo) {
             // just link to base archive version
             if (ListEntry.FInfoIdx >= 0)
                 Arch->FInfoBlocks->Link (ListEntry.FInfoIdx, BaseArchive->FInfoBlocks->TopDir);
         } else {
             // create new FInfo block
-            if (ListEntry.FInfoIdx >= 0)
+            if (ListEntry.FInfoIdx >= 0 && Arch->FreeBaseBlocks)
                 Arch->FInfoBlocks->Free (ListEntry.FInfoIdx);
 
             // compress it
             // if compression doesn't help, keep it uncompressed
             string *SelFInfo   = &FInfo;
+            ListEntry.CompFlag = CompFlagUnComp;
             string Compressed;
             if (O.CompType != CompType_NONE) {
+                if (Arch->Dict)
+                    Arch->Dict->Sample (FInfo);
                 Comp::Compress (FInfo, Compressed);
                 if (Compressed.size() < FInfo.size()) {
                     SelFInfo           = &Compressed;
-                    ListEntry.CompFlag =  CompFlagComp;
+                    ListEntry.CompFlag =  Comp::CompType2CompFlag (O.CompType);
                 }
             }
 
@@ -804,7 +1796,8 @@ void ArchFileCreate::Create (InodeInfo *Inode) {
     }
 
     // use negative FInfoIdx to designate potentially hardlinked zero-size files (or pipes, etc)
-    if (LF->Stats.st_size == 0 && !LF->IsDir() && !LF->IsSLink()) {
+    // and files kept in the list
+    if ((LF->Stats.st_size == 0 && !LF->IsDir() && !LF->IsSLink()) || Inline) {
         Arch->ZeroLenIdxMtx.lock();
 
         ListEntry.FInfoIdx = --Arch->ZeroLenIdx;
@@ -840,6 +1833,55 @@ void ArchFileCreate::Create (InodeInfo *Inode) {
     delete this;
 }
 
+// keep the contents of a tiny file in the list instead of finfo and chunk blocks
+void ArchFileCreate::CreateInline () {
+    // an unchanged file keeps the copy in the base list
+    ArchiveBase         *BaseArchive = Arch->ArchBase;
+    const FileListEntry *Base        = BaseArchive ? BaseArchive->FileMap.Find (Name) : NULL;
+    if (   Base && Base->Inline.size()
+        && Base->Stats.st_size == ListEntry.Stats.st_size
+        && TimeSpecsEqual (Base->Stats.st_mtim, ListEntry.Stats.st_mtim)) {
+        ListEntry.Inline   = Base->Inline;
+        ListEntry.CompFlag = Base->CompFlag;
+        ListEntry.Digest   = Base->Digest.size() ? Base->Digest : InlineDigest (O.HashType, ArchFileRead (BaseArchive, *Base).ListEntry.Inline);
+    } else {
+        string Data;
+        LF->OpenRead();
+        LF->ReadChunk (Data, ListEntry.Stats.st_size);
+        LF->Close();
+
+        // compress it
+        // if compression doesn't help, keep it uncompressed
+        ListEntry.Inline   = Data;
+        ListEntry.CompFlag = CompFlagUnComp;
+        ListEntry.Digest   = InlineDigest (O.HashType, Data);
+        string Compressed;
+        if (O.CompType != CompType_NONE) {
+            if (Arch->Dict)
+                Arch->Dict->Sample (Data);
+            Comp::Compress (Data, Compressed);
+            if (Compressed.size() < Data.size()) {
+                ListEntry.Inline   = Compressed;
+                ListEntry.CompFlag = Comp::CompType2CompFlag (O.CompType);
+            }
+        }
+    }
+
+    // blocks of a base file that used to be bigger aren't needed anymore
+    if (Base && Base->FInfoIdx >= 0 && Arch->FreeBaseBlocks) {
+        ArchFileRead BaseFile (BaseArchive, *Base);
+        map <i64, bool> Freed;
+        for (auto &Chunk : BaseFile.Chunks)
+            if (!Freed.count (Chunk.ChunkIdx)) {
+                Freed [Chunk.ChunkIdx] = 1;
+                Arch->ChunkBlocks->Free (Chunk.ChunkIdx);
+            }
+        Arch->FInfoBlocks->Free (Base->FInfoIdx);
+    }
+
+    Arch->InlineFiles ++;
+}
+
 // link to previously archived file
 void ArchFileCreate::CreateLink (InodeInfo *First) {
     First->Mtx.lock();
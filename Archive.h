@@ -6,11 +6,20 @@
 #include "BlockList.h"
 #include "Types.h"
 #include "BusyLock.h"
+#include "ConcMap.h"
+#include "DedupIndex.h"
+#include "MemBudget.h"
+#include "DictTrainer.h"
+#include "LevelControl.h"
+#include "ChunkCache.h"
+#include "ListStream.h"
+#include "Merkle.h"
 
 #include <string>
 #include <vector>
 #include <stdio.h>
 #include <mutex>
+#include <atomic>
 #include <fstream>
 using namespace std;
 
@@ -26,8 +35,12 @@ class HashAndCompressReturn {
     i64          BlockIdx;
     string       Hash;
     bool         Keep;
+    const RefArchive *Ref;  // earlier archive holding a kept block (BlockRefs), NULL if in this archive
+    u64          MemHeld;   // bytes of the in-flight budget to give back when done
+    vector <ChunkInfo> Delta; // chain of a delta chunk, as it goes into the finfo
+    u64          Sum;       // checksum of the block as stored
 
-    HashAndCompressReturn () : BL (true) {}
+    HashAndCompressReturn () : BL (true), Ref (NULL), MemHeld (0), Sum (0) {}
 };
 
 class Archive {
@@ -38,13 +51,14 @@ class Archive {
     string        IDPath;
     string        FinishedPath;
     string        ListPath;
+    string        TreePath;
     string        LogPath;
     string        OptionsPath;
     string        FinfoDirPath;
     string        ChunkDirPath;
     string        ExtraDirPath;
     fstream       LogFile;
-    fstream       ListFile;
+    ListStream    ListFile;
     BlockList    *FInfoBlocks;
     BlockList    *ChunkBlocks;
 
@@ -54,9 +68,32 @@ class Archive {
     FileListEntry ParseListLine (const string &ListLine, u64 LineNo);
 };
 
+// a block index qualified by the archive holding it
+class BlockKey {
+    public:
+    i64 Idx;
+    u32 ArchNo;  // RefArchive::No
+    bool operator== (const BlockKey &Other) const {return Idx == Other.Idx && ArchNo == Other.ArchNo;}
+};
+class BlockKeyHash {
+    public:
+    size_t operator() (const BlockKey &BK) const {return BK.Idx ^ ((u64) BK.ArchNo << 40);}
+};
+
+// a block of this archive looked at by recompress
+class RecompRec {
+    public:
+    char Flag;     // how it's stored now
+    char NewFlag;  // ... and in the block replacing it
+    i64  NewIdx;   // replacing block, -1 if it stays as is
+    u64  NewSum;   // checksum of the replacing block
+};
+
 class ArchiveRead : public Archive {
-    map <i64, HLinkSyncRec*> HLinkSyncs;
-    mutex                    HLinkSyncsMtx;
+    ConcMap <BlockKey, HLinkSyncRec*, BlockKeyHash> HLinkSyncs;
+    ConcMap <string, RefArchive*> RefArchs;  // archives whose blocks are referenced, by name
+    atomic <u32>             NextRefNo;
+    RefArchive               Self;
     vector <DirAttribRec>    DirAttribs;
     mutex                    DirAttribsMtx;
     Opts                     O;  // options from archive "Options" file
@@ -64,29 +101,57 @@ class ArchiveRead : public Archive {
     void ParseOptions();
 
     public:
+    bool                     SharedChunks; // chunk blocks may be used by more than one file (dedup or moves, in it or any base)
+    bool                     RawByChoice;  // blocks stored uncompressed whatever their data (DeferComp, CompType none)
+    ChunkCache               ChunkReader;  // plain chunk data, delta chains resolved
+    atomic <u64>             SumsChecked;  // quick test: blocks checked by their stored checksum
+    atomic <u64>             SumsMissing;  // ... and chunks without one, checked in full
 
      ArchiveRead (RepoInfo *repo, const string &name);
     ~ArchiveRead ();
 
+    const RefArchive *GetRef (const string &RefName);
+
     void DoExtract    ();
     void DoExtractJob (const string &ListLine, u64 LineNo);
     void DoList       ();
     void DoTestJob    (const string ListLine, u64 LineCount
-                      ,map <i64, bool> &FInfosMap, map <i64, bool> &ChunksMap
-                      ,mutex &FInfosMapMtx, mutex &ChunksMapMtx
+                      ,ConcMap <BlockKey, bool, BlockKeyHash> &FInfosMap, ConcMap <BlockKey, bool, BlockKeyHash> &ChunksMap
+                      ,ConcMap <BlockKey, bool, BlockKeyHash> &DeltaMap
+                      ,MerkleBuilder *Tested
                       );
-    void DoTest       ();
+    void DoTest       (const vecstr &Scope);
+    void TestSum      (const ChunkInfo &Chunk);
     void DoCompareJob (const FileListEntry &ListEntry);
     void DoCompare    ();
+    void DoDiff       (ArchiveRead *Other, const vecstr &Scope);
+    void DoRecompressScan (const string ListLine, u64 LineCount
+                          ,ConcMap <i64, RecompRec> &FInfosMap, ConcMap <i64, RecompRec> &ChunksMap
+                          );
+    void DoRecompress ();
+};
+
+// size and mtime of a file, to find it again after a move
+class SizeTime {
+    public:
+    u64 Size;
+    u64 MTime;
+    bool operator== (const SizeTime &Other) const {return Size == Other.Size && MTime == Other.MTime;}
+};
+class SizeTimeHash {
+    public:
+    size_t operator() (const SizeTime &ST) const {return ST.MTime ^ (ST.Size * 0x9e3779b97f4a7c15ULL);}
 };
 
 class ArchiveBase : public ArchiveRead {
     public:
-    map <string, FileListEntry> FileMap;
-    mutex                       FileMapMtx;
+    ConcMap <string, FileListEntry> FileMap;
+    ConcMap <SizeTime, vector <const FileListEntry*>, SizeTimeHash> MoveMap; // regular files (DetectMoves only)
 
      ArchiveBase (RepoInfo *repo, const string &name);
     ~ArchiveBase ();
+
+    const FileListEntry *FindMoved (const LiveFile *LF, bool &Sure);
 };
 
 class ArchiveCreate : public Archive {
@@ -94,11 +159,30 @@ class ArchiveCreate : public Archive {
     i64          ZeroLenIdx;
     mutex        ZeroLenIdxMtx;
     ArchiveBase *ArchBase;
+    DedupIndex  *Dedup;           // every stored chunk by hash (NULL without dedup)
+    DictTrainer *Dict;            // dictionary for small blocks (NULL without one)
+    LevelControl *Levels;         // adapts the zstd level of new chunks (NULL for a fixed level)
+    bool         FreeBaseBlocks;  // base blocks no longer used by their file can be reused
+    ConcMap <BlockKey, bool, BlockKeyHash> FInfoClaims; // base finfos kept by a file of this archive (DetectMoves only)
+    atomic <u64> MovedFiles;      // files found under a new name in the base
+    atomic <u64> MovedByContent;  // ... of which the contents had to be compared
+    atomic <u64> RefFiles;        // unchanged files referring to blocks of earlier archives (BlockRefs)
+    atomic <u64> InlineFiles;     // tiny files kept in the list
+    atomic <u64> ProbeSkips;      // chunks stored uncompressed because the probe said so
+    atomic <u64> HistorySkips;    // ... because earlier chunks of the file didn't compress
+    atomic <u64> CompMisses;      // chunks compressed for no gain
+    atomic <u64> DeltaTries;      // changed chunks compressed against their base chunk
+    atomic <u64> DeltaChunks;     // ... and stored that way
+    atomic <u64> DeltaRaw;        // plain bytes of the delta chunks
+    atomic <u64> DeltaStored;     // ... and their stored size
+    MemBudget    ChunkMem;        // chunk data read but not yet written, across all files
+    MerkleBuilder Tree;           // hashes of the entries and the directories above them
 
      ArchiveCreate (RepoInfo *repo, const string &name, ArchiveBase *base);
     ~ArchiveCreate ();
 
     void Init          (RepoInfo *repo, const string &name);
+    void LoadDedup     ();
     void PushListEntry (const FileListEntry &ListEntry);
 };
 
@@ -116,11 +200,14 @@ class ArchFile {
 
 class ArchFileRead : public ArchFile {
     public:
-    ArchiveRead    *Arch;
+    ArchiveRead      *Arch;
+    const RefArchive *Ref;  // archive holding the FInfo block
 
      ArchFileRead (ArchiveRead *arch, const FileListEntry &ListEntry);
     ~ArchFileRead ();
 
+    ChunkInfo ParseFInfoBlock (const string &Block, const string &Line);
+
     void DoExtract  ();
 };
 
@@ -129,14 +216,23 @@ class ArchFileCreate : public ArchFile {
     ArchiveCreate *Arch;
     string         Name;
     LiveFile      *LF;
+    atomic <u32>   CompChunks;  // chunks of this file that compressed, seeded from the base file
+    atomic <u32>   RawChunks;   // ... and that didn't
+
+    static const u32 ProbeTrust = 4; // agreeing chunks before the rest of a file follows them
+    static const u32 ProbeRetry = 16; // ... but a raw file's chunks are still probed this often
+    static const u32 DeltaGain  = 16; // a delta must be this many times smaller than the chunk, else the base didn't help
 
      ArchFileCreate (ArchiveCreate *arch, LiveFile *lf);
     ~ArchFileCreate ();
 
     void Create     (InodeInfo *Inode); // add file to archive
+    void CreateInline ();               // keep tiny file contents in the list
     void CreateLink (InodeInfo *First); // link to previously archived file
-    void HashAndCompressJob (const string &ChunkData
-                            ,const ChunkInfo *BaseChunkInfo, const BlockList *BaseBlockList
+    vector <ChunkInfo> KeepDelta (const ChunkInfo &Chunk); // chain of a base chunk, for this archive
+    void HashAndCompressJob (const BufRef &ChunkData
+                            ,const map <string, const ChunkInfo*> *BaseChunks, const ChunkInfo *BaseChunk
+                            ,const BlockList *BaseBlockList
                             ,HashAndCompressReturn *HACR);
 };
 
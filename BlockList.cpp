@@ -3,6 +3,7 @@
 #include "Utils.h"
 #include "ThreadPool.h"
 
+#include <algorithm>
 #include <filesystem>
 #include <string>
 #include <sstream>
@@ -10,66 +11,147 @@
 #include <stdio.h>
 namespace fs = std::filesystem;
 
-BlockList::BlockList (const string &topdir) {
-    TopDir = topdir;
+BlockList::BlockList (const string &topdir) : Reserved (false) {
+    TopDir   = topdir;
+    Reserves = new BlockReserve [NumReserves];
 }
 
 BlockList::~BlockList () {
+    delete [] Reserves;
+}
+
+// threads are numbered as they first allocate, to pick their reserve
+static atomic <u32>      ThreadCount (0);
+static thread_local i64  ThreadNo = -1;
+
+BlockReserve &BlockList::MyReserve () {
+    if (ThreadNo < 0)
+        ThreadNo = ThreadCount++;
+    return Reserves [ThreadNo % NumReserves];
 }
 
 // allocate a block index
-// always allocate the lowest availabel index
+// from this thread's freed indices or reserve, which is refilled with the lowest free indices
 i64 BlockList::Alloc () {
-    unique_lock<recursive_mutex> lock(Mtx);
+    BlockReserve &R = MyReserve();
+    lock_guard <mutex> Lock (R.Mtx);
 
-    // create at head of list if idx 0 isn't allocated
-    if (Ranges.size() == 0 || Ranges [0].min > 1) {
-        // create first allocated range
-        Ranges.insert (Ranges.begin(), BlockRangeTuple (0,0));
-        DBG ("BlockList::Alloc Idx=0\n");
-        return 0;
+    i64 Idx;
+    if (R.Freed.size()) {
+        Idx = R.Freed.back();
+        R.Freed.pop_back();
+    } else {
+        if (R.Next == R.End) {
+            unique_lock<recursive_mutex> lock(Mtx, try_to_lock);
+            if (lock.owns_lock()) {
+                R.Batch = max (R.Batch / 2, (i64) 1);
+            } else {
+                R.Batch = min (R.Batch * 2, ReserveSize);
+                lock.lock();
+            }
+            i64 Num  = AllocRun (R.Batch, R.Next);
+            R.End    = R.Next + Num;
+            Reserved = true;
+        }
+        Idx = R.Next++;
     }
 
-    BlockRangeTuple &Range = Ranges[0];
+    DBG ("BlockList::Alloc Idx=%ld\n", Idx);
+    return Idx;
+}
 
-    // allocate from beginning of first range if there's room
-    if (Range.min == 1) {
-        Range.min = 0;
-        DBG ("BlockList::Alloc Idx=0\n");
-        return 0;
+// mark the lowest run of free indices allocated, up to Max of them
+// returns how many, Start gets the first
+i64 BlockList::AllocRun (i64 Max, i64 &Start) {
+    i64 Num;
+    if (Ranges.size() == 0 || Ranges [0].min > 0) {
+        // room before the first range
+        Start = 0;
+        Num   = Ranges.size() ? min (Max, Ranges [0].min) : Max;
+        Ranges.insert (Ranges.begin(), BlockRangeTuple (0, Num - 1));
+    } else {
+        // room after the first range
+        Start = Ranges [0].max + 1;
+        Num   = Ranges.size() > 1 ? min (Max, Ranges [1].min - Start) : Max;
+        Ranges [0].max += Num;
     }
 
-    // allocate at the end of the first range
-    i64 Idx = ++Range.max;
-
     // see if we need to merge with the next range
     if (Ranges.size() > 1) {
+        BlockRangeTuple &Range    = Ranges[0];
         BlockRangeTuple &RangeNxt = Ranges[1];
-        if (Idx >= RangeNxt.min)
-            THROW_PBEXCEPTION ("Block Allocation list corrupted. Idx:%" PRId64 " NextMin:%" PRId64, Idx, RangeNxt.min);
-        if (Idx == RangeNxt.min-1) {
+        if (Range.max >= RangeNxt.min)
+            THROW_PBEXCEPTION ("Block Allocation list corrupted. Max:%" PRId64 " NextMin:%" PRId64, Range.max, RangeNxt.min);
+        if (Range.max == RangeNxt.min-1) {
             // merge ranges 0 and 1
             Range.max = RangeNxt.max;
             Ranges.erase (Ranges.begin()+1);
         }
     }
-
-    DBG ("BlockList::Alloc Idx=%ld\n", Idx);
-    return Idx;
+    return Num;
 }
 
-// free a block index from the allocated blocks
+// free a block index
+// the thread keeps it for its next allocations, giving the older half back when it has too many
 void BlockList::Free (i64 Idx) {
+    assert (Idx >= 0);
+    BlockReserve &R = MyReserve();
+    lock_guard <mutex> Lock (R.Mtx);
+
+    // a double free has to be caught here, before the index can be handed out twice
+    {
+        unique_lock<recursive_mutex> lock(Mtx);
+        i64 RangeIdx = Search (Idx);
+        if (RangeIdx < 0 || Ranges[RangeIdx].max < Idx || (Idx >= R.Next && Idx < R.End)
+            || find (R.Freed.begin(), R.Freed.end(), Idx) != R.Freed.end())
+            THROW_PBEXCEPTION ("BlockList::Free (%s) Attempt to free unallocated index: %" PRId64, TopDir.c_str(), Idx);
+    }
+
+    R.Freed.push_back (Idx);
+    if (!Reserved)
+        Reserved = true;
+
+    if (R.Freed.size() >= FreedKeep) {
+        unique_lock<recursive_mutex> lock(Mtx);
+        for (u32 i = 0; i < FreedKeep / 2; i++)
+            FreeOne (R.Freed [i]);
+        R.Freed.erase (R.Freed.begin(), R.Freed.begin() + FreedKeep / 2);
+    }
+}
+
+// give everything the threads hold back to the ranges
+// so the allocated ranges are exactly the blocks in use (while nothing is being allocated)
+void BlockList::Flush () {
+    if (!Reserved)
+        return;
+    Reserved = false;
+
+    for (u32 r = 0; r < NumReserves; r++) {
+        BlockReserve &R = Reserves [r];
+        lock_guard <mutex> Lock (R.Mtx);
+        if (R.Next == R.End && !R.Freed.size())
+            continue;
+
+        unique_lock<recursive_mutex> lock(Mtx);
+        for (i64 Idx = R.End - 1; Idx >= R.Next; Idx--)
+            FreeOne (Idx);
+        for (auto Idx : R.Freed)
+            FreeOne (Idx);
+        R.Next = R.End = 0;
+        R.Freed.clear();
+    }
+}
+
+// free a block index from the allocated ranges
+void BlockList::FreeOne (i64 Idx) {
     unique_lock<recursive_mutex> lock(Mtx);
     assert (Idx >= 0);
 
     // find the range containing the block index
     i64 RangeIdx = Search (Idx);
-    BlockRangeTuple Range = Ranges[RangeIdx];
-    if (RangeIdx >= 0)
-        Range = Ranges[RangeIdx];
-    if (RangeIdx < 0 || Range.max < Idx)
+    if (RangeIdx < 0 || Ranges[RangeIdx].max < Idx)
         THROW_PBEXCEPTION ("BlockList::Free (%s) Attempt to free unallocated index: %" PRId64, TopDir.c_str(), Idx);
+    BlockRangeTuple Range = Ranges[RangeIdx];
 
     if (Range.min == Idx) {
         // free from low end of range
@@ -96,6 +178,7 @@ void BlockList::Free (i64 Idx) {
 }
 
 bool BlockList::IsAllocated (i64 Idx) {
+    Flush ();
     unique_lock<recursive_mutex> lock(Mtx);
     assert (Idx >= 0);
 
@@ -112,6 +195,7 @@ bool BlockList::IsAllocated (i64 Idx) {
 
 // mark a block as allocated
 void BlockList::MarkAllocated (i64 Idx) {
+    Flush ();
     unique_lock<recursive_mutex> lock(Mtx);
     assert (Idx >= 0);
 
@@ -184,7 +268,9 @@ i64 BlockList::Search (i64 Idx, i64 Start, i64 End) const {
     return Search (Idx, Mid+1, End);
 }
 
-i64 BlockList::CountAllocated () const {
+i64 BlockList::CountAllocated () {
+    Flush ();
+    unique_lock<recursive_mutex> lock(Mtx);
     i64 Total = 0;
     for (unsigned i = 0; i < Ranges.size(); i++) {
         auto &Range    = Ranges [i];
@@ -251,14 +337,41 @@ void BlockList::SlurpBlock (i64 Idx, string &BufStr) const {
     fclose (F);
 }
 
+// block files don't change once written, so read the whole file in one go
+// into a pooled buffer sized from fstat
+void BlockList::SlurpBlock (i64 Idx, BufRef &Buf) const {
+    assert (Idx >= 0);
+    FILE *F = Utils::OpenReadBin (Idx2FileName (Idx));
+
+    struct stat Stats;
+    if (fstat (fileno (F), &Stats))
+        THROW_PBEXCEPTION_IO ("Can't stat block %ld", Idx);
+
+    Buf.Resize (Stats.st_size);
+    size_t TotalSize = 0;
+    while (TotalSize < Buf.Size()) {
+        i64 BytesRead = Utils::ReadBinary (F, Buf.Data() + TotalSize, Buf.Size() - TotalSize);
+        if (!BytesRead)
+            break;
+        TotalSize += BytesRead;
+    }
+    Buf.Resize (TotalSize);
+
+    fclose (F);
+}
+
 void BlockList::SpitBlock (i64 Idx, const string &BufStr) {
+    SpitBlock (Idx, BufStr.data(), BufStr.size());
+}
+
+void BlockList::SpitBlock (i64 Idx, const char *Buf, size_t Size) {
     assert (Idx >= 0);
     // create subdirs
     string SubDirName = Idx2DirString(Idx);
     Utils::CreateDir (SubDirName, true);
 
     FILE *F = Utils::OpenWriteBin (SubDirName + "/" + to_string (Idx));
-    Utils::WriteBinary (F, BufStr);
+    Utils::WriteBinary (F, Buf, Size);
     fclose (F);
 }
 
@@ -268,6 +381,12 @@ i64 BlockList::SpitNewBlock (const string &BufStr) {
     return Blk;
 }
 
+i64 BlockList::SpitNewBlock (const BufRef &Buf) {
+    i64 Blk = Alloc();
+    SpitBlock (Blk, Buf.Data(), Buf.Size());
+    return Blk;
+}
+
 void BlockList::Link (i64 Idx, const string &TargTop) {
     assert (Idx >= 0);
     string DirStr  = Idx2SubDirString (Idx);
@@ -278,7 +397,8 @@ void BlockList::Link (i64 Idx, const string &TargTop) {
 
     string LinkName = Dir                    + "/" + IdxStr;
     string Target   = TargTop + "/" + DirStr + "/" + IdxStr;
-    Utils::Link (LinkName, Target);
+    // the same block may be linked more than once (repeated data within a file)
+    Utils::Link (LinkName, Target, true);
 }
 
 void BlockList::ReverseAlloc () {
@@ -5,12 +5,14 @@
 #include "RepoInfo.h"
 #include "Opts.h"
 #include "BusyLock.h"
+#include "BufPool.h"
 
 #include <string>
 #include <vector>
 #include <map>
 #include <stdio.h>
 #include <mutex>
+#include <atomic>
 #include <fstream>
 using namespace std;
 
@@ -24,12 +26,38 @@ class BlockRangeTuple {
     }
 };
 
+// indices set aside for one thread, so it can allocate without the list's lock
+// only a flush takes the lock besides the thread using it
+class alignas (64) BlockReserve {
+    public:
+    mutex        Mtx;
+    i64          Next = 0;   // reserved indices not handed out yet are Next .. End-1
+    i64          End  = 0;
+    i64          Batch = 1;  // indices to take next time, more while other threads are taking them too
+    vector <i64> Freed;      // indices freed by the thread, handed out again first
+};
+
+// allocated block indices, as ranges
+// threads allocate from reserved runs of the lowest free indices and keep what they free for reuse
+// runs only get longer when threads are waiting for each other, so the indices stay dense
+// but for what's still reserved (see Flush)
 class BlockList {
+    public:
+    static const u32 NumReserves = 128;  // threads beyond this share reserves
+    static const i64 ReserveSize = 32;   // most indices taken at a time
+    static const u32 FreedKeep   = 64;   // freed indices kept by a thread before giving half back
+
+    private:
     vector <BlockRangeTuple> Ranges;
     recursive_mutex          Mtx;
+    BlockReserve            *Reserves;
+    atomic <bool>            Reserved;   // some reserve may hold indices
 
-    i64 Search (i64 Idx) const ;
-    i64 Search (i64 Idx, i64 Start, i64 End) const ;
+    i64  Search    (i64 Idx) const ;
+    i64  Search    (i64 Idx, i64 Start, i64 End) const ;
+    i64  AllocRun  (i64 Max, i64 &Start);
+    void FreeOne   (i64 Idx);
+    BlockReserve &MyReserve ();
 
     public:
      BlockList (const string &topdir);
@@ -39,9 +67,10 @@ class BlockList {
 
     i64     Alloc            ();
     void    Free             (i64 Idx);
+    void    Flush            ();
     bool    IsAllocated      (i64 Idx);
     void    MarkAllocated    (i64 Idx);
-    i64     CountAllocated   ()                              const;
+    i64     CountAllocated   ();
     vecstr  GetSubDirs       (i64 Idx)                       const;
     string  Idx2SubDirString (i64 Idx                   )    const;
     string  Idx2DirString    (i64 Idx                   )    const;
@@ -49,8 +78,11 @@ class BlockList {
     string  Idx2FileName     (i64 Idx)                       const;
     fstream OpenReadStream   (i64 Idx)                       const;
     void    SlurpBlock       (i64 Idx,       string &BufStr) const;
+    void    SlurpBlock       (i64 Idx,       BufRef &Buf)    const;
     void    SpitBlock        (i64 Idx, const string &BufStr);
+    void    SpitBlock        (i64 Idx, const char *Buf, size_t Size);
     i64     SpitNewBlock     (         const string &BufStr);
+    i64     SpitNewBlock     (         const BufRef &Buf);
     void    Link             (i64 Idx, const string &Target);
     void    ReverseAlloc     ();
     void    ReverseAlloc     (const string &Dir);
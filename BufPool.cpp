@@ -0,0 +1,169 @@
+#include "BufPool.h"
+#include "Logging.h"
+
+#include <stdlib.h>
+
+// global buffer pool
+// never destroyed: pool and walker threads can still be ending at exit,
+// handing their cached buffers back as they go, so it's left to the os with them
+BufPool_t &BufPool = *new BufPool_t;
+
+// buffers freed by this thread, reused first by the same thread
+// so a buffer tends to stay on the cpu (and memory node) that last touched it
+class BufThreadCache {
+    public:
+    ChunkBuf *Free  [BufPool_t::NumClasses];
+    u32       Count [BufPool_t::NumClasses];
+
+    BufThreadCache () {
+        memset (Free,  0, sizeof (Free));
+        memset (Count, 0, sizeof (Count));
+    }
+    ~BufThreadCache () {
+        // hand everything to the shared lists when the thread ends
+        for (u32 c = 0; c < BufPool_t::NumClasses; c++) {
+            while (Free [c]) {
+                ChunkBuf *Buf = Free [c];
+                Free [c] = Buf->Next;
+                BufPool.PutShared (Buf);
+            }
+        }
+    }
+};
+static thread_local BufThreadCache ThreadCache;
+
+BufPool_t::BufPool_t () {
+    memset (Free, 0, sizeof (Free));
+    Kept    = 0;
+    KeepMax = 256 << 20;
+    Allocs  = 0;
+    Reuses  = 0;
+    Bytes   = 0;
+}
+
+u32 BufPool_t::SizeClass (size_t Size) {
+    if (Size <= ((size_t) 1 << MinShift))
+        return 0;
+    u32    Shift = 63 - __builtin_clzll (Size - 1);   // 2^Shift < Size <= 2^(Shift+1)
+    size_t Step  = (size_t) 1 << (Shift - 2);
+    u32    Sub   = (Size - ((size_t) 1 << Shift) + Step - 1) / Step;
+    u32    Class = (Shift - MinShift) * 4 + Sub;
+    if (Class >= NumClasses)
+        THROW_PBEXCEPTION ("Buffer size too big: %lu", Size);
+    return Class;
+}
+
+size_t BufPool_t::ClassSize (u32 Class) {
+    if (!Class)
+        return (size_t) 1 << MinShift;
+    u32 Shift = (Class - 1) / 4 + MinShift;
+    u32 Sub   = (Class - 1) % 4 + 1;
+    return ((size_t) 1 << Shift) + Sub * ((size_t) 1 << (Shift - 2));
+}
+
+ChunkBuf *BufPool_t::Get (size_t MinCap) {
+    u32 Class = SizeClass (MinCap);
+
+    // this thread's own cache first, then the shared list
+    ChunkBuf *Buf = ThreadCache.Free [Class];
+    if (Buf) {
+        ThreadCache.Free  [Class] = Buf->Next;
+        ThreadCache.Count [Class] --;
+    } else {
+        lock_guard <mutex> Lock (Mtx);
+        Buf = Free [Class];
+        if (Buf) {
+            Free [Class] = Buf->Next;
+            Kept -= Buf->Cap;
+        }
+    }
+
+    if (Buf) {
+        Reuses ++;
+    } else {
+        // nothing to reuse
+        Buf = new ChunkBuf;
+        Buf->Cap   = ClassSize (Class);
+        Buf->Class = Class;
+        if (posix_memalign ((void **) &Buf->Data, (size_t) 1 << MinShift, Buf->Cap))
+            THROW_PBEXCEPTION ("Can't allocate %lu byte buffer", Buf->Cap);
+        Allocs ++;
+        Bytes  += Buf->Cap;
+    }
+    Buf->Size = 0;
+    Buf->Refs = 1;
+    Buf->Next = NULL;
+    return Buf;
+}
+
+void BufPool_t::Put (ChunkBuf *Buf) {
+    u32 Class = Buf->Class;
+    if (ThreadCache.Count [Class] < ThreadKeep) {
+        Buf->Next = ThreadCache.Free [Class];
+        ThreadCache.Free  [Class] = Buf;
+        ThreadCache.Count [Class] ++;
+        return;
+    }
+    PutShared (Buf);
+}
+
+void BufPool_t::PutShared (ChunkBuf *Buf) {
+    {
+        lock_guard <mutex> Lock (Mtx);
+        if (Kept + Buf->Cap <= KeepMax) {
+            Buf->Next = Free [Buf->Class];
+            Free [Buf->Class] = Buf;
+            Kept += Buf->Cap;
+            return;
+        }
+    }
+    Destroy (Buf);
+}
+
+void BufPool_t::Destroy (ChunkBuf *Buf) {
+    free (Buf->Data);
+    delete Buf;
+}
+
+BufRef::BufRef (size_t MinCap) {
+    Buf = BufPool.Get (MinCap);
+}
+
+BufRef::BufRef (const BufRef &Other) {
+    Buf = Other.Buf;
+    if (Buf)
+        Buf->Refs ++;
+}
+
+BufRef::~BufRef () {
+    Clear();
+}
+
+void BufRef::Clear () {
+    if (Buf && !--Buf->Refs)
+        BufPool.Put (Buf);
+    Buf = NULL;
+}
+
+void BufRef::Reserve (size_t MinCap) {
+    if (Buf && MinCap <= Buf->Cap)
+        return;
+    BufRef Bigger (MinCap);
+    if (Buf) {
+        memcpy (Bigger.Buf->Data, Buf->Data, Buf->Size);
+        Bigger.Buf->Size = Buf->Size;
+    }
+    *this = move (Bigger);
+}
+
+void BufRef::Resize (size_t NewSize) {
+    Reserve (NewSize);
+    Buf->Size = NewSize;
+}
+
+void BufRef::Assign (const char *Src, size_t Len) {
+    if (!Buf || Len > Buf->Cap)
+        *this = BufRef (Len);
+    memcpy (Buf->Data, Src, Len);
+    Buf->Size = Len;
+}
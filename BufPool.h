@@ -0,0 +1,89 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include "Types.h"
+
+#include <string.h>
+#include <atomic>
+#include <mutex>
+using namespace std;
+
+// page aligned data buffer, recycled through BufPool instead of going back to the heap
+class ChunkBuf {
+    public:
+    char          *Data;
+    size_t         Size;    // bytes of valid data
+    size_t         Cap;     // bytes allocated
+    u32            Class;   // size class within the pool
+    atomic <u32>   Refs;    // number of BufRefs holding this buffer
+    ChunkBuf      *Next;    // free list link while in the pool
+};
+
+// counted reference to a pooled buffer
+// the buffer goes back to the pool with the last reference
+// so a chunk can be handed from reader to hash/compress/write without copying
+class BufRef {
+    ChunkBuf *Buf;
+
+    public:
+     BufRef () : Buf (NULL) {}
+     explicit BufRef (size_t MinCap);   // buffer from the pool with room for at least MinCap bytes
+     BufRef (const BufRef &Other);
+     BufRef (BufRef &&Other) : Buf (Other.Buf) {Other.Buf = NULL;}
+    ~BufRef ();
+    BufRef &operator= (BufRef Other) {swap (Buf, Other.Buf); return *this;}
+
+    char       *Data  ()       {return Buf ? Buf->Data : NULL;}
+    const char *Data  () const {return Buf ? Buf->Data : NULL;}
+    size_t      Size  () const {return Buf ? Buf->Size : 0;}
+    size_t      Cap   () const {return Buf ? Buf->Cap  : 0;}
+    void        Clear ();                   // drop the buffer
+    void        Reserve (size_t MinCap);    // keeps the data, moves to a bigger buffer if needed
+    void        Resize  (size_t NewSize);   // as Reserve and sets the data size
+    void        Assign  (const char *Src, size_t Len);
+
+    bool operator== (const BufRef &Other) const {
+        return Size() == Other.Size() && !memcmp (Data(), Other.Data(), Size());
+    }
+    bool operator!= (const BufRef &Other) const {return !(*this == Other);}
+    bool Equals (const char *Src, size_t Len) const {
+        return Size() == Len && !memcmp (Data(), Src, Len);
+    }
+};
+
+// buffers are kept in size classes, four to each doubling from 4 KiB
+// freed buffers go to a small per-thread cache first, then to a shared list
+class BufPool_t {
+    public:
+    static const u32    MinShift   = 12;   // smallest buffer is one page
+    static const u32    NumClasses = 4 * (48 - MinShift) + 1;
+    static const u32    ThreadKeep = 2;    // buffers cached per class in each thread
+
+    private:
+    ChunkBuf           *Free  [NumClasses];  // shared free lists
+    mutex               Mtx;                 // protects the shared free lists
+    u64                 Kept;                // bytes in the shared free lists
+    u64                 KeepMax;             // past this freed buffers go back to the heap
+
+    public:
+    // statistics for the log
+    atomic <u64>        Allocs;   // buffers taken from the heap
+    atomic <u64>        Reuses;   // buffers taken from the pool
+    atomic <u64>        Bytes;    // bytes taken from the heap
+
+     BufPool_t ();
+
+    static u32    SizeClass (size_t Size);
+    static size_t ClassSize (u32 Class);
+
+    void      SetKeep (u64 keepmax) {KeepMax = keepmax;}
+    ChunkBuf *Get     (size_t MinCap);
+    void      Put     (ChunkBuf *Buf);
+    void      PutShared (ChunkBuf *Buf);
+    void      Destroy (ChunkBuf *Buf);
+};
+
+// global buffer pool (never destroyed, see BufPool.cpp)
+extern BufPool_t &BufPool;
+
+#endif // BUFPOOL_H
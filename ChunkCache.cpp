@@ -0,0 +1,85 @@
+#include "ChunkCache.h"
+#include "BlockList.h"
+#include "Logging.h"
+#include "Comp.h"
+
+ChunkCache::ChunkCache (u64 maxbytes) {
+    Bytes    = 0;
+    MaxBytes = maxbytes;
+    Hits     = 0;
+    Misses   = 0;
+}
+
+ChunkCache::~ChunkCache () {
+}
+
+bool ChunkCache::Find (const Key &K, BufRef &Data) {
+    lock_guard <mutex> Lock (Mtx);
+    auto Itr = Index.find (K);
+    if (Itr == Index.end())
+        return false;
+    LRU.splice (LRU.begin(), LRU, Itr->second);
+    Data = Itr->second->Data;
+    return true;
+}
+
+void ChunkCache::Add (const Key &K, const BufRef &Data) {
+    lock_guard <mutex> Lock (Mtx);
+    if (Index.count (K))
+        return; // another thread decoded it too
+    LRU.push_front ({K, Data});
+    Index [K] = LRU.begin();
+    Bytes += Data.Size();
+    while (Bytes > MaxBytes && LRU.size() > 1) {
+        Bytes -= LRU.back().Data.Size();
+        Index.erase (LRU.back().K);
+        LRU.pop_back();
+    }
+}
+
+// plain data of link number Link of a delta chain
+void ChunkCache::ReadLink (const vector <ChunkInfo> &Chain, size_t Link, const BlockList *ChunkBlocks, BufRef &Data) {
+    const ChunkInfo &Chunk = Chain [Link];
+    if (Chunk.Ref)
+        ChunkBlocks = Chunk.Ref->ChunkBlocks;
+    Key K = {ChunkBlocks, Chunk.ChunkIdx};
+    if (Find (K, Data)) {
+        Hits ++;
+        return;
+    }
+    Misses ++;
+
+    BufRef Stored;
+    ChunkBlocks->SlurpBlock (Chunk.ChunkIdx, Stored);
+    if (Chunk.CompFlag == CompFlagDelta) {
+        if (Link + 1 >= Chain.size())
+            THROW_PBEXCEPTION_FMT ("Delta chain of chunk #%ld is cut short", Chunk.ChunkIdx);
+        BufRef Base;
+        ReadLink (Chain, Link + 1, ChunkBlocks, Base);
+        Comp::DeCompress_Delta (Stored, Base, Data);
+    } else if (Chunk.CompFlag != CompFlagUnComp) {
+        Comp::DeCompress (Chunk.CompFlag, Stored, Data);
+    } else {
+        Data = move (Stored);
+    }
+    Add (K, Data);
+}
+
+void ChunkCache::Read (const ChunkInfo &Chunk, const BlockList *ChunkBlocks, BufRef &Data) {
+    if (Chunk.Ref)
+        ChunkBlocks = Chunk.Ref->ChunkBlocks;
+
+    BufRef Stored;
+    ChunkBlocks->SlurpBlock (Chunk.ChunkIdx, Stored);
+    if (Chunk.CompFlag == CompFlagDelta) {
+        if (Chunk.Delta.empty())
+            THROW_PBEXCEPTION_FMT ("Delta chunk #%ld has no chain", Chunk.ChunkIdx);
+        BufRef Base;
+        ReadLink (Chunk.Delta, 0, ChunkBlocks, Base);
+        Comp::DeCompress_Delta (Stored, Base, Data);
+    } else if (Chunk.CompFlag != CompFlagUnComp) {
+        Comp::DeCompress (Chunk.CompFlag, Stored, Data);
+    } else {
+        Data = move (Stored);
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef CHUNKCACHE_H
+#define CHUNKCACHE_H
+
+#include "Types.h"
+#include "BufPool.h"
+
+#include <list>
+#include <map>
+#include <mutex>
+#include <atomic>
+using namespace std;
+
+// reads chunks back to their plain data
+// a delta chunk is decoded against the next chunk of its chain, which may be a delta itself
+// the chunks of a changed file mostly lean on the same few base chunks, so the decoded
+// chain links are kept (least recently used ones go first)
+class ChunkCache {
+    typedef pair <const BlockList*, i64> Key;
+    class Entry {
+        public:
+        Key    K;
+        BufRef Data;
+    };
+
+    mutex                              Mtx;
+    list <Entry>                       LRU;     // most recently used first
+    map <Key, list <Entry>::iterator>  Index;
+    u64                                Bytes;
+    u64                                MaxBytes;
+
+    bool Find     (const Key &K, BufRef &Data);
+    void Add      (const Key &K, const BufRef &Data);
+    void ReadLink (const vector <ChunkInfo> &Chain, size_t Link, const BlockList *ChunkBlocks, BufRef &Data);
+
+    public:
+    // statistics
+    atomic <u64> Hits;
+    atomic <u64> Misses;
+
+     ChunkCache (u64 maxbytes = 64 << 20);
+    ~ChunkCache ();
+
+    // chunks without a RefArchive are in ChunkBlocks
+    void Read (const ChunkInfo &Chunk, const BlockList *ChunkBlocks, BufRef &Data);
+};
+
+#endif // CHUNKCACHE_H
@@ -0,0 +1,102 @@
+#include "Chunker.h"
+#include "Logging.h"
+#include "Utils.h"
+using namespace Utils;
+
+// random values for each byte, fixed forever since they decide where chunks are cut
+static u64 Gear [256];
+static bool InitGear () {
+    u64 Seed = 0x5048415442414b21ULL; // splitmix64
+    for (auto &G : Gear) {
+        u64 z = (Seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        G = z ^ (z >> 31);
+    }
+    return true;
+}
+static bool GearReady = InitGear ();
+
+// mask of the top Bits bits
+// with the gear hash shifting left, high bits depend on the most bytes
+static u64 TopMask (int Bits) {
+    return Bits <= 0 ? 0 : ~0ULL << (64 - Bits);
+}
+
+Chunker::Chunker (FILE *f, size_t minsize, size_t avgsize, size_t maxsize) {
+    DBGCTOR;
+    assert (GearReady);
+    F       = f;
+    Pos     = 0;
+    Eof     = false;
+    AvgSize = max (avgsize, (size_t) 64);
+    MinSize = min (minsize, AvgSize);
+    MaxSize = max (maxsize, AvgSize);
+
+    // normalized chunking: cut probability is 1/(4*Avg) before Avg and 4/Avg after
+    int Bits = 0;
+    while ((2ULL << Bits) <= AvgSize)
+        Bits++;
+    MaskS = TopMask (Bits + 2);
+    MaskL = TopMask (Bits - 2);
+}
+
+Chunker::~Chunker () {
+    DBGDTOR;
+}
+
+size_t Chunker::Cut (const u8 *Data, size_t Size) const {
+    if (Size <= MinSize)
+        return Size;
+    if (Size > MaxSize)
+        Size = MaxSize;
+    size_t Normal = min (Size, AvgSize);
+
+    // skip the first MinSize bytes entirely
+    u64    FP = 0;
+    size_t i  = MinSize;
+    for (; i < Normal; i++) {
+        FP = (FP << 1) + Gear [Data[i]];
+        if (!(FP & MaskS))
+            return i + 1;
+    }
+    for (; i < Size; i++) {
+        FP = (FP << 1) + Gear [Data[i]];
+        if (!(FP & MaskL))
+            return i + 1;
+    }
+    return Size;
+}
+
+// length of the next chunk, which starts at Buf[Pos], 0 at the end
+size_t Chunker::NextLen () {
+    // keep at least MaxSize bytes buffered so every cut sees a full window
+    if (!Eof && Buf.size() - Pos < MaxSize) {
+        Buf.erase (0, Pos);
+        Pos = 0;
+        size_t Have = Buf.size();
+        size_t Want = 4 * MaxSize;
+        Buf.resize (Want);
+        while (Have < Want) {
+            int Got = ReadBinary (F, Buf.data() + Have, Want - Have);
+            if (Got <= 0) {
+                Eof = true;
+                break;
+            }
+            Have += Got;
+        }
+        Buf.resize (Have);
+    }
+
+    size_t Avail = Buf.size() - Pos;
+    if (!Avail)
+        return 0;
+    return Cut ((const u8 *) Buf.data() + Pos, Avail);
+}
+
+bool Chunker::Next (BufRef &Chunk) {
+    size_t Len = NextLen();
+    Chunk.Assign (Buf.data() + Pos, Len);
+    Pos += Len;
+    return Len;
+}
@@ -0,0 +1,35 @@
+#ifndef CHUNKER_H
+#define CHUNKER_H
+
+#include "Types.h"
+#include "BufPool.h"
+
+#include <string>
+#include <stdio.h>
+using namespace std;
+
+// content-defined chunking (FastCDC)
+// cut points depend only on the last few dozen bytes of data,
+// so an insert or delete only changes the chunks around it
+class Chunker {
+    FILE   *F;
+    string  Buf;      // data read from F but not yet returned
+    size_t  Pos;      // start of unreturned data in Buf
+    bool    Eof;
+    size_t  MinSize;  // no cut before this
+    size_t  AvgSize;  // cut gets easier after this
+    size_t  MaxSize;  // forced cut
+    u64     MaskS;    // harder cut condition, used below AvgSize
+    u64     MaskL;    // easier cut condition, used above AvgSize
+
+    size_t NextLen ();
+
+    public:
+     Chunker (FILE *f, size_t minsize, size_t avgsize, size_t maxsize);
+    ~Chunker ();
+
+    bool   Next (BufRef &Chunk);                 // next chunk of the file, false at the end
+    size_t Cut  (const u8 *Data, size_t Size) const; // length of the first chunk of Data
+};
+
+#endif // CHUNKER_H
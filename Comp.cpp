@@ -1,9 +1,89 @@
 #include "Comp.h"
 #include "Opts.h"
 #include "Logging.h"
+#include "BufPool.h"
 
 #include <stdlib.h>
+#include <math.h>
+#include <map>
+#include <atomic>
+#include <shared_mutex>
+#include <filesystem>
 #include <zstd.h>
+#include <zdict.h>
+#include <lz4.h>
+namespace fs = std::filesystem;
+
+// zstd contexts are expensive to set up, so each thread keeps one of each
+// the compression level is only set again when it changes
+class ZSTDCtxs {
+    public:
+    ZSTD_CCtx *CCtx;
+    ZSTD_DCtx *DCtx;
+    int        Level;   // level CCtx is set up for
+    bool       LevelSet;
+
+    ZSTDCtxs () {
+        CCtx     = NULL;
+        DCtx     = NULL;
+        Level    = 0;
+        LevelSet = false;
+    }
+    ~ZSTDCtxs () {
+        ZSTD_freeCCtx (CCtx);
+        ZSTD_freeDCtx (DCtx);
+    }
+
+    ZSTD_CCtx *Comp (int Lvl) {
+        if (!CCtx) {
+            CCtx = ZSTD_createCCtx();
+            if (!CCtx)
+                THROW_PBEXCEPTION ("Can't create ZSTD compression context");
+        }
+        if (!LevelSet || Level != Lvl) {
+            auto RVal = ZSTD_CCtx_setParameter (CCtx, ZSTD_c_compressionLevel, Lvl);
+            if (ZSTD_isError(RVal))
+                THROW_PBEXCEPTION ("ZSTD compression level %d error: %s\n", Lvl, ZSTD_getErrorName (RVal));
+            Level    = Lvl;
+            LevelSet = true;
+        }
+        return CCtx;
+    }
+
+    ZSTD_DCtx *DeComp () {
+        if (!DCtx) {
+            DCtx = ZSTD_createDCtx();
+            if (!DCtx)
+                THROW_PBEXCEPTION ("Can't create ZSTD decompression context");
+        } else {
+            // throw away the state of any frame left unfinished by an error
+            ZSTD_DCtx_reset (DCtx, ZSTD_reset_session_only);
+        }
+        return DCtx;
+    }
+};
+static thread_local ZSTDCtxs ZSTDThreadCtxs;
+
+// trained dictionaries by id, for frames compressed with one
+// they're loaded when an archive is opened and kept for the life of the program
+static map <u32, ZSTD_DDict*> DDicts;
+static shared_mutex           DDictsMtx;
+
+// dictionary new blocks below O.DictBelow are compressed with (NULL for none)
+static atomic <ZSTD_CDict*>   CDict (NULL);
+
+static const ZSTD_DDict *FindDDict (u32 ID) {
+    shared_lock <shared_mutex> Lock (DDictsMtx);
+    auto Itr = DDicts.find (ID);
+    if (Itr == DDicts.end())
+        THROW_PBEXCEPTION ("ZSTD Decompress error: dictionary %u not found\n", ID);
+    return Itr->second;
+}
+
+// dictionary to compress a block of this size with
+static const ZSTD_CDict *SmallDict (size_t Size) {
+    return Size < O.DictBelow ? CDict.load() : NULL;
+}
 
 eCompType Comp::CompNameToEnum (const string &Name) {
     for (int i = 0; i < CompType_NULL; i++) {
@@ -17,10 +97,13 @@ eCompType Comp::CompFlag2CompType (char Flag) {
     return CompFlag2CompType (Flag, O);
 }
 
+// the flag alone says how a block was compressed, whatever the archive's CompType
+// (zstd was the only codec before lz4, so 'C' always meant zstd)
 eCompType Comp::CompFlag2CompType (char Flag, Opts &O) {
     switch (Flag) {
-        case 'U' : return CompType_NONE;
-        case 'C' : return O.CompType;
+        case CompFlagUnComp : return CompType_NONE;
+        case CompFlagComp   : return CompType_ZTSD;
+        case CompFlagLZ4    : return CompType_LZ4;
         default:
             THROW_PBEXCEPTION_FMT ("Unrecognized compression flag: %c", Flag);
     }
@@ -28,10 +111,105 @@ eCompType Comp::CompFlag2CompType (char Flag, Opts &O) {
 }
 
 char Comp::CompType2CompFlag (eCompType Type) {
-    if (Type == CompType_NONE)
-        return CompFlagUnComp;
-    else
-        return CompFlagComp;;
+    switch (Type) {
+        case CompType_ZTSD : return CompFlagComp;
+        case CompType_LZ4  : return CompFlagLZ4;
+        default            : return CompFlagUnComp;
+    }
+}
+
+bool Comp::IsCompFlag (char Flag) {
+    return Flag == CompFlagUnComp || Flag == CompFlagComp || Flag == CompFlagLZ4;
+}
+
+// guess from a byte histogram of samples spread across the data whether compressing is worth a try
+// compressed and encrypted data (jpeg, video, zip, zstd) uses every byte value about equally often
+// the entropy of random data in the 16 KiB of samples comes out at about 7.99 bits per byte
+bool Comp::Compressible (const char *Buf, size_t Size) {
+    static const size_t SampleSize = 1024;
+    static const size_t Samples    = 16;
+    static const double MaxEntropy = 7.95;  // bits per byte
+
+    // small data is cheap enough to just compress
+    if (Size < 2 * Samples * SampleSize)
+        return true;
+
+    // four histograms so consecutive bytes don't wait on the same counter
+    u32 Hist [4][256] = {};
+    size_t Stride = Size / Samples;
+    for (size_t s = 0; s < Samples; s++) {
+        const u8 *P = (const u8 *) Buf + s * Stride;
+        for (size_t i = 0; i < SampleSize; i += 4) {
+            Hist [0][P[i  ]] ++;
+            Hist [1][P[i+1]] ++;
+            Hist [2][P[i+2]] ++;
+            Hist [3][P[i+3]] ++;
+        }
+    }
+
+    double Total   = Samples * SampleSize;
+    double Entropy = 0;
+    for (int b = 0; b < 256; b++) {
+        u32 Count = Hist [0][b] + Hist [1][b] + Hist [2][b] + Hist [3][b];
+        if (Count) {
+            double P = Count / Total;
+            Entropy -= P * log2 (P);
+        }
+    }
+    return Entropy < MaxEntropy;
+}
+
+u32 Comp::DictID (const string &Dict) {
+    return ZDICT_getDictID (Dict.data(), Dict.size());
+}
+
+u32 Comp::AddDict (const string &Dict) {
+    u32 ID = DictID (Dict);
+    if (!ID)
+        THROW_PBEXCEPTION ("Not a ZSTD dictionary\n");
+
+    unique_lock <shared_mutex> Lock (DDictsMtx);
+    if (!DDicts.count (ID)) {
+        ZSTD_DDict *DDict = ZSTD_createDDict (Dict.data(), Dict.size());
+        if (!DDict)
+            THROW_PBEXCEPTION ("Can't load ZSTD dictionary %u\n", ID);
+        DDicts [ID] = DDict;
+    }
+    return ID;
+}
+
+void Comp::UseDict (const string &Dict) {
+    AddDict (Dict);
+    ZSTD_CDict *NewCDict = ZSTD_createCDict (Dict.data(), Dict.size(), O.CompLevel);
+    if (!NewCDict)
+        THROW_PBEXCEPTION ("Can't load ZSTD dictionary %u\n", DictID (Dict));
+
+    // a replaced dictionary may still be in use by another thread, so it's never freed
+    CDict = NewCDict;
+}
+
+void Comp::LoadDicts (const string &Dir) {
+    if (!fs::is_directory (Dir))
+        return;
+    for (const auto &Entry : fs::directory_iterator (Dir)) {
+        string Name = Entry.path().filename().string();
+        if (Name.substr (0, 5) != "Dict.")
+            continue;
+        string Dict;
+        FILE  *F = Utils::OpenReadBin (Entry.path().string());
+        Utils::ReadBinary (F, Dict, fs::file_size (Entry.path()));
+        fclose (F);
+        AddDict (Dict);
+    }
+}
+
+string Comp::TrainDict (const string &Samples, const vector <size_t> &SampleSizes, size_t DictSize) {
+    string Dict (DictSize, 0);
+    auto RVal = ZDICT_trainFromBuffer (Dict.data(), Dict.size(), Samples.data(), SampleSizes.data(), SampleSizes.size());
+    if (ZDICT_isError (RVal))
+        return "";
+    Dict.resize (RVal);
+    return Dict;
 }
 
 void Comp::Compress (const string &InStr, string &OutStr) {
@@ -43,8 +221,11 @@ void Comp::Compress (eCompType CompType, const string &InStr, string &OutStr) {
         case CompType_ZTSD :
             Compress_ZSTD (InStr, OutStr);
             return;
+        case CompType_LZ4 :
+            Compress_LZ4 (InStr.data(), InStr.size(), OutStr);
+            return;
         default:
-            THROW_PBEXCEPTION ("Illegal compression type: %d", O.CompType);
+            THROW_PBEXCEPTION ("Illegal compression type: %d", CompType);
     }
 }
 
@@ -53,26 +234,100 @@ void Comp::DeCompress (char CompFlag, const string &InStr, string &OutStr) {
 }
 
 void Comp::DeCompress (eCompType CompType, const string &InStr, string &OutStr) {
-    switch (O.CompType) {
+    switch (CompType) {
         case CompType_ZTSD :
             DeCompress_ZSTD (InStr, OutStr);
             break;
+        case CompType_LZ4 :
+            DeCompress_LZ4 (InStr, OutStr);
+            break;
+        default:
+            THROW_PBEXCEPTION ("Illegal compression type: %d", CompType);
+    }
+}
+
+void Comp::Compress (const BufRef &In, BufRef &Out) {
+    Compress (In, Out, O.CompLevel);
+}
+
+void Comp::Compress (const BufRef &In, BufRef &Out, int Level) {
+    switch (O.CompType) {
+        case CompType_ZTSD :
+            Compress_ZSTD (In, Out, Level);
+            return;
+        case CompType_LZ4 :
+            Compress_LZ4 (In, Out);
+            return;
         default:
             THROW_PBEXCEPTION ("Illegal compression type: %d", O.CompType);
     }
 }
 
+void Comp::DeCompress (char CompFlag, const BufRef &In, BufRef &Out) {
+    switch (CompFlag2CompType (CompFlag, O)) {
+        case CompType_ZTSD :
+            DeCompress_ZSTD (In, Out);
+            break;
+        case CompType_LZ4 :
+            DeCompress_LZ4 (In, Out);
+            break;
+        default:
+            THROW_PBEXCEPTION ("Illegal compression flag: %c", CompFlag);
+    }
+}
+
+// compress with a trained dictionary (at the level it was loaded with) or on its own
+static size_t CompressFrame_ZSTD (char *Out, size_t OutSize, const char *In, size_t InSize, int Level) {
+    const ZSTD_CDict *Dict = SmallDict (InSize);
+    if (Dict)
+        return ZSTD_compress_usingCDict (ZSTDThreadCtxs.Comp (Level), Out, OutSize, In, InSize, Dict);
+    return ZSTD_compress2 (ZSTDThreadCtxs.Comp (Level), Out, OutSize, In, InSize);
+}
+
 void Comp::Compress_ZSTD (const string &InStr, string &OutStr) {
     OutStr.resize(ZSTD_COMPRESSBOUND(InStr.size()));
-    auto CompSize = ZSTD_compress (OutStr.data(), OutStr.size(), InStr.data(), InStr.size(), O.CompLevel);
+    auto CompSize = CompressFrame_ZSTD (OutStr.data(), OutStr.size(), InStr.data(), InStr.size(), O.CompLevel);
     if (ZSTD_isError(CompSize))
         THROW_PBEXCEPTION ("ZSTD Decompress error: %s\n", ZSTD_getErrorName (CompSize));
     OutStr.resize (CompSize);
 }
 
+// size of the data in a zstd frame when the frame header records it
+// ZSTD_compress and ZSTD_compress2 always do, so only foreign frames go without
+static bool FrameContentSize (const char *In, size_t InSize, size_t &Size) {
+    auto ContentSize = ZSTD_getFrameContentSize (In, InSize);
+    if (ContentSize == ZSTD_CONTENTSIZE_UNKNOWN || ContentSize == ZSTD_CONTENTSIZE_ERROR)
+        return false;
+    Size = ContentSize;
+    return true;
+}
+
+// trained dictionary a frame was compressed with (NULL for none)
+static const ZSTD_DDict *FrameDict (const char *In, size_t InSize) {
+    u32 ID = ZSTD_getDictID_fromFrame (In, InSize);
+    return ID ? FindDDict (ID) : NULL;
+}
+
+// decompress a whole frame straight into Out, which must be exactly the content size
+static void DeCompressFrame_ZSTD (const char *In, size_t InSize, char *Out, size_t OutSize) {
+    auto RVal = ZSTD_decompress_usingDDict (ZSTDThreadCtxs.DeComp(), Out, OutSize, In, InSize, FrameDict (In, InSize));
+    if (ZSTD_isError(RVal))
+        THROW_PBEXCEPTION ("ZSTD Decompress error: %s\n", ZSTD_getErrorName (RVal));
+    if (RVal != OutSize)
+        THROW_PBEXCEPTION ("ZSTD Decompress error: %lu bytes out of %lu expected\n", RVal, OutSize);
+}
+
 void Comp::DeCompress_ZSTD (const string &InStr, string &OutStr) {
-    ZSTD_DStream* ZSTD = ZSTD_createDStream();
-    ZSTD_initDStream(ZSTD);
+    // one pass into a buffer of the right size when the frame tells us the size
+    size_t ContentSize;
+    if (FrameContentSize (InStr.data(), InStr.size(), ContentSize)) {
+        OutStr.resize (ContentSize);
+        DeCompressFrame_ZSTD (InStr.data(), InStr.size(), OutStr.data(), ContentSize);
+        return;
+    }
+
+    ZSTD_DStream* ZSTD = ZSTDThreadCtxs.DeComp();
+    ZSTD_DCtx_refDDict (ZSTD, FrameDict (InStr.data(), InStr.size()));
 
     unsigned AllocAmt   = O.ChunkSize;
     unsigned TotalAlloc = AllocAmt;
@@ -95,6 +350,140 @@ void Comp::DeCompress_ZSTD (const string &InStr, string &OutStr) {
     } while (in_buf.pos < in_buf.size || out_buf.pos >= out_buf.size);
 
     OutStr.resize(TotalOut);
+}
+
+void Comp::Compress_ZSTD (const BufRef &In, BufRef &Out) {
+    Compress_ZSTD (In, Out, O.CompLevel);
+}
+
+void Comp::Compress_ZSTD (const BufRef &In, BufRef &Out, int Level) {
+    Out.Resize (ZSTD_COMPRESSBOUND (In.Size()));
+    auto CompSize = CompressFrame_ZSTD (Out.Data(), Out.Size(), In.Data(), In.Size(), Level);
+    if (ZSTD_isError(CompSize))
+        THROW_PBEXCEPTION ("ZSTD Compress error: %s\n", ZSTD_getErrorName (CompSize));
+    Out.Resize (CompSize);
+}
+
+void Comp::DeCompress_ZSTD (const BufRef &In, BufRef &Out) {
+    // one pass, reusing Out's buffer if it's big enough
+    size_t ContentSize;
+    if (FrameContentSize (In.Data(), In.Size(), ContentSize)) {
+        Out.Resize (ContentSize);
+        DeCompressFrame_ZSTD (In.Data(), In.Size(), Out.Data(), ContentSize);
+        return;
+    }
+
+    ZSTD_DStream* ZSTD = ZSTDThreadCtxs.DeComp();
+    ZSTD_DCtx_refDDict (ZSTD, FrameDict (In.Data(), In.Size()));
+
+    unsigned AllocAmt   = O.ChunkSize;
+    unsigned TotalAlloc = AllocAmt;
+    unsigned TotalOut   = 0;
+
+    ZSTD_inBuffer  in_buf = {In.Data(), In.Size(), 0};
+    ZSTD_outBuffer out_buf;
+
+    // loop until decompression is complete
+    // the pooled buffer only moves when the data outgrows its size class
+    do {
+        Out.Resize(TotalAlloc);
+        out_buf = {Out.Data(), TotalAlloc, TotalOut};
+        int RVal = ZSTD_decompressStream(ZSTD, &out_buf, &in_buf);
+        if (ZSTD_isError(RVal))
+            THROW_PBEXCEPTION ("ZSTD Decompress error: %s\n", ZSTD_getErrorName (RVal));
+
+        TotalOut     = out_buf.pos;
+        TotalAlloc  += AllocAmt;
+    } while (in_buf.pos < in_buf.size || out_buf.pos >= out_buf.size);
+
+    Out.Resize(TotalOut);
+}
+
+// a chunk that changed in a few places compresses to next to nothing against its old version
+// the base isn't recorded in the frame, the finfo says which chunk it was
+void Comp::Compress_Delta (const BufRef &In, const BufRef &Base, BufRef &Out, int Level) {
+    ZSTD_CCtx *CCtx = ZSTDThreadCtxs.Comp (Level);
+    auto RVal = ZSTD_CCtx_refPrefix (CCtx, Base.Data(), Base.Size());
+    if (ZSTD_isError(RVal))
+        THROW_PBEXCEPTION ("ZSTD Compress error: %s\n", ZSTD_getErrorName (RVal));
+    Out.Resize (ZSTD_COMPRESSBOUND (In.Size()));
+    auto CompSize = ZSTD_compress2 (CCtx, Out.Data(), Out.Size(), In.Data(), In.Size());
+    if (ZSTD_isError(CompSize))
+        THROW_PBEXCEPTION ("ZSTD Compress error: %s\n", ZSTD_getErrorName (CompSize));
+    Out.Resize (CompSize);
+}
+
+void Comp::DeCompress_Delta (const BufRef &In, const BufRef &Base, BufRef &Out) {
+    size_t ContentSize;
+    if (!FrameContentSize (In.Data(), In.Size(), ContentSize))
+        THROW_PBEXCEPTION ("ZSTD Decompress error: delta frame without content size\n");
+    ZSTD_DCtx *DCtx = ZSTDThreadCtxs.DeComp();
+    auto RVal = ZSTD_DCtx_refPrefix (DCtx, Base.Data(), Base.Size());
+    if (ZSTD_isError(RVal))
+        THROW_PBEXCEPTION ("ZSTD Decompress error: %s\n", ZSTD_getErrorName (RVal));
+    Out.Resize (ContentSize);
+    RVal = ZSTD_decompressDCtx (DCtx, Out.Data(), ContentSize, In.Data(), In.Size());
+    if (ZSTD_isError(RVal))
+        THROW_PBEXCEPTION ("ZSTD Decompress error: %s\n", ZSTD_getErrorName (RVal));
+    if (RVal != ContentSize)
+        THROW_PBEXCEPTION ("ZSTD Decompress error: %lu bytes out of %lu expected\n", RVal, ContentSize);
+}
+
+// lz4 state is big enough to keep off the stack, so each thread keeps one
+static thread_local string LZ4State;
+
+static size_t LZ4Bound (size_t InSize) {
+    if (InSize > LZ4_MAX_INPUT_SIZE)
+        THROW_PBEXCEPTION ("LZ4 Compress error: %lu bytes is too big\n", InSize);
+    return 4 + LZ4_COMPRESSBOUND (InSize);
+}
+
+// Out must have room for LZ4Bound (InSize), returns the compressed size
+static size_t CompressBlock_LZ4 (const char *In, size_t InSize, char *Out, size_t OutSize) {
+    if (LZ4State.empty())
+        LZ4State.resize (LZ4_sizeofState());
+    u32 Size = InSize;
+    for (int i = 0; i < 4; i++)
+        Out [i] = Size >> (8 * i);
+    int CompSize = LZ4_compress_fast_extState (LZ4State.data(), In, Out + 4, InSize, OutSize - 4, 1);
+    if (CompSize <= 0)
+        THROW_PBEXCEPTION ("LZ4 Compress error on %lu bytes\n", InSize);
+    return 4 + CompSize;
+}
+
+// size the block says it holds
+static size_t ContentSize_LZ4 (const char *In, size_t InSize) {
+    if (InSize < 4)
+        THROW_PBEXCEPTION ("LZ4 Decompress error: block of %lu bytes is too short\n", InSize);
+    u32 Size = 0;
+    for (int i = 0; i < 4; i++)
+        Size |= (u32) (u8) In [i] << (8 * i);
+    return Size;
+}
+
+// decompress a whole block straight into Out, which must be exactly the content size
+static void DeCompressBlock_LZ4 (const char *In, size_t InSize, char *Out, size_t OutSize) {
+    int RVal = LZ4_decompress_safe (In + 4, Out, InSize - 4, OutSize);
+    if (RVal < 0 || (size_t) RVal != OutSize)
+        THROW_PBEXCEPTION ("LZ4 Decompress error: %d bytes out of %lu expected\n", RVal, OutSize);
+}
+
+void Comp::Compress_LZ4 (const char *In, size_t InSize, string &OutStr) {
+    OutStr.resize (LZ4Bound (InSize));
+    OutStr.resize (CompressBlock_LZ4 (In, InSize, OutStr.data(), OutStr.size()));
+}
+
+void Comp::DeCompress_LZ4 (const string &InStr, string &OutStr) {
+    OutStr.resize (ContentSize_LZ4 (InStr.data(), InStr.size()));
+    DeCompressBlock_LZ4 (InStr.data(), InStr.size(), OutStr.data(), OutStr.size());
+}
+
+void Comp::Compress_LZ4 (const BufRef &In, BufRef &Out) {
+    Out.Resize (LZ4Bound (In.Size()));
+    Out.Resize (CompressBlock_LZ4 (In.Data(), In.Size(), Out.Data(), Out.Size()));
+}
 
-    ZSTD_freeDStream (ZSTD);
+void Comp::DeCompress_LZ4 (const BufRef &In, BufRef &Out) {
+    Out.Resize (ContentSize_LZ4 (In.Data(), In.Size()));
+    DeCompressBlock_LZ4 (In.Data(), In.Size(), Out.Data(), Out.Size());
 }
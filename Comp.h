@@ -5,31 +5,64 @@
 #include "Opts.h"
 
 #include <string>
+#include <vector>
 using namespace std;
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-variable"
 
-static const char CompFlagUnComp = 'U';  // in file list and finfo, signifies uncompressed block
-static const char CompFlagComp   = 'C';  // in file list and finfo, signifies compressed block
+// in file list and finfo, each block records how it was compressed
+static const char CompFlagUnComp = 'U';  // uncompressed block
+static const char CompFlagComp   = 'C';  // zstd compressed block
+static const char CompFlagLZ4    = 'L';  // lz4 compressed block
+static const char CompFlagDelta  = 'D';  // zstd compressed against an earlier chunk (chunks only)
 
-static const char *CompNames [] = {"none", "zstd"};
+static const char *CompNames [] = {"none", "zstd", "lz4"};
 
 class Opts; // needed by circular header dependecies
+class BufRef;
 
 namespace Comp {
     eCompType CompFlag2CompType (char Flag, Opts &O);
     eCompType CompFlag2CompType (char Flag);
     char      CompType2CompFlag (eCompType Type);
+    bool      IsCompFlag        (char Flag);
     eCompType CompNameToEnum    (const string &Name);
+    bool      Compressible      (const char *Buf, size_t Size);
 
     void        Compress   (                    const string &InStr, string &OutStr);
     void        Compress   (eCompType CompType, const string &InStr, string &OutStr);
     void      DeCompress   (eCompType CompType, const string &InStr, string &OutStr);
     void      DeCompress   (char      CompFlag, const string &InStr, string &OutStr);
 
+    // same, with pooled buffers for chunk data
+    void        Compress   (                    const BufRef &In, BufRef &Out);
+    void        Compress   (                    const BufRef &In, BufRef &Out, int Level);
+    void      DeCompress   (char      CompFlag, const BufRef &In, BufRef &Out);
+
+    // trained dictionaries for small blocks
+    // frames record the id of their dictionary, so decompression picks the right one by itself
+    string    TrainDict (const string &Samples, const vector <size_t> &SampleSizes, size_t DictSize); // "" if it can't
+    u32       DictID    (const string &Dict);
+    u32       AddDict   (const string &Dict); // make it known to decompression
+    void      UseDict   (const string &Dict); // ... and compress blocks below O.DictBelow with it
+    void      LoadDicts (const string &Dir);  // every Dict.<id> file in an archive's Extra dir
+
     void        Compress_ZSTD (const string &InStr, string &OutStr);
     void      DeCompress_ZSTD (const string &InStr, string &OutStr);
+    void        Compress_ZSTD (const BufRef &In, BufRef &Out);
+    void        Compress_ZSTD (const BufRef &In, BufRef &Out, int Level);
+    void      DeCompress_ZSTD (const BufRef &In, BufRef &Out);
+
+    // delta chunks: zstd with the plain data of a similar chunk as reference prefix
+    void        Compress_Delta (const BufRef &In, const BufRef &Base, BufRef &Out, int Level);
+    void      DeCompress_Delta (const BufRef &In, const BufRef &Base, BufRef &Out);
+
+    // lz4 blocks start with the uncompressed size (4 bytes, little endian)
+    void        Compress_LZ4  (const char *In, size_t InSize, string &OutStr);
+    void      DeCompress_LZ4  (const string &InStr, string &OutStr);
+    void        Compress_LZ4  (const BufRef &In, BufRef &Out);
+    void      DeCompress_LZ4  (const BufRef &In, BufRef &Out);
 };
 
 
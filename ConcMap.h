@@ -0,0 +1,171 @@
+#ifndef CONCMAP_H
+#define CONCMAP_H
+
+#include "Types.h"
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <functional>
+using namespace std;
+
+// concurrent insert-only hash map
+// keys are spread over shards, each an open addressing table with its own mutex
+// inserts lock just one shard; lookups don't lock at all
+// entries are never moved or removed, so pointers to values stay valid for the life of the map
+// tables outgrown by a shard are kept until the map is destroyed so lock-free readers never see freed memory
+template <class K, class V, class H = hash <K>>
+class ConcMap {
+    class Node {
+        public:
+        K   Key;
+        V   Val;
+        u64 Hash;
+        Node (const K &key, const V &val, u64 hash) : Key (key), Val (val), Hash (hash) {}
+    };
+
+    class Table {
+        public:
+        u64             Mask;   // slots - 1
+        atomic <Node*> *Slots;
+        Table (u64 NumSlots) {
+            Mask  = NumSlots - 1;
+            Slots = new atomic <Node*> [NumSlots];
+            for (u64 i = 0; i < NumSlots; i++)
+                Slots[i].store (NULL, memory_order_relaxed);
+        }
+        ~Table () {
+            delete [] Slots;
+        }
+    };
+
+    class Shard {
+        public:
+        mutex           Mtx;     // serializes inserts
+        atomic <Table*> Tab;     // current table
+        u64             Count;   // entries in Tab
+        vector <Table*> Retired; // outgrown tables, freed with the map
+        Shard () : Tab (new Table (16)), Count (0) {}
+    };
+
+    static const unsigned NumShards = 64; // power of 2
+    Shard Shards [NumShards];
+    H     Hasher;
+
+    // mix the key hash since std::hash of integers is the identity
+    u64 HashOf (const K &Key) const {
+        u64 h = Hasher (Key);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+    Shard &ShardOf (u64 Hash) {
+        return Shards [Hash & (NumShards - 1)];
+    }
+    static Node *Probe (const Table *T, const K &Key, u64 Hash) {
+        for (u64 i = (Hash >> 6) & T->Mask;; i = (i + 1) & T->Mask) {
+            Node *N = T->Slots[i].load (memory_order_acquire);
+            if (!N)
+                return NULL;
+            if (N->Hash == Hash && N->Key == Key)
+                return N;
+        }
+    }
+    static void Place (Table *T, Node *N) {
+        u64 i = (N->Hash >> 6) & T->Mask;
+        while (T->Slots[i].load (memory_order_relaxed))
+            i = (i + 1) & T->Mask;
+        T->Slots[i].store (N, memory_order_release);
+    }
+
+    // double the table of a shard (called with the shard locked)
+    void Grow (Shard &S) {
+        Table *Old = S.Tab.load (memory_order_relaxed);
+        Table *New = new Table ((Old->Mask + 1) * 2);
+        for (u64 i = 0; i <= Old->Mask; i++)
+            if (Node *N = Old->Slots[i].load (memory_order_relaxed))
+                Place (New, N);
+        S.Tab.store (New, memory_order_release);
+        S.Retired.push_back (Old);
+    }
+
+    public:
+    ConcMap () {}
+    ConcMap (const ConcMap&) = delete;
+    ConcMap &operator= (const ConcMap&) = delete;
+    ~ConcMap () {
+        for (auto &S : Shards) {
+            Table *T = S.Tab.load();
+            for (u64 i = 0; i <= T->Mask; i++)
+                delete T->Slots[i].load();
+            delete T;
+            for (auto R : S.Retired)
+                delete R;
+        }
+    }
+
+    // lock-free lookup, NULL if the key isn't there
+    V *Find (const K &Key) {
+        u64   Hash = HashOf (Key);
+        Node *N    = Probe (ShardOf (Hash).Tab.load (memory_order_acquire), Key, Hash);
+        return N ? &N->Val : NULL;
+    }
+    bool Contains (const K &Key) {
+        return Find (Key) != NULL;
+    }
+
+    // add Key with Val unless Key is already there
+    // returns the value in the map and sets Inserted if it was added by this call
+    V *Insert (const K &Key, const V &Val, bool &Inserted) {
+        u64    Hash = HashOf (Key);
+        Shard &S    = ShardOf (Hash);
+        unique_lock <mutex> lock (S.Mtx);
+
+        Table *T = S.Tab.load (memory_order_relaxed);
+        if (Node *N = Probe (T, Key, Hash)) {
+            Inserted = false;
+            return &N->Val;
+        }
+
+        // keep load under 3/4
+        if ((S.Count + 1) * 4 > (T->Mask + 1) * 3) {
+            Grow (S);
+            T = S.Tab.load (memory_order_relaxed);
+        }
+        Node *N = new Node (Key, Val, Hash);
+        Place (T, N);
+        S.Count ++;
+        Inserted = true;
+        return &N->Val;
+    }
+    bool Insert (const K &Key, const V &Val) {
+        bool Inserted;
+        Insert (Key, Val, Inserted);
+        return Inserted;
+    }
+
+    // number of entries - only exact when no inserts are in flight
+    u64 Size () {
+        u64 Count = 0;
+        for (auto &S : Shards) {
+            unique_lock <mutex> lock (S.Mtx);
+            Count += S.Count;
+        }
+        return Count;
+    }
+
+    // visit every entry (in no particular order) - not safe against concurrent inserts
+    void ForEach (function <void(const K&, V&)> Func) {
+        for (auto &S : Shards) {
+            Table *T = S.Tab.load (memory_order_acquire);
+            for (u64 i = 0; i <= T->Mask; i++)
+                if (Node *N = T->Slots[i].load (memory_order_acquire))
+                    Func (N->Key, N->Val);
+        }
+    }
+};
+
+#endif // CONCMAP_H
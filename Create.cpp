@@ -3,6 +3,7 @@
 #include "Logging.h"
 #include "Utils.h"
 #include "ThreadPool.h"
+#include "StatBatch.h"
 using namespace Utils;
 
 #include <string>
@@ -10,9 +11,14 @@ using namespace Utils;
 #include <filesystem>
 #include <iostream>
 #include <algorithm>
+#include <dirent.h>
 using namespace std;
 namespace fs = std::filesystem;
 
+// max number of names handed to a walker worker at once
+// bounds the work a single huge directory can pin on one worker
+static const unsigned WalkBatchSize = 256;
+
 Create::Create () {
     Repo = new RepoInfo (O.RepoDirName);
 
@@ -35,19 +41,23 @@ Create::Create () {
     }
 
     Arch = new ArchiveCreate (Repo, ArchName, ArchBase);
+
+    // batched stats need a working io_uring
+    if (O.StatURing && !StatBatch::Available()) {
+        WARN ("io_uring not available, using synchronous stats\n");
+        O.StatURing = false;
+    }
+
+    Walker = new DirWalker (O.WalkThreads, WalkBatchSize,
+                            [this](WalkBatch &Batch, unsigned WorkerIdx){DoCreateBatch (Batch, WorkerIdx);});
 }
 
 Create::~Create () {
-    for (auto Itr : Inodes) {
-        u32 Dev = Itr.first;
-        map <u64, InodeInfo*> &INodeMap = Itr.second;
-        for (auto Itr : Inodes[Dev]) {
-            u64        InodeNum = Itr.first;
-            InodeInfo *Inode    = Itr.second;
-            assert (Inode);
-            delete Inode;
-        }
-    }
+    Inodes.ForEach ([](const DevIno &Key, InodeInfo *&Inode) {
+        assert (Inode);
+        delete Inode;
+    });
+    delete Walker;
     delete Arch;
     if (ArchBase)
         delete ArchBase;
@@ -79,11 +89,14 @@ void Create::DoCreate () {
 
     // archive the root dirs
     for (auto Dir : Sorted)
-        DoCreate (Dir, 0);
+        DoCreate (Dir);
 
-    // do the user-specified dirs
+    // walk the user-specified dirs
+    WalkBatch Args;
     for (auto Dir : O.FileArgs)
-        DoCreate (CanonizeFileName(Dir));
+        Args.Names.push_back (CanonizeFileName(Dir));
+    Walker->Push (0, Args);
+    Walker->Walk ();
 
     // wait for threads to complete
     ThreadPool.WaitIdle();
@@ -91,28 +104,86 @@ void Create::DoCreate () {
     Repo->Finish(O.ArchDirName);
 }
 
-void Create::DoCreate (const string &Name, bool Recurse) {
+// archive a batch of names from the walker
+// sub dirs/files of any directories go back to the walker
+void Create::DoCreateBatch (WalkBatch &Batch, unsigned WorkerIdx) {
+    // harvest the metadata of the whole batch in one go if we can
+    // the directories it opens are counted as open until their LiveFiles are done with them
+    // (past the limit they're left for OpenDir to open when listed)
+    static const vector <u8> NoTypes;
+    vector <StatResult> Pre;
+    bool HavePre = false;
+    if (O.StatURing && Batch.Dir && Batch.Dir->Fd >= 0) {
+        int  Dirs     = count (Batch.Types.begin(), Batch.Types.end(), DT_DIR);
+        bool OpenDirs = Dirs && ReserveDirFds (Dirs);
+        HavePre = StatBatch::Stat (Batch.Dir->Fd, Batch.Names, OpenDirs ? Batch.Types : NoTypes, Pre);
+        if (OpenDirs) {
+            for (auto &Res : Pre)
+                Dirs -= HavePre && Res.DirFd >= 0;
+            ReleaseDirFds (Dirs);
+        }
+    }
+
+    for (unsigned i = 0; i < Batch.Names.size(); i++) {
+        LiveFile *LF;
+        if (Batch.Dir)
+            LF = new LiveFile (Batch.Dir, Batch.Names[i], Batch.Types.size() ? Batch.Types[i] : DT_UNKNOWN, HavePre ? &Pre[i] : NULL);
+        else
+            LF = new LiveFile (Batch.Names[i]);
+
+        WalkBatch Subs;
+        DoCreate (LF, &Subs);
+        Walker->Push (WorkerIdx, Subs);
+    }
+}
+
+void Create::DoCreate (const string &Name) {
+    DoCreate (new LiveFile (Name), NULL);
+}
+
+// archive one file
+// if Subs is given, return the contents of directories
+void Create::DoCreate (LiveFile *LF, WalkBatch *Subs) {
+    string Name = LF->Name;
     if (O.ShowFiles)
         cout << Name << endl;
 
-    // create local and archive file structures
-    LiveFile       *LF   = new LiveFile (Name);
-    vecstr          Subs = LF->GetSubs();
+    // list directory contents
+    // either relative to an open directory or as full path names
+    if (Subs && LF->IsDir()) {
+        if (O.FdWalk) {
+            Subs->Dir = LF->OpenDir();
+            LiveFile::ListDir (Subs->Dir, Subs->Names, Subs->Types);
+        } else {
+            Subs->Names = LF->GetSubs();
+        }
+    }
+
+    // create archive file structure
     ArchFileCreate *AF   = new ArchFileCreate (Arch, LF);
 
     // if the device and inode has already been seen, process hard link
     InodeInfo *INode = NULL;
-    if (u32 INodeNum = LF->INode()) {
-        u32 Dev = LF->Dev();
-
-        InodesMtx.lock();
+    if (u64 INodeNum = LF->INode()) {
+        DevIno Key = {LF->Dev(), INodeNum};
+
+        // remember the first instance of this dev/inode combo
+        // if another thread got there first, this one is a link to it
+        bool        Inserted = false;
+        InodeInfo **Found    = Inodes.Find (Key);
+        if (Found) {
+            INode = *Found;
+        } else {
+            InodeInfo *NewINode = new InodeInfo;
+            NewINode->ListEntry.Name = Name;
+            NewINode->Complete       = false;
+            INode = *Inodes.Insert (Key, NewINode, Inserted);
+            if (!Inserted)
+                delete NewINode;
+        }
 
-        if (Inodes.count (Dev) && Inodes [Dev].count(INodeNum)) {
+        if (!Inserted) {
             // this dev/inode combo has been seen before
-            INode = Inodes [Dev][INodeNum];
-
-            InodesMtx.unlock();
-
             // create the link
             assert (INode);
             function <void()> Task = [=](){AF->CreateLink(INode);};
@@ -120,31 +191,10 @@ void Create::DoCreate (const string &Name, bool Recurse) {
 
             // that's all
             return;
-        } else {
-            // remember the first instance of this dev/inode combo
-            INode = new InodeInfo;
-            INode->ListEntry.Name  = Name;
-            INode->Complete        = false;
-            Inodes [Dev][INodeNum] = INode;
         }
-
-        InodesMtx.unlock();
     }
 
     // create the archived file
     function <void()> Task = [=](){AF->Create(INode);};
     ThreadPool.Execute (Task, 0);
-
-    // create sub dirs/files
-    if (Recurse)
-        for (auto &Sub : Subs) {
-            function <void()> Task = [=,this](){DoCreate (Sub);};
-
-            // this severely slows everything down
-            // consumes too many threads, I guess
-            //ThreadPool.Execute (Task);
-
-            // just run it here
-            (Task)();
-        }
 }
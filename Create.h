@@ -4,24 +4,40 @@
 #include "LiveFile.h"
 #include "RepoInfo.h"
 #include "Archive.h"
+#include "DirWalker.h"
+#include "ConcMap.h"
 
 #include <string>
 #include <vector>
 #include <map>
 using namespace std;
 
+// identifies an inode across block devices
+class DevIno {
+    public:
+    u64 Dev;
+    u64 Ino;
+    bool operator== (const DevIno &Other) const {return Dev == Other.Dev && Ino == Other.Ino;}
+};
+class DevInoHash {
+    public:
+    size_t operator() (const DevIno &DI) const {return DI.Ino ^ (DI.Dev * 0x9e3779b97f4a7c15ULL);}
+};
+
 class Create {
     public:
     RepoInfo       *Repo;      // information about current repository
     ArchiveCreate  *Arch;      // information about current archive
     ArchiveBase    *ArchBase;  // information about base archive
-    map <u32, map <u64, InodeInfo*>> Inodes; // archive info for each inode of each block device
-    mutex                            InodesMtx; // avoid races accessing Inodes
+    ConcMap <DevIno, InodeInfo*, DevInoHash> Inodes; // archive info for each inode of each block device
+    DirWalker      *Walker;    // parallel traversal of the file args
 
      Create ();
     ~Create ();
     void DoCreate ();
-    void DoCreate (const string &Dir, bool Recurse = 1);
+    void DoCreate (const string &Name);
+    void DoCreate (LiveFile *LF, WalkBatch *Subs);
+    void DoCreateBatch (WalkBatch &Batch, unsigned WorkerIdx);
 };
 
 #endif // CREATE_H
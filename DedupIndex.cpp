@@ -0,0 +1,80 @@
+#include "DedupIndex.h"
+#include "Logging.h"
+
+#include <stdlib.h>
+using namespace std;
+
+DedupIndex::DedupIndex (u64 ExpectedChunks) {
+    DBGCTOR;
+
+    // at least 32 bits per expected chunk (4 probes) so the filter
+    // stays sparse as chunks get added during the create
+    u64 Bits = 1 << 20;
+    while (Bits < ExpectedChunks * 32)
+        Bits <<= 1;
+    BloomMask = Bits - 1;
+    Bloom     = new atomic <u64> [Bits / 64];
+    for (u64 i = 0; i < Bits / 64; i++)
+        Bloom[i].store (0, memory_order_relaxed);
+
+    Lookups     = 0;
+    BloomMisses = 0;
+    Hits        = 0;
+    HitBytes    = 0;
+    TotalBytes  = 0;
+}
+
+DedupIndex::~DedupIndex () {
+    DBGDTOR;
+    delete [] Bloom;
+}
+
+bool DedupIndex::KeyOf (const string &HashHex, DedupKey &Key) {
+    if (HashHex.size() < 32)
+        return false;
+    char Part [17];
+    Part[16] = 0;
+    HashHex.copy (Part, 16, 0);
+    Key.Hi = strtoull (Part, NULL, 16);
+    HashHex.copy (Part, 16, 16);
+    Key.Lo = strtoull (Part, NULL, 16);
+    return true;
+}
+
+bool DedupIndex::Find (const string &HashHex, u64 Size, ChunkRef &Ref) {
+    DedupKey Key;
+    if (!KeyOf (HashHex, Key))
+        return false;
+    Lookups    ++;
+    TotalBytes += Size;
+
+    // any clear bit means the hash was never added
+    for (int i = 0; i < BloomProbes; i++) {
+        u64 Bit = (Key.Lo + i * Key.Hi) & BloomMask;
+        if (!(Bloom[Bit / 64].load (memory_order_relaxed) & (1ULL << (Bit % 64)))) {
+            BloomMisses ++;
+            return false;
+        }
+    }
+
+    ChunkRef *Found = Map.Find (Key);
+    if (!Found)
+        return false;
+    Ref = *Found;
+    Hits     ++;
+    HitBytes += Size;
+    return true;
+}
+
+void DedupIndex::Add (const string &HashHex, const ChunkRef &Ref) {
+    DedupKey Key;
+    if (!KeyOf (HashHex, Key))
+        return;
+
+    // set the bloom bits after the insert so a lookup that passes the filter finds the entry
+    Map.Insert (Key, Ref);
+    for (int i = 0; i < BloomProbes; i++) {
+        u64 Bit = (Key.Lo + i * Key.Hi) & BloomMask;
+        Bloom[Bit / 64].fetch_or (1ULL << (Bit % 64), memory_order_release);
+    }
+}
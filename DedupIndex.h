@@ -0,0 +1,61 @@
+#ifndef DEDUPINDEX_H
+#define DEDUPINDEX_H
+
+#include "Types.h"
+#include "ConcMap.h"
+
+#include <string>
+#include <atomic>
+using namespace std;
+
+// first 128 bits of a chunk hash
+class DedupKey {
+    public:
+    u64 Hi;
+    u64 Lo;
+    bool operator== (const DedupKey &Other) const {return Hi == Other.Hi && Lo == Other.Lo;}
+};
+class DedupKeyHash {
+    public:
+    size_t operator() (const DedupKey &Key) const {return Key.Lo;}
+};
+
+// where a chunk with a given hash is already stored
+class ChunkRef {
+    public:
+    i64  ChunkIdx;
+    char CompFlag;
+    bool InBase;    // block is in the base archive and has to be linked, else already in this archive
+    const RefArchive *Ref; // archive actually holding a base block (for BlockRefs)
+    u64  Sum;       // checksum of the block as stored
+};
+
+// chunk hash -> stored chunk, for every chunk of the base archive and the archive being created
+// a bloom filter in front answers most misses (i.e. new data) without touching the map
+class DedupIndex {
+    ConcMap <DedupKey, ChunkRef, DedupKeyHash> Map;
+    atomic <u64> *Bloom;      // bloom filter bits
+    u64           BloomMask;  // bits - 1
+
+    static const int BloomProbes = 4;
+
+    public:
+    // statistics for the log
+    atomic <u64> Lookups;      // chunks looked up
+    atomic <u64> BloomMisses;  // lookups rejected by the bloom filter
+    atomic <u64> Hits;         // chunks found
+    atomic <u64> HitBytes;     // uncompressed bytes not written thanks to hits
+    atomic <u64> TotalBytes;   // uncompressed bytes looked up
+
+     DedupIndex (u64 ExpectedChunks);
+    ~DedupIndex ();
+
+    // hashes under 128 bits collide too easily to dedup on
+    static bool KeyOf (const string &HashHex, DedupKey &Key);
+
+    bool Find (const string &HashHex, u64 Size, ChunkRef &Ref);
+    void Add  (const string &HashHex, const ChunkRef &Ref);
+    u64  Size () {return Map.Size();}
+};
+
+#endif // DEDUPINDEX_H
@@ -0,0 +1,82 @@
+#include "DictTrainer.h"
+#include "Comp.h"
+#include "Opts.h"
+#include "Logging.h"
+#include "Utils.h"
+
+#include <filesystem>
+namespace fs = std::filesystem;
+
+DictTrainer::DictTrainer (const string &extradir) {
+    ExtraDir = extradir;
+    Done     = false;
+    ID       = 0;
+    Source   = "none";
+
+    // keep using the dictionary linked in from the base archive
+    string DictPath = ExtraDir + "/Dict";
+    if (fs::exists (DictPath)) {
+        string Dict;
+        FILE  *F = Utils::OpenReadBin (DictPath);
+        Utils::ReadBinary (F, Dict, fs::file_size (DictPath));
+        fclose (F);
+        Comp::UseDict (Dict);
+        ID     = Comp::DictID (Dict);
+        Source = "base archive";
+        Done   = true;
+    }
+}
+
+DictTrainer::~DictTrainer () {
+}
+
+void DictTrainer::Sample (const char *Buf, size_t Size) {
+    if (Done || Size >= O.DictBelow)
+        return;
+
+    lock_guard <mutex> Lock (Mtx);
+    if (Done)
+        return;
+    Samples.append (Buf, Size);
+    SampleSizes.push_back (Size);
+    if (Samples.size() >= SampleTarget)
+        Train ();
+}
+
+// called with Mtx held
+void DictTrainer::Train () {
+    Done = true;
+    string Dict = Comp::TrainDict (Samples, SampleSizes, DictSize);
+    Source = to_string (SampleSizes.size()) + " samples";
+    Samples.clear();
+    Samples.shrink_to_fit();
+    SampleSizes.clear();
+    if (!Dict.size())
+        return;
+    Save (Dict);
+    Comp::UseDict (Dict);
+    ID = Comp::DictID (Dict);
+}
+
+void DictTrainer::Finish () {
+    lock_guard <mutex> Lock (Mtx);
+    if (Done)
+        return;
+    Done = true;
+
+    // not enough small blocks this time, but the next archive can still use it
+    string Dict = Comp::TrainDict (Samples, SampleSizes, DictSize);
+    if (!Dict.size())
+        return;
+    Save (Dict);
+    Comp::AddDict (Dict);
+    Source = to_string (SampleSizes.size()) + " samples, for the next archive";
+}
+
+void DictTrainer::Save (const string &Dict) {
+    string DictPath = ExtraDir + "/Dict." + to_string (Comp::DictID (Dict));
+    FILE  *F = Utils::OpenWriteBin (DictPath);
+    Utils::WriteBinary (F, Dict);
+    fclose (F);
+    Utils::MakeHardLink (DictPath, ExtraDir + "/Dict");
+}
@@ -0,0 +1,43 @@
+#ifndef DICTTRAINER_H
+#define DICTTRAINER_H
+
+#include "Types.h"
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+using namespace std;
+
+// zstd dictionary for the small blocks of an archive (finfo, tiny files, file tails)
+// an archive keeps using its base archive's dictionary (Extra/Dict)
+// without one, the first small blocks of the run are sampled and a dictionary is trained from them
+// blocks compressed before it's ready go without
+// every dictionary is kept as Extra/Dict.<id> (see Comp::LoadDicts)
+class DictTrainer {
+    string          ExtraDir;
+    mutex           Mtx;
+    string          Samples;
+    vector <size_t> SampleSizes;
+    atomic <bool>   Done;       // no more samples wanted
+
+    void Train ();
+    void Save  (const string &Dict);
+
+    public:
+    static const size_t DictSize     = 112 << 10;
+    static const size_t SampleTarget = 8 * DictSize;  // sample bytes to train from
+
+    // statistics for the log
+    u32    ID;       // dictionary in use, 0 for none
+    string Source;   // where it came from
+
+     DictTrainer (const string &extradir);
+    ~DictTrainer ();
+
+    void Sample (const char *Buf, size_t Size);
+    void Sample (const string &Str) {Sample (Str.data(), Str.size());}
+    void Finish ();  // train from what was sampled, for the next archive to use
+};
+
+#endif // DICTTRAINER_H
@@ -0,0 +1,131 @@
+#include "DirWalker.h"
+#include "Logging.h"
+
+#include <iterator>
+#include <algorithm>
+using namespace std;
+
+DirWalker::DirWalker (unsigned NumWorkers, unsigned batchsize, VisitFunc visit) {
+    DBGCTOR;
+    if (NumWorkers < 1)
+        NumWorkers = 1;
+    BatchSize = batchsize ? batchsize : 1;
+    Visit     = visit;
+    Pending   = 0;
+    WorkSeq   = 0;
+    Idle      = 0;
+    for (unsigned i = 0; i < NumWorkers; i++)
+        Workers.push_back (new Worker);
+}
+
+DirWalker::~DirWalker () {
+    DBGDTOR;
+    for (auto W : Workers)
+        delete W;
+}
+
+// add names to a worker's deque
+// big lists are split so other workers can steal parts of huge directories
+void DirWalker::Push (unsigned WorkerIdx, WalkBatch &Subs) {
+    if (!Subs.Names.size())
+        return;
+
+    Worker *W = Workers [WorkerIdx % Workers.size()];
+    W->Mtx.lock();
+    for (size_t Start = 0; Start < Subs.Names.size(); Start += BatchSize) {
+        size_t End = min (Subs.Names.size(), Start + BatchSize);
+        W->Work.emplace_back ();
+        WalkBatch &Batch = W->Work.back();
+        Batch.Dir = Subs.Dir;
+        Batch.Names.assign (make_move_iterator (Subs.Names.begin() + Start),
+                            make_move_iterator (Subs.Names.begin() + End));
+        if (Subs.Types.size())
+            Batch.Types.assign (Subs.Types.begin() + Start, Subs.Types.begin() + End);
+        Pending ++;
+    }
+    W->Mtx.unlock();
+
+    // wake up any parked workers
+    WorkSeq ++;
+    if (Idle) {
+        unique_lock<mutex> lock(IdleMtx);
+        IdleCV.notify_all();
+    }
+}
+
+// owner takes the newest batch (depth first keeps the deques short)
+bool DirWalker::Pop (unsigned WorkerIdx, WalkBatch &Batch) {
+    Worker *W = Workers [WorkerIdx];
+    unique_lock<mutex> lock(W->Mtx);
+    if (W->Work.empty())
+        return false;
+    Batch = move (W->Work.back());
+    W->Work.pop_back();
+    return true;
+}
+
+// thieves take the oldest batch, which is usually closest to the top of the tree
+bool DirWalker::Steal (unsigned WorkerIdx, WalkBatch &Batch) {
+    unsigned N = Workers.size();
+    for (unsigned i = 1; i < N; i++) {
+        Worker *W = Workers [(WorkerIdx + i) % N];
+        unique_lock<mutex> lock(W->Mtx);
+        if (W->Work.empty())
+            continue;
+        Batch = move (W->Work.front());
+        W->Work.pop_front();
+        DBG ("DirWalker: worker %u stole from %u\n", WorkerIdx, (WorkerIdx + i) % N);
+        return true;
+    }
+    return false;
+}
+
+void DirWalker::Run (unsigned WorkerIdx) {
+    while (1) {
+        u64       Seen = WorkSeq;
+        WalkBatch Batch;
+        if (Pop (WorkerIdx, Batch) || Steal (WorkerIdx, Batch)) {
+            Visit (Batch, WorkerIdx);
+
+            // last batch done - release everyone
+            if (--Pending == 0) {
+                unique_lock<mutex> lock(IdleMtx);
+                IdleCV.notify_all();
+            }
+            continue;
+        }
+
+        if (Pending == 0)
+            break;
+
+        // nothing to steal right now, park until something is pushed or the walk completes
+        Idle ++;
+        {
+            unique_lock<mutex> lock(IdleMtx);
+            IdleCV.wait (lock, [&]{return WorkSeq != Seen || Pending == 0;});
+        }
+        Idle --;
+    }
+}
+
+// calling thread acts as worker 0
+void DirWalker::Walk () {
+    for (unsigned i = 1; i < Workers.size(); i++) {
+        Workers[i]->Thr = new thread ([this, i]() {
+            try {
+                Run (i);
+            }
+            catch (PB_Exception &E) {
+                E.Handle();
+            }
+        });
+    }
+
+    Run (0);
+
+    for (unsigned i = 1; i < Workers.size(); i++) {
+        Workers[i]->Thr->join();
+        delete Workers[i]->Thr;
+        Workers[i]->Thr = NULL;
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef DIRWALKER_H
+#define DIRWALKER_H
+
+#include "Types.h"
+#include "LiveFile.h"
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+using namespace std;
+
+// a group of names to be visited
+class WalkBatch {
+    public:
+    DirHandlePtr Dir;    // open directory containing the names, NULL if names are full paths
+    vecstr       Names;  // names within Dir (or full paths)
+    vector <u8>  Types;  // d_type of each name, if known
+};
+
+// parallel directory tree walker
+// each worker owns a deque of pending batches of names
+// owners work depth first from the back of their own deque
+// idle workers steal the oldest (usually biggest) batches from the front of other deques
+class DirWalker {
+    public:
+    // called for each batch of names - worker index identifies the caller's deque for Push
+    typedef function <void(WalkBatch &Batch, unsigned WorkerIdx)> VisitFunc;
+
+    private:
+    class Worker {
+        public:
+        deque <WalkBatch> Work; // pending batches
+        mutex             Mtx;  // protects Work
+        thread           *Thr;  // NULL for the worker run by the calling thread
+        Worker () : Thr (NULL) {}
+    };
+
+    vector <Worker *>  Workers;
+    VisitFunc          Visit;
+    unsigned           BatchSize;  // max names per batch (bounds fan-out of huge directories)
+    atomic <i64>       Pending;    // batches pushed but not yet finished
+    atomic <u64>       WorkSeq;    // bumped on every push so idle workers can detect new work
+    atomic <unsigned>  Idle;       // workers waiting for work
+    mutex              IdleMtx;    // used with IdleCV to park idle workers
+    condition_variable IdleCV;
+
+    bool Pop   (unsigned WorkerIdx, WalkBatch &Batch);
+    bool Steal (unsigned WorkerIdx, WalkBatch &Batch);
+    void Run   (unsigned WorkerIdx);
+
+    public:
+     DirWalker (unsigned NumWorkers, unsigned batchsize, VisitFunc visit);
+    ~DirWalker ();
+
+    void Push (unsigned WorkerIdx, WalkBatch &Subs); // queue names, split into batches
+    void Walk ();                                   // process everything pushed, return when done
+};
+
+#endif // DIRWALKER_H
@@ -1,40 +1,215 @@
 #include "Hash.h"
 #include "Logging.h"
+#include "BufPool.h"
+#include "HashBatch.h"
 
 #include <mhash.h>
+#include <blake3.h>
+#include <xxhash.h>
+#include <immintrin.h>
+#include <string.h>
 #include <string>
 using namespace std;
 
+// sha256 round constants
+alignas(16) static const uint32_t ShaK [64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint32_t ShaInit [8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+// run whole 64 byte blocks through sha256 using the sha extensions
+// each pass of the loop does 4 rounds, scheduling the message words 12 rounds ahead
+__attribute__((target("sha,sse4.1")))
+static void ShaNiBlocks (uint32_t State [8], const uint8_t *Data, size_t NumBlocks) {
+    const __m128i Swap = _mm_set_epi64x (0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // state is kept as ABEF and CDGH the way sha256rnds2 wants it
+    __m128i Tmp    = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i*) &State [0]), 0xB1);
+    __m128i State1 = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i*) &State [4]), 0x1B);
+    __m128i State0 = _mm_alignr_epi8 (Tmp, State1, 8);
+    State1         = _mm_blend_epi16 (State1, Tmp, 0xF0);
+
+    for (; NumBlocks; NumBlocks--, Data += 64) {
+        __m128i Save0 = State0;
+        __m128i Save1 = State1;
+        __m128i Msg [4];
+        #pragma GCC unroll 16
+        for (int i = 0; i < 16; i++) {
+            if (i < 4)
+                Msg [i] = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i*) (Data + i * 16)), Swap);
+            __m128i Words = _mm_add_epi32 (Msg [i % 4], _mm_load_si128 ((const __m128i*) &ShaK [i * 4]));
+            State1 = _mm_sha256rnds2_epu32 (State1, State0, Words);
+            if (i >= 3 && i < 15) {
+                __m128i &Next = Msg [(i + 1) % 4];
+                Next = _mm_add_epi32 (Next, _mm_alignr_epi8 (Msg [i % 4], Msg [(i + 3) % 4], 4));
+                Next = _mm_sha256msg2_epu32 (Next, Msg [i % 4]);
+            }
+            State0 = _mm_sha256rnds2_epu32 (State0, State1, _mm_shuffle_epi32 (Words, 0x0E));
+            if (i >= 1 && i < 13)
+                Msg [(i + 3) % 4] = _mm_sha256msg1_epu32 (Msg [(i + 3) % 4], Msg [i % 4]);
+        }
+        State0 = _mm_add_epi32 (State0, Save0);
+        State1 = _mm_add_epi32 (State1, Save1);
+    }
+
+    Tmp    = _mm_shuffle_epi32 (State0, 0x1B);
+    State1 = _mm_shuffle_epi32 (State1, 0xB1);
+    _mm_storeu_si128 ((__m128i*) &State [0], _mm_blend_epi16 (Tmp, State1, 0xF0));
+    _mm_storeu_si128 ((__m128i*) &State [4], _mm_alignr_epi8 (State1, Tmp, 8));
+}
+
+static bool HaveShaNi () {
+    static const bool Have = __builtin_cpu_supports ("sha") && __builtin_cpu_supports ("sse4.1");
+    return Have;
+}
+
+eHashImpl HashImplOf (eHashType T) {
+    switch (T) {
+        case HashType_SHA256: return HaveShaNi() ? HashImpl_ShaNi : HashImpl_MHash;
+        case HashType_BLAKE3: return HashImpl_Blake3;
+        case HashType_XXH3  : return HashImpl_XXH3;
+        default             : return HashImpl_MHash;
+    }
+}
+
+const char *HashImplName (eHashType T) {
+    switch (HashImplOf (T)) {
+        case HashImpl_ShaNi : return "sha-ni";
+        case HashImpl_Blake3: return "blake3";
+        case HashImpl_XXH3  : return "xxhash";
+        default             : return "mhash";
+    }
+}
+
 Hash::Hash (eHashType T) {
     if (T >= HashType_Null)
         THROW_PBEXCEPTION ("Unrecognized hash type: %d", T);
-    Hasher = mhash_init (MHashTypes [T]);
-    assert (Hasher != NULL);
-    HashSize = mhash_get_block_size(MHashTypes [T]);
+    Impl = HashImplOf (T);
+    switch (Impl) {
+        case HashImpl_ShaNi:
+            memcpy (Sha.State, ShaInit, sizeof (Sha.State));
+            Sha.BufLen = 0;
+            Sha.Len    = 0;
+            HashSize   = 32;
+            break;
+        case HashImpl_Blake3:
+            blake3_hasher_init (&Blake3);
+            HashSize = BLAKE3_OUT_LEN;
+            break;
+        case HashImpl_XXH3:
+            XXH3 = XXH3_createState ();
+            assert (XXH3 != NULL);
+            XXH3_128bits_reset (XXH3);
+            HashSize = sizeof (XXH128_canonical_t);
+            break;
+        default:
+            Hasher = mhash_init (MHashTypes [T]);
+            assert (Hasher != NULL);
+            HashSize = mhash_get_block_size(MHashTypes [T]);
+    }
 }
 
 Hash::~Hash () {
+    if (XXH3)
+        XXH3_freeState (XXH3);
 }
 
 void Hash::Update (const char *Buf, int BufSize) {
-    mhash (Hasher, Buf, BufSize);
+    switch (Impl) {
+        case HashImpl_ShaNi: {
+            const uint8_t *In = (const uint8_t*) Buf;
+            size_t         N  = BufSize;
+            Sha.Len += N;
+            if (Sha.BufLen) {
+                size_t Take = min (N, 64 - Sha.BufLen);
+                memcpy (Sha.Buf + Sha.BufLen, In, Take);
+                Sha.BufLen += Take;
+                In += Take;
+                N  -= Take;
+                if (Sha.BufLen < 64)
+                    break;
+                ShaNiBlocks (Sha.State, Sha.Buf, 1);
+                Sha.BufLen = 0;
+            }
+            ShaNiBlocks (Sha.State, In, N / 64);
+            memcpy (Sha.Buf, In + N / 64 * 64, N % 64);
+            Sha.BufLen = N % 64;
+            break;
+        }
+        case HashImpl_Blake3:
+            blake3_hasher_update (&Blake3, Buf, BufSize);
+            break;
+        case HashImpl_XXH3:
+            XXH3_128bits_update (XXH3, Buf, BufSize);
+            break;
+        default:
+            mhash (Hasher, Buf, BufSize);
+    }
 }
 
 string Hash::GetHash () {
-    unsigned char *HashBin = (unsigned char *)mhash_end_m (Hasher, (void * (*)(unsigned int)) malloc);
-    string HashHex;
-    // TBD: do more than one byte at a time
-    for (int i = 0; i < HashSize; i++) {
-        char Hex [3];
-        snprintf (Hex, 3, "%02x", HashBin[i]);
-        HashHex.append(Hex);
-    }
-    free (HashBin);
+    unsigned char  Out [64];
+    unsigned char *HashBin = Out;
+    switch (Impl) {
+        case HashImpl_ShaNi: {
+            // pad with 0x80, zeros and the bit length to a whole block
+            uint64_t Bits = Sha.Len * 8;
+            Sha.Buf [Sha.BufLen++] = 0x80;
+            if (Sha.BufLen > 56) {
+                memset (Sha.Buf + Sha.BufLen, 0, 64 - Sha.BufLen);
+                ShaNiBlocks (Sha.State, Sha.Buf, 1);
+                Sha.BufLen = 0;
+            }
+            memset (Sha.Buf + Sha.BufLen, 0, 56 - Sha.BufLen);
+            for (int i = 0; i < 8; i++)
+                Sha.Buf [56 + i] = Bits >> (56 - i * 8);
+            ShaNiBlocks (Sha.State, Sha.Buf, 1);
+            for (int i = 0; i < 8; i++)
+                for (int j = 0; j < 4; j++)
+                    Out [i * 4 + j] = Sha.State [i] >> (24 - j * 8);
+            break;
+        }
+        case HashImpl_Blake3:
+            blake3_hasher_finalize (&Blake3, Out, BLAKE3_OUT_LEN);
+            break;
+        case HashImpl_XXH3:
+            XXH128_canonicalFromHash ((XXH128_canonical_t*) Out, XXH3_128bits_digest (XXH3));
+            break;
+        default:
+            HashBin = (unsigned char *)mhash_end_m (Hasher, (void * (*)(unsigned int)) malloc);
+    }
+    string HashHex = HexStr (HashBin, HashSize);
+    if (HashBin != Out)
+        free (HashBin);
     return HashHex;
 }
 
+string HexStr (const unsigned char *Bin, int Size) {
+    static const char Digits [] = "0123456789abcdef";
+    string Hex (Size * 2, 0);
+    for (int i = 0; i < Size; i++) {
+        Hex [i * 2]     = Digits [Bin[i] >> 4];
+        Hex [i * 2 + 1] = Digits [Bin[i] & 15];
+    }
+    return Hex;
+}
+
 string Hash::HashStr (const string &Str) {
-    Update (Str.data(), Str.size());
+    return HashStr (Str.data(), Str.size());
+}
+
+string Hash::HashStr (const char *Buf, size_t BufSize) {
+    Update (Buf, BufSize);
     return GetHash();
 }
 
@@ -50,3 +225,22 @@ string HashStr (eHashType T, const string &Str) {
     Hash Hasher(T);
     return Hasher.HashStr (Str);
 }
+
+// chunk data, which may be hashed along with other threads' chunks
+string HashStr (eHashType T, const BufRef &Buf) {
+    if (HashBatch.Usable (T))
+        return HashBatch.HashStr (Buf.Data(), Buf.Size());
+    Hash Hasher(T);
+    return Hasher.HashStr (Buf.Data(), Buf.Size());
+}
+
+uint64_t StoredSum (const BufRef &Buf) {
+    uint64_t Sum = XXH3_64bits (Buf.Data(), Buf.Size());
+    return Sum ? Sum : 1; // 0 means no checksum
+}
+
+string SumStr (uint64_t Sum) {
+    char Str [17];
+    snprintf (Str, sizeof (Str), "%016lx", Sum);
+    return Str;
+}
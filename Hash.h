@@ -2,6 +2,8 @@
 #define HASH_H
 
 #include <mhash.h>
+#include <blake3.h>
+#include <xxhash.h>
 #include <string>
 using namespace std;
 
@@ -10,20 +12,43 @@ typedef enum {
     HashType_CRC32,
     HashType_SHA1,
     HashType_SHA256,
+    HashType_BLAKE3,
+    HashType_XXH3,
     HashType_Null,  // denotes end of list
 } eHashType;
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-variable"
 
-static const char *  HashNames [] = {"MD5", "CRC32", "SHA1", "SHA256"};
-static const hashid  MHashTypes [] = {MHASH_MD5, MHASH_CRC32, MHASH_SHA1, MHASH_SHA256};
+static const char *  HashNames [] = {"MD5", "CRC32", "SHA1", "SHA256", "BLAKE3", "XXH3"};
+static const hashid  MHashTypes [] = {MHASH_MD5, MHASH_CRC32, MHASH_SHA1, MHASH_SHA256}; // types done by mhash
 
 #pragma GCC diagnostic pop
 
+// implementation actually doing a hash type, picked at run time from what the cpu supports
+typedef enum {
+    HashImpl_MHash = 0,
+    HashImpl_ShaNi,     // sha256 with the x86 sha extensions
+    HashImpl_Blake3,    // libblake3, which picks its own sse/avx2/avx512 code
+    HashImpl_XXH3,      // xxh3 128 bit
+} eHashImpl;
+
+class BufRef;
+
 class Hash {
-    MHASH Hasher;
-    int HashSize;
+    eHashImpl Impl;
+    int       HashSize;
+
+    // state of whichever implementation is in use
+    MHASH          Hasher = NULL;
+    blake3_hasher  Blake3;
+    XXH3_state_t  *XXH3 = NULL;
+    struct {
+        uint32_t State [8];
+        uint8_t  Buf [64];
+        size_t   BufLen;
+        uint64_t Len;
+    } Sha;
 
     public:
     Hash (eHashType T);
@@ -31,10 +56,19 @@ class Hash {
     void   Update  (const char *Buf, int BufSize);
     string GetHash ();
     string HashStr (const string &Str);
+    string HashStr (const char *Buf, size_t BufSize);
 };
 
-eHashType HashNameToEnum (const string &Name);
+eHashType   HashNameToEnum (const string &Name);
+eHashImpl   HashImplOf     (eHashType T);
+const char *HashImplName   (eHashType T);
 
+string HexStr  (const unsigned char *Bin, int Size);
 string HashStr (eHashType T, const string &Str);
+string HashStr (eHashType T, const BufRef &Buf);
+
+// checksum of a block as stored (xxh3 64 bit), so it can be checked without decompressing
+uint64_t StoredSum (const BufRef &Buf);
+string   SumStr    (uint64_t Sum);
 
 #endif // HASH_H
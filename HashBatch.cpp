@@ -0,0 +1,179 @@
+#include "HashBatch.h"
+#include "Hash.h"
+#include "Opts.h"
+#include "Logging.h"
+
+#include <immintrin.h>
+#include <string.h>
+#include <chrono>
+
+// global hash batcher
+HashBatch_t HashBatch;
+
+HashBatch_t::HashBatch_t () : Batches (0), Batched (0), Alone (0) {
+}
+
+bool HashBatch_t::Usable (eHashType T) {
+    static const bool HaveAVX2 = __builtin_cpu_supports ("avx2");
+    return T == HashType_MD5 && HaveAVX2 && O.HashWait > 0;
+}
+
+string HashBatch_t::HashStr (const char *Buf, size_t Size) {
+    Req R;
+    R.Buf  = Buf;
+    R.Size = Size;
+
+    unique_lock <mutex> Lock (Mtx);
+    if (Open) {
+        // join the open batch and wait for its leader to hash it
+        Open->Reqs [Open->Num++] = &R;
+        if (Open->Num == Lanes) {
+            Open = NULL;
+            Cond.notify_all();
+        }
+        Cond.wait (Lock, [&]() {return R.Done;});
+    } else {
+        // lead a new batch
+        Batch B;
+        B.Reqs [B.Num++] = &R;
+        Open = &B;
+        Cond.wait_for (Lock, chrono::microseconds (O.HashWait), [&]() {return B.Num == Lanes;});
+        if (Open == &B)
+            Open = NULL;
+        Lock.unlock();
+
+        if (B.Num == 1) {
+            Alone++;
+            Hash Hasher (HashType_MD5);
+            return Hasher.HashStr (Buf, Size);
+        }
+        MD5Lanes (B.Reqs, B.Num);
+        Batches++;
+        Batched += B.Num;
+
+        Lock.lock();
+        for (u32 i = 0; i < B.Num; i++)
+            B.Reqs [i]->Done = true;
+        Cond.notify_all();
+    }
+    Lock.unlock();
+    return HexStr (R.Digest, sizeof (R.Digest));
+}
+
+// md5 tables: sine derived constants, rotations and message word order of each step
+static const u32 MD5K [64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+static const u32 MD5S [64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+static const u32 MD5G [64] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+    1, 6, 11, 0, 5, 10, 15, 4, 9, 14, 3, 8, 13, 2, 7, 12,
+    5, 8, 11, 14, 1, 4, 7, 10, 13, 0, 3, 6, 9, 12, 15, 2,
+    0, 7, 14, 5, 12, 3, 10, 1, 8, 15, 6, 13, 4, 11, 2, 9,
+};
+
+// one lane: the chunk itself, then one or two blocks of padding and length
+class MD5Lane {
+    public:
+    const u8 *Data;
+    size_t    Whole;      // whole blocks in the chunk
+    size_t    Blocks;     // including padding
+    size_t    Next = 0;
+    u8        Tail [128];
+
+    void Init (const char *Buf, size_t Size) {
+        Data   = (const u8*) Buf;
+        Whole  = Size / 64;
+        size_t Rest = Size % 64;
+        Blocks = Whole + (Rest < 56 ? 1 : 2);
+        memset (Tail, 0, sizeof (Tail));
+        memcpy (Tail, Data + Whole * 64, Rest);
+        Tail [Rest] = 0x80;
+        u64 Bits = (u64) Size * 8;
+        memcpy (Tail + (Blocks - Whole) * 64 - 8, &Bits, 8);
+    }
+    const u8 *Block () {
+        return Next < Whole ? Data + Next * 64 : Tail + (Next - Whole) * 64;
+    }
+};
+
+// md5 of up to 8 chunks at once, 32 bit lane i of each register belongs to chunk i
+// lanes that are done (or unused) keep running on a block of zeros and are ignored
+__attribute__((target("avx2")))
+void HashBatch_t::MD5Lanes (Req **Reqs, u32 Num) {
+    static const u8 Zeros [64] = {};
+    MD5Lane Lane [Lanes];
+    for (u32 l = 0; l < Num; l++)
+        Lane[l].Init (Reqs[l]->Buf, Reqs[l]->Size);
+
+    __m256i A = _mm256_set1_epi32 (0x67452301);
+    __m256i B = _mm256_set1_epi32 (0xefcdab89);
+    __m256i C = _mm256_set1_epi32 (0x98badcfe);
+    __m256i D = _mm256_set1_epi32 (0x10325476);
+
+    for (u32 Left = Num; Left;) {
+        // gather word w of each lane's block into one register
+        const u8 *P [Lanes];
+        for (u32 l = 0; l < Lanes; l++)
+            P[l] = l < Num && Lane[l].Next < Lane[l].Blocks ? Lane[l].Block() : Zeros;
+        __m256i M [16];
+        for (int w = 0; w < 16; w++) {
+            u32 V [Lanes];
+            for (u32 l = 0; l < Lanes; l++)
+                memcpy (&V[l], P[l] + w * 4, 4);
+            M[w] = _mm256_loadu_si256 ((const __m256i*) V);
+        }
+
+        __m256i AA = A, BB = B, CC = C, DD = D;
+        #pragma GCC unroll 64
+        for (int i = 0; i < 64; i++) {
+            __m256i F;
+            if (i < 16)
+                F = _mm256_xor_si256 (D, _mm256_and_si256 (B, _mm256_xor_si256 (C, D)));
+            else if (i < 32)
+                F = _mm256_xor_si256 (C, _mm256_and_si256 (D, _mm256_xor_si256 (B, C)));
+            else if (i < 48)
+                F = _mm256_xor_si256 (_mm256_xor_si256 (B, C), D);
+            else
+                F = _mm256_xor_si256 (C, _mm256_or_si256 (B, _mm256_xor_si256 (D, _mm256_set1_epi32 (-1))));
+            F = _mm256_add_epi32 (_mm256_add_epi32 (F, A), _mm256_add_epi32 (_mm256_set1_epi32 (MD5K[i]), M[MD5G[i]]));
+            F = _mm256_or_si256 (_mm256_sll_epi32 (F, _mm_cvtsi32_si128 (MD5S[i])), _mm256_srl_epi32 (F, _mm_cvtsi32_si128 (32 - MD5S[i])));
+            A = D;
+            D = C;
+            C = B;
+            B = _mm256_add_epi32 (B, F);
+        }
+        A = _mm256_add_epi32 (A, AA);
+        B = _mm256_add_epi32 (B, BB);
+        C = _mm256_add_epi32 (C, CC);
+        D = _mm256_add_epi32 (D, DD);
+
+        // lanes that just took their last block have their digest
+        u32 SA [Lanes], SB [Lanes], SC [Lanes], SD [Lanes];
+        _mm256_storeu_si256 ((__m256i*) SA, A);
+        _mm256_storeu_si256 ((__m256i*) SB, B);
+        _mm256_storeu_si256 ((__m256i*) SC, C);
+        _mm256_storeu_si256 ((__m256i*) SD, D);
+        for (u32 l = 0; l < Num; l++) {
+            if (Lane[l].Next >= Lane[l].Blocks || ++Lane[l].Next < Lane[l].Blocks)
+                continue;
+            memcpy (Reqs[l]->Digest +  0, &SA[l], 4);
+            memcpy (Reqs[l]->Digest +  4, &SB[l], 4);
+            memcpy (Reqs[l]->Digest +  8, &SC[l], 4);
+            memcpy (Reqs[l]->Digest + 12, &SD[l], 4);
+            Left--;
+        }
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef HASHBATCH_H
+#define HASHBATCH_H
+
+#include "Types.h"
+
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#include <string>
+using namespace std;
+
+// hashes chunks from concurrent callers together, one chunk per simd lane
+// the first caller of a batch waits up to --HashWait microseconds for the lanes to fill
+// then hashes the whole batch while the others wait for their results
+// a caller still alone when the wait is up is hashed the usual way
+class HashBatch_t {
+    public:
+    static const u32 Lanes = 8;    // md5 streams per avx2 register
+
+    private:
+    class Req {
+        public:
+        const char   *Buf;
+        size_t        Size;
+        unsigned char Digest [16];
+        bool          Done = false;
+    };
+    class Batch {
+        public:
+        Req *Reqs [Lanes];
+        u32  Num = 0;
+    };
+
+    mutex               Mtx;
+    condition_variable  Cond;
+    Batch              *Open = NULL;   // batch taking new requests, if any
+
+    static void MD5Lanes (Req **Reqs, u32 Num);
+
+    public:
+    // statistics for the log
+    atomic <u64>        Batches;   // batches hashed in lanes
+    atomic <u64>        Batched;   // chunks hashed in those batches
+    atomic <u64>        Alone;     // chunks hashed by themselves
+
+    HashBatch_t ();
+
+    bool   Usable (eHashType T);
+    string HashStr (const char *Buf, size_t Size);
+};
+
+// global hash batcher
+extern HashBatch_t HashBatch;
+
+#endif // HASHBATCH_H
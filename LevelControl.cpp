@@ -0,0 +1,86 @@
+#include "LevelControl.h"
+#include "Logging.h"
+#include "Utils.h"
+
+#include <thread>
+#include <sstream>
+#include <iomanip>
+
+LevelControl::LevelControl (int mn, int mx, int start) : Chunks (mx + 1) {
+    Min      = mn;
+    Max      = mx;
+    Level    = start < Min ? Min : start > Max ? Max : start;
+    Dropped  = 0;
+    Depth    = 0;
+    High     = max (thread::hardware_concurrency(), 2u);
+    Low      = max (High / 4, 1u);
+    WinStart = Utils::TimeNowNs ();
+    WinBytes = 0;
+    WinDepth = 0;
+    WinReads = 0;
+    for (auto &Count : Chunks)
+        Count = 0;
+}
+
+LevelControl::~LevelControl () {
+}
+
+void LevelControl::Read (u64 Bytes) {
+    WinDepth += Depth++;
+    WinReads ++;
+    WinBytes += Bytes;
+
+    u64 Now = Utils::TimeNowNs ();
+    if (Now - WinStart >= Window && Mtx.try_lock()) {
+        if (Now - WinStart >= Window)
+            Adjust (Now);
+        Mtx.unlock();
+    }
+}
+
+void LevelControl::Used (int Lvl) {
+    Chunks [Lvl] ++;
+}
+
+void LevelControl::Done () {
+    Depth --;
+}
+
+// called with Mtx held
+void LevelControl::Adjust (u64 Now) {
+    double AvgDepth = WinReads ? (double) WinDepth / WinReads : 0;
+    double MiBps    = WinBytes / 1048576.0 / ((Now - WinStart) / 1e9);
+    int    Old      = Level;
+    if (AvgDepth > High && Old > Min)
+        Level = Old - 1;
+    else if (AvgDepth < Low && Old < Max)
+        Level = Old + 1;
+
+    if (Level != Old && Changes.size() >= MaxChanges)
+        Dropped ++;
+    else if (Level != Old) {
+        stringstream Change;
+        Change << fixed << setprecision (2)
+               << "   " << (Now - O.StartTime) / 1e9 << " s: " << Old << " -> " << Level
+               << " (" << AvgDepth << " chunks waiting, reading " << MiBps << " MiB/s)\n";
+        Changes.push_back (Change.str());
+    }
+
+    WinStart = Now;
+    WinBytes = 0;
+    WinDepth = 0;
+    WinReads = 0;
+}
+
+string LevelControl::Summary () {
+    stringstream S;
+    S << "Compression Level: adaptive " << Min << " to " << Max << ", chunks at each level:";
+    for (int l = Min; l <= Max; l++)
+        S << " " << l << ":" << Chunks[l];
+    S << "\n";
+    for (auto &Change : Changes)
+        S << Change;
+    if (Dropped)
+        S << "   ... and " << Dropped << " more changes\n";
+    return S.str();
+}
@@ -0,0 +1,51 @@
+#ifndef LEVELCONTROL_H
+#define LEVELCONTROL_H
+
+#include "Types.h"
+
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <vector>
+using namespace std;
+
+// picks the zstd level for each new chunk during create (--AdaptLevel)
+// chunks read but not yet compressed pile up when compression can't keep up with reading:
+// the level goes down when more of them than there are cpus are waiting on average,
+// and up when few are, i.e. the workers are idle waiting for data
+// the level is checked every Window, and steps by one at a time
+class LevelControl {
+    int           Min, Max;
+    atomic <int>  Level;
+    atomic <u32>  Depth;       // chunks read and not yet compressed
+    u32           High, Low;   // average depths that move the level
+    mutex         Mtx;         // one thread adjusts at a time
+    u64           WinStart;    // ns
+    atomic <u64>  WinBytes;    // read during the current window
+    atomic <u64>  WinDepth;    // sum of the depth seen by each read ...
+    atomic <u64>  WinReads;    // ... and how many there were
+
+    void Adjust (u64 Now);
+
+    public:
+    static const u64    Window     = 250000000;  // ns
+    static const size_t MaxChanges = 1000;       // kept for the log
+
+    // statistics for the log
+    vector <atomic <u64>> Chunks;    // chunks compressed at each level
+    vector <string>       Changes;   // when and why the level moved
+    u64                   Dropped;   // changes beyond MaxChanges
+
+     LevelControl (int mn, int mx, int start);
+    ~LevelControl ();
+
+    int  Get () const {return Level;}
+
+    void Read (u64 Bytes);  // a chunk was read and is waiting to be compressed
+    void Used (int Lvl);    // ... was compressed at this level
+    void Done ();           // ... and is out of the way (compressed or not)
+
+    string Summary ();
+};
+
+#endif // LEVELCONTROL_H
@@ -0,0 +1,186 @@
+#include "ListStream.h"
+#include "Logging.h"
+#include "Utils.h"
+
+static const u32 ZstdMagic     = 0xFD2FB528;
+static const u32 SkipMagic     = 0x184D2A5E; // skippable frame holding the seek table
+static const u32 SeekableMagic = 0x8F92EAB1;
+
+static void PutU32 (string &Str, u32 Val) {
+    for (int i = 0; i < 4; i++)
+        Str += (char) (Val >> (8 * i));
+}
+
+ListStream::ListStream () {
+    F          = NULL;
+    Writing    = false;
+    Zstd       = false;
+    Pos        = 0;
+    InPos      = 0;
+    FrameLeft  = 0;
+    CCtx       = NULL;
+    DCtx       = NULL;
+    FrameLines = 0;
+    Lines      = 0;
+}
+
+ListStream::~ListStream () {
+    Close ();
+    ZSTD_freeCCtx (CCtx);
+    ZSTD_freeDCtx (DCtx);
+}
+
+void ListStream::OpenRead (const string &path) {
+    Path    = path;
+    F       = Utils::OpenReadBin (Path);
+    Writing = false;
+
+    // a compressed list starts with a zstd frame
+    u8 Magic [4] = {};
+    Zstd = fread (Magic, 1, 4, F) == 4
+        && (Magic[0] | Magic[1] << 8 | Magic[2] << 16 | (u32) Magic[3] << 24) == ZstdMagic;
+    if (Zstd && !DCtx && !(DCtx = ZSTD_createDCtx()))
+        THROW_PBEXCEPTION ("Can't create ZSTD decompression context");
+    Rewind ();
+}
+
+void ListStream::Rewind () {
+    if (fseek (F, 0, SEEK_SET))
+        THROW_PBEXCEPTION_IO ("Can't rewind %s", Path.c_str());
+    if (Zstd)
+        ZSTD_DCtx_reset (DCtx, ZSTD_reset_session_only);
+    Text.clear();
+    Pos       = 0;
+    In.clear();
+    InPos     = 0;
+    FrameLeft = 0;
+}
+
+bool ListStream::Fill () {
+    // drop the lines already handed out
+    Text.erase (0, Pos);
+    Pos = 0;
+
+    size_t Old = Text.size();
+    if (!Zstd) {
+        Text.resize (Old + ReadSize);
+        size_t Got = fread (Text.data() + Old, 1, ReadSize, F);
+        Text.resize (Old + Got);
+        return Got;
+    }
+
+    // decode until some text comes out
+    // the seek table is a skippable frame, the decoder steps over it
+    while (1) {
+        if (InPos == In.size()) {
+            In.resize (ReadSize);
+            In.resize (fread (In.data(), 1, ReadSize, F));
+            InPos = 0;
+            if (In.empty()) {
+                if (FrameLeft)
+                    THROW_PBEXCEPTION_FMT ("%s ends in the middle of a zstd frame", Path.c_str());
+                return false;
+            }
+        }
+
+        Text.resize (Old + ReadSize);
+        ZSTD_inBuffer  InBuf  = {In.data(),   In.size(),   InPos};
+        ZSTD_outBuffer OutBuf = {Text.data(), Text.size(), Old};
+        FrameLeft = ZSTD_decompressStream (DCtx, &OutBuf, &InBuf);
+        if (ZSTD_isError (FrameLeft))
+            THROW_PBEXCEPTION_FMT ("ZSTD Decompress error in %s: %s", Path.c_str(), ZSTD_getErrorName (FrameLeft));
+        InPos = InBuf.pos;
+        Text.resize (OutBuf.pos);
+        if (OutBuf.pos > Old)
+            return true;
+    }
+}
+
+bool ListStream::GetLine (string &Line) {
+    size_t Start = Pos;
+    while (1) {
+        size_t NL = Text.find ('\n', Start);
+        if (NL != string::npos) {
+            Line.assign (Text, Pos, NL - Pos);
+            Pos = NL + 1;
+            return true;
+        }
+        Start = Text.size() - Pos;  // where the search stopped, once Fill has moved the text down
+        if (!Fill ())
+            break;
+    }
+
+    // last line without a newline
+    if (Pos == Text.size())
+        return false;
+    Line = Text.substr (Pos);
+    Pos  = Text.size();
+    return true;
+}
+
+void ListStream::OpenWrite (const string &path, u32 framelines, int Level) {
+    Path       = path;
+    F          = Utils::OpenWriteBin (Path);
+    Writing    = true;
+    FrameLines = framelines;
+    Zstd       = FrameLines;
+    Lines      = 0;
+    Frames.clear();
+    if (!Zstd)
+        return;
+
+    if (!CCtx && !(CCtx = ZSTD_createCCtx()))
+        THROW_PBEXCEPTION ("Can't create ZSTD compression context");
+    ZSTD_CCtx_setParameter (CCtx, ZSTD_c_compressionLevel, Level);
+    ZSTD_CCtx_setParameter (CCtx, ZSTD_c_checksumFlag, 1);
+}
+
+void ListStream::Write (const string &Line) {
+    if (!Zstd) {
+        Utils::WriteBinary (F, Line);
+        return;
+    }
+    Text += Line;
+    if (++Lines >= FrameLines)
+        PutFrame ();
+}
+
+void ListStream::PutFrame () {
+    string Frame (ZSTD_compressBound (Text.size()), 0);
+    auto Size = ZSTD_compress2 (CCtx, Frame.data(), Frame.size(), Text.data(), Text.size());
+    if (ZSTD_isError (Size))
+        THROW_PBEXCEPTION_FMT ("ZSTD Compress error in %s: %s", Path.c_str(), ZSTD_getErrorName (Size));
+    Utils::WriteBinary (F, Frame.data(), Size);
+    Frames.push_back ({Size, Text.size()});
+    Text.clear();
+    Lines = 0;
+}
+
+void ListStream::Close () {
+    if (!F)
+        return;
+
+    if (Writing && Zstd) {
+        if (Lines)
+            PutFrame ();
+
+        // seek table: a skippable frame of (compressed, plain) sizes, then the frame count and markers
+        if (Frames.size()) {
+            string Table;
+            PutU32 (Table, SkipMagic);
+            PutU32 (Table, Frames.size() * 8 + 9);
+            for (auto &Frame : Frames) {
+                PutU32 (Table, Frame.first);
+                PutU32 (Table, Frame.second);
+            }
+            PutU32 (Table, Frames.size());
+            Table += (char) 0;  // descriptor: no per-frame checksums (each frame has its own)
+            PutU32 (Table, SeekableMagic);
+            Utils::WriteBinary (F, Table);
+        }
+    }
+
+    if (fclose (F) && Writing)
+        THROW_PBEXCEPTION_IO ("Can't write %s", Path.c_str());
+    F = NULL;
+}
@@ -0,0 +1,49 @@
+#ifndef LISTSTREAM_H
+#define LISTSTREAM_H
+
+#include "Types.h"
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <zstd.h>
+using namespace std;
+
+// the List file of an archive, one line per entry
+// written as independent zstd frames of FrameLines entries each, followed by a seek table
+// in the zstd seekable format, so a reader can start at any frame
+// with FrameLines 0 it's plain text, which is what older archives have (reading tells them apart)
+class ListStream {
+    string      Path;
+    FILE       *F;
+    bool        Writing;
+    bool        Zstd;       // compressed list, else plain text
+    string      Text;       // read: decoded text not yet handed out; write: entries of the current frame
+    size_t      Pos;        // read: start of the next line in Text
+    string      In;         // read: compressed bytes not yet decoded
+    size_t      InPos;
+    size_t      FrameLeft;  // read: 0 when the decoder is between frames
+    ZSTD_CCtx  *CCtx;
+    ZSTD_DCtx  *DCtx;
+    u32         FrameLines; // write: entries per frame (0 for plain text)
+    u32         Lines;      // write: entries in the current frame
+    vector <pair <u32, u32>> Frames; // write: compressed and plain size of each frame, for the seek table
+
+    static const size_t ReadSize = 1 << 20;
+
+    bool Fill     ();   // decode more text, false at the end of the file
+    void PutFrame ();
+
+    public:
+     ListStream ();
+    ~ListStream ();
+
+    void OpenRead  (const string &path);
+    void OpenWrite (const string &path, u32 framelines, int Level);
+    bool GetLine   (string &Line);      // without the newline, false at the end
+    void Rewind    ();                  // back to the first entry
+    void Write     (const string &Line); // one entry, with its newline
+    void Close     ();
+};
+
+#endif // LISTSTREAM_H
@@ -12,17 +12,122 @@ using namespace Utils;
 #include <vector>
 #include <filesystem>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <atomic>
 using namespace std;
 
+// number of directory fds open for create and the most we want open at once
+// counted when opened (or reserved for a stat batch), whether a DirHandle or a LiveFile holds them
+static atomic <int> DirHandlesOpen (0);
+static int MaxOpenDirHandles () {
+    // worked out once, by whichever walker thread gets here first
+    static const int Max = [] {
+        struct rlimit Lim;
+        int Lim4 = getrlimit (RLIMIT_NOFILE, &Lim) == 0 && Lim.rlim_cur != RLIM_INFINITY ? Lim.rlim_cur / 4 : 1024;
+        return max (Lim4, 16);
+    } ();
+    return Max;
+}
+
+DirHandle::DirHandle (int fd, const string &path) {
+    Fd   = fd;
+    Path = path;
+}
+
+DirHandle::~DirHandle () {
+    Close ();
+}
+
+void DirHandle::Close () {
+    if (Fd < 0)
+        return;
+    close (Fd);
+    Fd = -1;
+    DirHandlesOpen --;
+}
+
+bool ReserveDirFds (int Count) {
+    if (DirHandlesOpen.fetch_add (Count) + Count <= MaxOpenDirHandles())
+        return true;
+    DirHandlesOpen -= Count;
+    return false;
+}
+
+void ReleaseDirFds (int Count) {
+    DirHandlesOpen -= Count;
+}
+
+// full path name of an entry within a directory
+static string SubName (const string &Dir, const string &Leaf) {
+    if (Dir == "/")
+        return Dir + Leaf;
+    return Dir + "/" + Leaf;
+}
+
 // for create
 LiveFile::LiveFile (const string &name) {
     DBGCTOR;
     Name = name;
-    F = NULL;
+    InitCreate (DT_UNKNOWN, NULL);
+}
+
+// for create, relative to an already open directory
+// Pre is the file's metadata if it was already harvested by a batched stat
+LiveFile::LiveFile (const DirHandlePtr &parent, const string &leaf, u8 DType, const StatResult *Pre) {
+    DBGCTOR;
+    Parent = parent;
+    Leaf   = leaf;
+    Name   = SubName (Parent->Path, Leaf);
+    InitCreate (DType, Pre);
+}
+
+// fd and name to use for *at() system calls
+// falls back to the full path if there's no open parent
+int LiveFile::AtFd () const {
+    return Parent && Parent->Fd >= 0 ? Parent->Fd : AT_FDCWD;
+}
+
+const char *LiveFile::AtName () const {
+    return Parent && Parent->Fd >= 0 ? Leaf.c_str() : Name.c_str();
+}
+
+void LiveFile::InitCreate (u8 DType, const StatResult *Pre) {
+    F     = NULL;
+    CDC   = NULL;
+    DirFd = -1;
 
     // get file info
-    if (lstat (Name.c_str(), &Stats) < 0)
+    // batched stat results are used as is (a failed directory open is retried in OpenDir)
+    // directories (known from d_type) are opened first and stat'ed through the fd
+    // so the name is only looked up once
+    // the destructor doesn't run if this throws, so a directory fd is closed here first
+    if (Pre) {
+        if (Pre->Err) {
+            if (Pre->DirFd >= 0) {
+                close (Pre->DirFd);
+                DirHandlesOpen --;
+            }
+            errno = Pre->Err;
+            THROW_PBEXCEPTION_IO ("Can't stat file: %s", Name.c_str());
+        }
+        DirFd = Pre->DirFd;
+        Stats = Pre->Stats;
+    } else if (DType == DT_DIR) {
+        DirFd = openat (AtFd(), AtName(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (DirFd >= 0)
+            DirHandlesOpen ++;
+        if (DirFd >= 0 && fstat (DirFd, &Stats) < 0) {
+            int Err = errno;
+            close (DirFd);
+            DirFd = -1;
+            DirHandlesOpen --;
+            errno = Err;
+            THROW_PBEXCEPTION_IO ("Can't stat file: %s", Name.c_str());
+        }
+    }
+    if (!Pre && DirFd < 0 && fstatat (AtFd(), AtName(), &Stats, AT_SYMLINK_NOFOLLOW) < 0)
         THROW_PBEXCEPTION_IO ("Can't stat file: %s", Name.c_str());
 
     // type-specific actions
@@ -33,7 +138,7 @@ LiveFile::LiveFile (const string &name) {
     } else if (IsSocket()) {
     } else if (IsSLink ()) {
         char Targ [1000];
-        int TargSize = readlink (Name.c_str(), Targ, sizeof(Targ));
+        int TargSize = readlinkat (AtFd(), AtName(), Targ, sizeof(Targ));
         if (TargSize < 0)
             THROW_PBEXCEPTION_IO ("Can't read symbolic link '%s'", Name.c_str());
         if (TargSize >= 1000)
@@ -44,33 +149,26 @@ LiveFile::LiveFile (const string &name) {
     }
 }
 
-void ExtractChunkJob (const ChunkInfo *Chunk, const BlockList *ChunkBlocks, i64 BlockIdx, FILE *F, BusyLock *Lock, BusyLock *PrevLock) {
-    string ChunkData;
-    ChunkBlocks->SlurpBlock (BlockIdx, ChunkData);
-
-    // handle decompress
-    string *SelData = &ChunkData;
-    string DeCompressed;
-    if (Chunk->CompFlag != CompFlagUnComp) {
-        Comp::DeCompress (Chunk->CompFlag, ChunkData, DeCompressed);
-        SelData = &DeCompressed;
-    }
+void ExtractChunkJob (const ChunkInfo *Chunk, const BlockList *ChunkBlocks, ChunkCache *Reader, FILE *F, BusyLock *Lock, BusyLock *PrevLock) {
+    // the chunk may be held by an earlier archive, or be a delta against other chunks
+    BufRef ChunkData;
+    Reader->Read (*Chunk, ChunkBlocks, ChunkData);
 
-    string ChunkDataHash = HashStr (O.HashType, *SelData);
+    string ChunkDataHash = HashStr (O.HashType, ChunkData);
     if (ChunkDataHash != Chunk->Hash)
         THROW_PBEXCEPTION_FMT ("Hash mismatch on data chunk #%llu", Chunk->ChunkIdx);
 
     if (PrevLock)
         PrevLock->WaitIdle();
 
-    WriteBinary (F, *SelData);
+    WriteBinary (F, ChunkData);
 
     Lock->PostIdle();
 }
 
 // for extract, etc
 LiveFile::LiveFile (const FileListEntry &ListEntry
-                   ,const vector <ChunkInfo> &Chunks , const BlockList *ChunkBlocks
+                   ,const vector <ChunkInfo> &Chunks , const BlockList *ChunkBlocks, ChunkCache *Reader
                    ,vector <DirAttribRec> &DirAttribs, mutex *DirAttribsMtx
                    ,bool DoHLink
                    ) {
@@ -79,6 +177,8 @@ LiveFile::LiveFile (const FileListEntry &ListEntry
     Stats      = ListEntry.Stats;
     LinkTarget = ListEntry.LinkTarget;
     F          = NULL;
+    CDC        = NULL;
+    DirFd      = -1;
 
     // if extracting, create the file now
     if (O.Operation == Opts::DoExtract) {
@@ -112,6 +212,11 @@ LiveFile::LiveFile (const FileListEntry &ListEntry
             BusyLock *PrevLock = NULL;
 
             FILE *F = OpenWriteBin (Name);
+
+            // tiny file contents come straight from the list
+            if (ListEntry.Inline.size())
+                WriteBinary (F, ListEntry.Inline);
+
             for (auto ChunkItr = Chunks.begin(); ChunkItr != Chunks.end(); ChunkItr++) {
                 const ChunkInfo &Chunk = *ChunkItr;
 
@@ -122,11 +227,11 @@ LiveFile::LiveFile (const FileListEntry &ListEntry
                 // avoid deadlock if NumThreads==1 (because this function uses a thread)
                 if (O.NumThreads > 1 && ChunkItr != (Chunks.end()-1)) {
                     function <void()> Task = [=]() {
-                        ExtractChunkJob (&Chunk, ChunkBlocks, Chunk.ChunkIdx, F, Lock, PrevLock);
+                        ExtractChunkJob (&Chunk, ChunkBlocks, Reader, F, Lock, PrevLock);
                     };
                     ThreadPool.Execute (Task);
                 } else {
-                    ExtractChunkJob (&Chunk, ChunkBlocks, Chunk.ChunkIdx, F, Lock, PrevLock);
+                    ExtractChunkJob (&Chunk, ChunkBlocks, Reader, F, Lock, PrevLock);
                 }
 
 
@@ -182,6 +287,10 @@ LiveFile::LiveFile (const FileListEntry &ListEntry
 LiveFile::~LiveFile () {
     DBGDTOR;
     Close();
+    if (DirFd >= 0) {
+        close (DirFd);
+        DirHandlesOpen --;
+    }
 }
 
 vecstr LiveFile::GetSubs () {
@@ -193,6 +302,52 @@ vecstr LiveFile::GetSubs () {
     return Subs;
 }
 
+// get a shared handle for reading the contents of this directory
+DirHandlePtr LiveFile::OpenDir () {
+    if (DirFd < 0) {
+        DirFd = openat (AtFd(), AtName(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (DirFd < 0)
+            THROW_PBEXCEPTION_IO ("Can't open directory: %s", Name.c_str());
+        DirHandlesOpen ++;
+    }
+
+    // the handle owns the fd now
+    DirHandlePtr Dir = make_shared <DirHandle> (DirFd, Name);
+    DirFd = -1;
+    return Dir;
+}
+
+// list the names (and d_types) within an open directory
+void LiveFile::ListDir (const DirHandlePtr &Dir, vecstr &Leaves, vector <u8> &Types) {
+    assert (Dir->Fd >= 0);
+    alignas (struct dirent64) char Buf [32768];
+    while (1) {
+        ssize_t Size = getdents64 (Dir->Fd, Buf, sizeof(Buf));
+        if (Size < 0)
+            THROW_PBEXCEPTION_IO ("Can't read directory: %s", Dir->Path.c_str());
+        if (Size == 0)
+            break;
+
+        for (ssize_t Pos = 0; Pos < Size; ) {
+            struct dirent64 *Ent = (struct dirent64 *) (Buf + Pos);
+            Pos += Ent->d_reclen;
+
+            // skip . and ..
+            const char *EntName = Ent->d_name;
+            if (EntName[0] == '.' && (EntName[1] == 0 || (EntName[1] == '.' && EntName[2] == 0)))
+                continue;
+
+            Leaves.push_back (EntName);
+            Types .push_back (Ent->d_type);
+        }
+    }
+
+    // don't run out of file descriptors on wide trees
+    // contents of this directory will be accessed by full path instead
+    if (DirHandlesOpen > MaxOpenDirHandles())
+        Dir->Close();
+}
+
 void SplitFileName (const string &RawName, string &Path, string &Name) {
     // split into path and leaf names
     // leaf is just the part after the last "/"
@@ -202,8 +357,20 @@ void SplitFileName (const string &RawName, string &Path, string &Name) {
 }
 
 void LiveFile::OpenRead () {
-    F = OpenReadBin (Name);
-    assert (F);
+    if (!Parent || Parent->Fd < 0) {
+        F = OpenReadBin (Name);
+        assert (F);
+        return;
+    }
+
+    // open relative to the parent dir
+    int Fd = openat (Parent->Fd, Leaf.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (Fd < 0)
+        THROW_PBEXCEPTION_IO ("Can't open %s for read", Name.c_str());
+    if (!(F = fdopen (Fd, "rb"))) {
+        close (Fd);
+        THROW_PBEXCEPTION_IO ("Can't open %s for read", Name.c_str());
+    }
 }
 
 void LiveFile::OpenWrite () {
@@ -212,6 +379,9 @@ void LiveFile::OpenWrite () {
 }
 
 void LiveFile::Close () {
+    if (CDC)
+        delete CDC;
+    CDC = NULL;
     if (F)
         fclose (F);
     F = NULL;
@@ -222,9 +392,26 @@ int LiveFile::Read (char *Buf, int ReqSize) {
     return ReadBinary (F, Buf, ReqSize);
 }
 
-int  LiveFile::ReadChunk (string &Chunk) {
+// exactly Size bytes (or up to end of file)
+int  LiveFile::ReadChunk (string &Chunk, int Size) {
+    assert (F);
+    return ReadBinary (F, Chunk, Size);
+}
+
+// next chunk of the file, either fixed size or cut by content
+int  LiveFile::ReadChunk (BufRef &Chunk) {
+    assert (F);
+    if (!O.CDC)
+        return ReadBinary (F, Chunk, O.ChunkSize);
+    if (!CDC)
+        CDC = new Chunker (F, O.ChunkMinSize(), O.ChunkSize, O.ChunkMaxSize());
+    CDC->Next (Chunk);
+    return Chunk.Size();
+}
+
+int  LiveFile::ReadChunk (BufRef &Chunk, int Size) {
     assert (F);
-    return ReadBinary (F, Chunk, O.ChunkSize);
+    return ReadBinary (F, Chunk, Size);
 }
 
 void LiveFile::Write (const string &Str) {
@@ -4,27 +4,57 @@
 #include "Types.h"
 #include "BlockList.h"
 #include "BusyLock.h"
+#include "StatBatch.h"
+#include "Chunker.h"
+#include "ChunkCache.h"
 
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
 using namespace std;
 
-void ExtractChunkJob (const ChunkInfo *Chunk, const BlockList *ChunkBlocks, i64 BlockIdx, FILE *F, BusyLock *Lock, BusyLock *PrevLock);
+// open directory shared by the LiveFiles (and walker batches) of its contents
+class DirHandle {
+    public:
+    int    Fd;    // O_DIRECTORY fd, -1 once closed to stay under the open file limit
+    string Path;  // full path of the directory
+
+     DirHandle (int fd, const string &path);
+    ~DirHandle ();
+    void Close ();
+};
+typedef shared_ptr <DirHandle> DirHandlePtr;
+
+// directory fds a stat batch is about to open, counted with the ones already open
+// false (and nothing counted) if that would go past the limit
+bool ReserveDirFds (int Count);
+void ReleaseDirFds (int Count);
+
+void ExtractChunkJob (const ChunkInfo *Chunk, const BlockList *ChunkBlocks, ChunkCache *Reader, FILE *F, BusyLock *Lock, BusyLock *PrevLock);
 
 class LiveFile {
+    void        InitCreate (u8 DType, const StatResult *Pre);
+    int         AtFd       () const;
+    const char *AtName     () const;
+
     public:
     string      Name;       // Full pathname for the file
     FILE       *F;          // File for i/o
+    Chunker    *CDC;        // content-defined chunker for F (cdc chunking only)
     struct stat Stats;      // File status info from lstat() call
     string      LinkTarget; // Target of soft link
+    DirHandlePtr Parent;    // containing directory for fd-relative access (may be NULL)
+    string      Leaf;       // name within Parent
+    int         DirFd;      // open fd of this directory (fd-relative create only)
 
     // for create
     LiveFile  (const string &name);
+    LiveFile  (const DirHandlePtr &parent, const string &leaf, u8 DType, const StatResult *Pre = NULL);
 
     // for extract, etc
     LiveFile  (const FileListEntry &ListEntry
-              ,const vector <ChunkInfo> &Chunks , const BlockList *ChunkBlocks
+              ,const vector <ChunkInfo> &Chunks , const BlockList *ChunkBlocks, ChunkCache *Reader
               ,vector <DirAttribRec> &DirAttribs, mutex *DirAttribsMtx
               ,bool DoHLink
               );
@@ -44,14 +74,18 @@ class LiveFile {
     inline u64      INode() const {return (IsDir() || IsSLink() || Stats.st_nlink < 2) ? 0 : Stats.st_ino;} // only for non-dir hlink files
     inline void     Trunc()       {Stats.st_size = 0;}
 
-    vecstr GetSubs ();
+    vecstr       GetSubs ();
+    DirHandlePtr OpenDir ();
+    static void  ListDir (const DirHandlePtr &Dir, vecstr &Leaves, vector <u8> &Types);
 
     void     OpenRead  ();
     void     OpenWrite ();
     void     Close     ();
     int      Read      (char         *Buf, int ReqSize);
     int      ReadChunk (char       *Chunk);
-    int      ReadChunk (string     &Chunk);
+    int      ReadChunk (string     &Chunk, int Size);
+    int      ReadChunk (BufRef     &Chunk);
+    int      ReadChunk (BufRef     &Chunk, int Size);
     void     Write     (const string &Str);
     void     Write     (char         *Buf, int BufSize);
 };
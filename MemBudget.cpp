@@ -0,0 +1,35 @@
+#include "MemBudget.h"
+#include "Logging.h"
+
+MemBudget::MemBudget (u64 limit) {
+    Limit = limit;
+    Used  = 0;
+    Peak  = 0;
+    Waits = 0;
+}
+
+MemBudget::~MemBudget () {
+}
+
+void MemBudget::Acquire (u64 Bytes) {
+    unique_lock<mutex> lock(Mtx);
+    auto Fits = [&]{return !Limit || !Used || Used + Bytes <= Limit || StopThreads;};
+    if (!Fits()) {
+        Waits ++;
+
+        // count as a blocked thread so the thread pool can see it's not coming back soon
+        BUSYLOCK_WINC
+        CV.wait (lock, Fits);
+        BUSYLOCK_WDEC
+    }
+    Used += Bytes;
+    if (Used > Peak)
+        Peak = Used;
+}
+
+void MemBudget::Release (u64 Bytes) {
+    unique_lock<mutex> lock(Mtx);
+    assert (Bytes <= Used);
+    Used -= Bytes;
+    CV.notify_all();
+}
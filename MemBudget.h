@@ -0,0 +1,35 @@
+#ifndef MEMBUDGET_H
+#define MEMBUDGET_H
+
+#include "Types.h"
+#include "BusyLock.h"
+
+#include <mutex>
+#include <condition_variable>
+using namespace std;
+
+// limits the bytes of chunk data in flight between readers and the hash/compress/write jobs
+// Acquire blocks while the budget is used up
+// a request bigger than the whole budget is let through when nothing else is in flight
+class MemBudget {
+    u64                Limit;   // 0 for no limit
+    u64                Used;
+    mutex              Mtx;
+    condition_variable CV;
+
+    public:
+    // statistics for the log
+    u64 Peak;    // most bytes in flight at once
+    u64 Waits;   // acquires that had to wait
+
+     MemBudget (u64 limit = 0);
+    ~MemBudget ();
+
+    void SetLimit (u64 limit) {Limit = limit;}
+    u64  GetLimit () const    {return Limit;}
+
+    void Acquire (u64 Bytes);
+    void Release (u64 Bytes);
+};
+
+#endif // MEMBUDGET_H
@@ -0,0 +1,364 @@
+#include "Merkle.h"
+#include "Archive.h"
+#include "Logging.h"
+#include "Utils.h"
+
+#include <sstream>
+#include <fstream>
+#include <filesystem>
+#include <queue>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+
+using namespace Utils;
+namespace fs = std::filesystem;
+
+string ChunksDigest (eHashType T, const string &ChunkHashes) {
+    return HashStr (T, ChunkHashes);
+}
+
+string ChunksDigest (eHashType T, const vector <ChunkInfo> &Chunks) {
+    string ChunkHashes;
+    for (auto &Chunk : Chunks)
+        ChunkHashes += Chunk.Hash + "\n";
+    return ChunksDigest (T, ChunkHashes);
+}
+
+string InlineDigest (eHashType T, const string &Data) {
+    return ChunksDigest (T, HashStr (T, Data) + "\n");
+}
+
+// what an entry's own hash covers: attributes as in the list, and the contents
+// but not where the contents are stored
+static string OwnText (const FileListEntry &Entry) {
+    stringstream Own;
+    Own << "mode>"  << hex << Entry.Stats.st_mode;
+    Own << " uid>"  << hex << Entry.Stats.st_uid;
+    Own << " gid>"  << hex << Entry.Stats.st_gid;
+    Own << " size>" << dec << Entry.Stats.st_size;
+    Own << " mtime>" << hex << TimeSpecToNs (Entry.Stats.st_mtim);
+    if (Entry.Acl.size())
+        Own << " acl>" << Entry.Acl;
+    if (Entry.Digest.size())
+        Own << " dig>" << Entry.Digest;
+    if (S_ISLNK (Entry.Stats.st_mode))
+        Own << ListRecSep << "slink>" << Entry.LinkTarget;
+    return Own.str();
+}
+
+// directory holding Path, false at the top
+static bool ParentOf (const string &Path, string &Up) {
+    size_t Slash = Path.rfind ('/');
+    if (Slash == string::npos || Path == "/")
+        return false;
+    Up = Slash ? Path.substr (0, Slash) : "/";
+    return true;
+}
+
+string SubtreeBegin (const string &Path) {
+    return Path == "/" ? "/" : Path + "/";
+}
+
+string SubtreeEnd (const string &Path) {
+    return Path == "/" ? "0" : Path + "0";
+}
+
+bool InSubtree (const string &Name, const string &Path) {
+    string Begin = SubtreeBegin (Path);
+    return Name == Path || Name.compare (0, Begin.size(), Begin) == 0;
+}
+
+// each line of a file from the last one back, without the newline
+static void LinesBack (const string &Path, function <void(const char *Line, size_t Len)> Func) {
+    int Fd = open (Path.c_str(), O_RDONLY);
+    if (Fd < 0)
+        THROW_PBEXCEPTION_IO ("Can't open %s", Path.c_str());
+    struct stat Stats;
+    fstat (Fd, &Stats);
+    size_t      Bytes = Stats.st_size;
+    const char *Data  = NULL;
+    if (Bytes) {
+        Data = (const char*) mmap (NULL, Bytes, PROT_READ, MAP_SHARED, Fd, 0);
+        if (Data == MAP_FAILED)
+            THROW_PBEXCEPTION_IO ("Can't map %s", Path.c_str());
+    }
+    for (size_t End = Bytes; End; ) {
+        size_t Start = End - 1;
+        while (Start && Data [Start - 1] != '\n')
+            Start --;
+        Func (Data + Start, End - 1 - Start);
+        End = Start;
+    }
+    if (Data)
+        munmap ((void*) Data, Bytes);
+    close (Fd);
+}
+
+// a line of the Tree file
+static void TreeLine (ostream &Tree, const string &Path, const string &Hash, bool Dir, const string &Own) {
+    Tree << Path << ListRecSep << Hash;
+    if (Dir)
+        Tree << " " << (Own.size() ? Own : "-");
+    Tree << "\n";
+}
+
+//////////////////////////////////////////////////////////////////////
+MerkleBuilder::~MerkleBuilder () {
+    error_code ec;
+    for (auto &Run : Runs)
+        fs::remove (Run, ec);
+    if (Runs.size()) {
+        fs::remove (Spill + ".sorted", ec);
+        fs::remove (Spill + ".hashed", ec);
+    }
+}
+
+void MerkleBuilder::Add (const FileListEntry &Entry) {
+    string Own = HashStr (Type, OwnText (Entry));
+
+    // a map node is the key and value plus links and color, about 4 pointers
+    const u64 PerNode = sizeof (pair <const string, Node>) + 4 * sizeof (void*);
+
+    lock_guard <mutex> Lock (Mtx);
+    Node &N = Nodes [Entry.Name];
+    N.Own = Own;
+    N.Dir = S_ISDIR (Entry.Stats.st_mode);
+    Held += PerNode + Entry.Name.capacity() + Own.capacity();
+
+    // directories above it, which may not be in the list
+    string Path = Entry.Name, Up;
+    while (ParentOf (Path, Up) && !Nodes.count (Up)) {
+        Nodes [Up];
+        Held += PerNode + Up.capacity();
+        Path = Up;
+    }
+
+    Peak = max (Peak, Held);
+    if (Limit && Held >= Limit)
+        SpillRun ();
+}
+
+// write the entries held to a file, in path order, and start over
+// each line is "path<ListRecSep>" then "d" or "f" and the entry's own hash
+void MerkleBuilder::SpillRun () {
+    string  RunPath = Spill + ".run" + to_string (Runs.size());
+    fstream Run     = OpenWriteStream (RunPath);
+    for (auto &[NodePath, N] : Nodes)
+        Run << NodePath << ListRecSep << (N.Dir ? "d" : "f") << N.Own << "\n";
+    Run.close();
+    Runs.push_back (RunPath);
+    Nodes.clear();
+    Held = 0;
+}
+
+// merge the runs into one file in path order
+// a directory above entries of several runs is in each of them, but only one has it as an entry of its own
+void MerkleBuilder::Merge (const string &Path) {
+    class Head {
+        public:
+        string Path;
+        string Rec;
+        size_t Run;
+    };
+    auto Later = [](const Head &A, const Head &B) {return A.Path > B.Path;};
+    priority_queue <Head, vector <Head>, decltype (Later)> Heads (Later);
+
+    vector <fstream> Files;
+    auto Next = [&](size_t RunIdx) {
+        string Line;
+        if (!getline (Files [RunIdx], Line))
+            return;
+        size_t Sep = Line.find (ListRecSep);
+        if (Sep == string::npos)
+            THROW_PBEXCEPTION_FMT ("Bad line in %s: %s", Runs [RunIdx].c_str(), Line.c_str());
+        Heads.push ({Line.substr (0, Sep), Line.substr (Sep + strlen (ListRecSep)), RunIdx});
+    };
+    for (size_t r = 0; r < Runs.size(); r++) {
+        Files.push_back (OpenReadStream (Runs[r]));
+        Next (r);
+    }
+
+    fstream Out = OpenWriteStream (Path);
+    while (Heads.size()) {
+        Head H = Heads.top();
+        Heads.pop();
+        Next (H.Run);
+        while (Heads.size() && Heads.top().Path == H.Path) {
+            Head Dup = Heads.top();
+            Heads.pop();
+            Next (Dup.Run);
+            if (Dup.Rec.size() > 1)
+                H.Rec = Dup.Rec;
+        }
+        Out << H.Path << ListRecSep << H.Rec << "\n";
+        Count ++;
+    }
+    Out.close();
+
+    for (auto &File : Files)
+        File.close();
+    for (auto &Run : Runs)
+        fs::remove (Run);
+}
+
+// work out the hashes from the merged entries, as Finish does with them in memory
+// To gets the lines of the Tree file, from the last one back
+// only directories whose entries have been seen but not they themselves are held
+void MerkleBuilder::HashBack (const string &From, const string &To) {
+    map <string, string> Children;
+    fstream Out = OpenWriteStream (To);
+    LinesBack (From, [&](const char *Line, size_t Len) {
+        const char *Sep = (const char*) memmem (Line, Len, ListRecSep, strlen (ListRecSep));
+        if (!Sep || Sep + strlen (ListRecSep) >= Line + Len)
+            THROW_PBEXCEPTION_FMT ("Bad line in %s: %s", From.c_str(), string (Line, Len).c_str());
+        string      Path (Line, Sep - Line);
+        const char *Rec = Sep + strlen (ListRecSep);
+        bool        Dir = *Rec == 'd';
+        string      Own (Rec + 1, Line + Len);
+
+        string Hash = Own;
+        if (Dir) {
+            auto Found = Children.find (Path);
+            if (Found != Children.end()) {
+                Hash = HashStr (Type, Own + "\n" + Found->second);
+                Children.erase (Found);
+            } else {
+                Hash = HashStr (Type, Own + "\n");
+            }
+        }
+
+        string Up;
+        if (ParentOf (Path, Up))
+            Children [Up] += Path.substr (Path.rfind ('/') + 1) + ListRecSep + Hash + "\n";
+        TreeLine (Out, Path, Hash, Dir, Own);
+    });
+    Out.close();
+}
+
+// everything below a path sorts after it, so going backwards
+// a directory's entries are all done by the time it's reached
+void MerkleBuilder::Finish () {
+    if (Runs.size()) {
+        SpillRun ();
+        Merge    (Spill + ".sorted");
+        HashBack (Spill + ".sorted", Spill + ".hashed");
+        fs::remove (Spill + ".sorted");
+        return;
+    }
+
+    for (auto Itr = Nodes.rbegin(); Itr != Nodes.rend(); Itr++) {
+        const string &Path = Itr->first;
+        Node         &N    = Itr->second;
+        N.Hash = N.Dir ? HashStr (Type, N.Own + "\n" + N.Children) : N.Own;
+        N.Children.clear();
+
+        string Up;
+        if (ParentOf (Path, Up))
+            Nodes [Up].Children += Path.substr (Path.rfind ('/') + 1) + ListRecSep + N.Hash + "\n";
+    }
+    Count = Nodes.size();
+}
+
+void MerkleBuilder::Write (const string &Path) {
+    fstream Tree = OpenWriteStream (Path);
+    if (Runs.size()) {
+        LinesBack (Spill + ".hashed", [&](const char *Line, size_t Len) {
+            Tree.write (Line, Len);
+            Tree << "\n";
+        });
+    } else {
+        for (auto &[NodePath, N] : Nodes)
+            TreeLine (Tree, NodePath, N.Hash, N.Dir, N.Own);
+    }
+    Tree.close();
+}
+
+void MerkleBuilder::ForEach (function <void(const string &Path, const string &Hash)> Func) const {
+    if (Runs.size()) {
+        LinesBack (Spill + ".hashed", [&](const char *Line, size_t Len) {
+            string Rec (Line, Len);
+            size_t Sep   = Rec.find (ListRecSep);
+            size_t Start = Sep + strlen (ListRecSep);
+            Func (Rec.substr (0, Sep), Rec.substr (Start, Rec.find (' ', Start) - Start));
+        });
+        return;
+    }
+    for (auto &[NodePath, N] : Nodes)
+        Func (NodePath, N.Hash);
+}
+
+//////////////////////////////////////////////////////////////////////
+MerkleTree::MerkleTree (const string &Path) : Reads (0) {
+    Fd = open (Path.c_str(), O_RDONLY);
+    if (Fd < 0)
+        THROW_PBEXCEPTION_IO ("Can't open tree file %s", Path.c_str());
+    struct stat Stats;
+    fstat (Fd, &Stats);
+    Bytes = Stats.st_size;
+    Data  = NULL;
+    if (Bytes) {
+        Data = (const char*) mmap (NULL, Bytes, PROT_READ, MAP_SHARED, Fd, 0);
+        if (Data == MAP_FAILED)
+            THROW_PBEXCEPTION_IO ("Can't map tree file %s", Path.c_str());
+    }
+}
+
+MerkleTree::~MerkleTree () {
+    if (Data)
+        munmap ((void*) Data, Bytes);
+    close (Fd);
+}
+
+bool MerkleTree::At (size_t Off, Entry &E) const {
+    if (Off >= Bytes)
+        return false;
+    Reads ++;
+    const char *Line = Data + Off;
+    const char *Eol  = (const char*) memchr (Line, '\n', Bytes - Off);
+    if (!Eol)
+        Eol = Data + Bytes;
+    const char *Sep  = (const char*) memmem (Line, Eol - Line, ListRecSep, strlen (ListRecSep));
+    if (!Sep)
+        THROW_PBEXCEPTION_FMT ("Bad line in tree file: %s", string (Line, Eol - Line).c_str());
+    E.Path = string (Line, Sep - Line);
+    string Rest (Sep + strlen (ListRecSep), Eol);
+    size_t Space = Rest.find (' ');
+    E.Hash = Rest.substr (0, Space);
+    E.Own  = Space == string::npos ? "" : Rest.substr (Space + 1);
+    E.Next = Eol - Data + 1;
+    return true;
+}
+
+// binary search over the bytes of the file
+// a probe anywhere in a line backs up to the start of the line
+size_t MerkleTree::Lower (const string &Path) const {
+    size_t Lo = 0, Hi = Bytes;
+    Entry  E;
+    while (Lo < Hi) {
+        size_t Mid = Lo + (Hi - Lo) / 2;
+        size_t Start = Mid;
+        while (Start > Lo && Data [Start - 1] != '\n')
+            Start --;
+        At (Start, E);
+        if (E.Path < Path)
+            Lo = E.Next;
+        else
+            Hi = Start;
+    }
+    return Lo;
+}
+
+// ("/" starts what's below it)
+size_t MerkleTree::Below (const string &Path) const {
+    size_t Off = Lower (SubtreeBegin (Path));
+    Entry  E;
+    if (At (Off, E) && E.Path == Path)
+        Off = E.Next;
+    return Off;
+}
+
+bool MerkleTree::Find (const string &Path, Entry &E) const {
+    return At (Lower (Path), E) && E.Path == Path;
+}
@@ -0,0 +1,100 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include "Types.h"
+
+#include <map>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+using namespace std;
+
+// merkle hashes over the entries of an archive's list, kept in the archive's "Tree" file
+// an entry's own hash covers its attributes and contents (the hashes of its chunks), not how they're stored
+// a directory's hash also covers the names and hashes of everything in it
+// so equal hashes for a path in two archives mean the subtrees there are the same
+//
+// the file has a line per entry and per directory above them, sorted by path
+//     path<ListRecSep>hash[ own]
+// directories add the hash of their own attributes, to tell those changes from changes inside
+
+// hash of a file's contents from the hashes of its chunks
+string ChunksDigest (eHashType T, const vector <ChunkInfo> &Chunks);
+string ChunksDigest (eHashType T, const string &ChunkHashes);   // "hash\n" for each chunk
+string InlineDigest (eHashType T, const string &Data);          // the same as in a single chunk
+
+// collects the entries of an archive as it's created (or tested) and works out the tree
+// the list isn't in path order, so entries are held until Finish
+// past the limit they go to files under Spill as runs sorted by path,
+// which Finish merges and then works out the hashes from in one pass backwards
+class MerkleBuilder {
+    class Node {
+        public:
+        string Own;           // hash of the entry itself, "" for a directory not in the list
+        string Hash;          // ... with everything below it
+        string Children;      // "name<ListRecSep>hash\n" of each entry in a directory
+        bool   Dir = true;
+    };
+    eHashType          Type;
+    string             Spill;       // path prefix of the files entries go to past the limit
+    u64                Limit = 0;   // bytes of Nodes before they go to a file, 0 for no limit
+    map <string, Node> Nodes;
+    mutex              Mtx;
+    u64                Held  = 0;   // rough bytes taken by Nodes
+    u64                Peak  = 0;   // ... at most
+    u64                Count = 0;   // entries of the tree, once finished
+    vecstr             Runs;        // files with the entries written out so far
+
+    void SpillRun ();
+    void Merge    (const string &Path);
+    void HashBack (const string &From, const string &To);
+
+    public:
+     MerkleBuilder (eHashType T, const string &spill) : Type (T), Spill (spill) {}
+    ~MerkleBuilder ();
+
+    void SetLimit (u64 Bytes) {Limit = Bytes;}
+    void Add      (const FileListEntry &Entry);
+    void Finish   ();
+    void Write    (const string &Path);
+    u64  Size     () const {return Count;}
+    u64  Bytes    () const {return Peak;}
+    u64  Spills   () const {return Runs.size();}
+
+    // each path and its hash, in path order
+    void ForEach (function <void(const string &Path, const string &Hash)> Func) const;
+};
+
+// a Tree file, searched in place
+class MerkleTree {
+    int         Fd;
+    const char *Data;
+    size_t      Bytes;
+
+    public:
+    class Entry {
+        public:
+        string Path;
+        string Hash;
+        string Own;     // directories only
+        size_t Next;    // offset of the following line
+    };
+    mutable atomic <u64> Reads;   // lines looked at
+
+     MerkleTree (const string &Path);
+    ~MerkleTree ();
+
+    size_t End   () const {return Bytes;}
+    bool   At    (size_t Off, Entry &E) const;        // entry on the line at Off
+    size_t Lower (const string &Path) const;          // first line with a path at or after Path
+    size_t Below (const string &Path) const;          // first line of what's below Path
+    bool   Find  (const string &Path, Entry &E) const;
+};
+
+// paths below Path sort from Path + "/" up to (not including) Path + "0"
+string SubtreeBegin (const string &Path);
+string SubtreeEnd   (const string &Path);
+bool   InSubtree    (const string &Name, const string &Path);   // Name is Path or below it
+
+#endif // MERKLE_H
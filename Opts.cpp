@@ -10,6 +10,7 @@
 #include <string.h>
 #include <sstream>
 #include <filesystem>
+#include <thread>
 using namespace std;
 namespace fs = filesystem;
 
@@ -109,10 +110,32 @@ void Opts::ParseCmdLine (const int argc, const char *argv[]) {
     VersionMinor    = VERSION_MINOR;
     Operation       = DoUndef;
     ShowFiles       = 0;
+    QuickTest       = false;
     NumThreads      = 100;
+    WalkThreads     = min (thread::hardware_concurrency(), 16u);
+    FdWalk          = true;
+    StatURing       = false;
     CompType        = CompType_ZTSD;
     CompLevel       = 2;
+    AdaptMin        = 0;
+    AdaptMax        = 0;
+    DeltaDepth      = 0;
+    ListFrame       = 4096;
+    DeferComp       = false;
+    RecompRate      = 0;
+    CompGiven       = false;
+    HashWait        = 50;
     ChunkSize       = 1 << 18;
+    CDC             = false;
+    ChunkMin        = 0;
+    ChunkMax        = 0;
+    Dedup           = false;
+    DetectMoves     = false;
+    BlockRefs       = false;
+    InlineSize      = InlineUnset;
+    MemBudgetMiB    = 512;
+    CompProbe       = true;
+    DictBelow       = 0;
     HashType        = HashType_MD5;
     ExtractTarget   = "PhatBakExtract";
     DebugPrint      = 0;
@@ -149,6 +172,8 @@ void Opts::ParseCmdLine (const int argc, const char *argv[]) {
     else if (OpText (DoList      ) == MatchNames[0]) Operation = DoList      ;
     else if (OpText (DoShowLatest) == MatchNames[0]) Operation = DoShowLatest;
     else if (OpText (DoVersion   ) == MatchNames[0]) Operation = DoVersion   ;
+    else if (OpText (DoRecompress) == MatchNames[0]) Operation = DoRecompress;
+    else if (OpText (DoDiff      ) == MatchNames[0]) Operation = DoDiff      ;
 
     // basic operation must be set
     if (Operation == DoUndef)
@@ -198,11 +223,39 @@ void Opts::ParseCmdLine (const int argc, const char *argv[]) {
         //int TmpInt = 0;
         PARSE_MinusFlg ("-v"                ,, ShowFiles  , 1,)
         PARSE_MinusFlg ("-D"                ,, ShowFiles=ArchDiag, 1, )
+        PARSE_MinusFlg ("--Quick"           ,, QuickTest  , 1,)
         PARSE_MinusVal ("-T"                ,"%d", &NumThreads,)
-        PARSE_MinusStr ("--CompType"        , arg, CompType = Comp::CompNameToEnum(arg);)
-        PARSE_MinusVal ("--CompLevel"       ,"%d", &CompLevel,)
+        PARSE_MinusVal ("--WalkThreads"     ,"%d", &WalkThreads,)
+        PARSE_MinusStr ("--WalkMode"        , arg, if      (!strcmp (arg, "fd"  )) FdWalk = true;
+                                                   else if (!strcmp (arg, "path")) FdWalk = false;
+                                                   else    ArgError (arg);)
+        PARSE_MinusStr ("--StatMode"        , arg, if      (!strcmp (arg, "sync" )) StatURing = false;
+                                                   else if (!strcmp (arg, "uring")) StatURing = true;
+                                                   else    ArgError (arg);)
+        PARSE_MinusStr ("--CompType"        , arg, CompType = Comp::CompNameToEnum(arg); CompGiven = true;)
+        PARSE_MinusVal ("--CompLevel"       ,"%d", &CompLevel, CompGiven = true;)
+        PARSE_MinusStr ("--AdaptLevel"      , arg, if (sscanf (arg, "%d:%d", &AdaptMin, &AdaptMax) != 2
+                                                       || AdaptMin < 1 || AdaptMin > AdaptMax)
+                                                       ArgError (arg);)
+        PARSE_MinusVal ("--Delta"           ,"%u", &DeltaDepth,)
+        PARSE_MinusVal ("--ListFrame"       ,"%u", &ListFrame,)
+        PARSE_MinusFlg ("--DeferComp"       ,, DeferComp , 1,)
+        PARSE_MinusVal ("--RecompRate"      ,"%u", &RecompRate,)
         PARSE_MinusStr ("--HashType"        , arg, HashType = HashNameToEnum(arg);)
+        PARSE_MinusVal ("--HashWait"        ,"%u", &HashWait,)
         PARSE_MinusVal ("--ChunkSize"       ,"%d", &ChunkSize,)
+        PARSE_MinusStr ("--Chunking"        , arg, if      (!strcmp (arg, "fixed")) CDC = false;
+                                                   else if (!strcmp (arg, "cdc"  )) CDC = true;
+                                                   else    ArgError (arg);)
+        PARSE_MinusVal ("--ChunkMin"        ,"%d", &ChunkMin,)
+        PARSE_MinusVal ("--ChunkMax"        ,"%d", &ChunkMax,)
+        PARSE_MinusFlg ("--Dedup"           ,, Dedup     , 1,)
+        PARSE_MinusFlg ("--DetectMoves"     ,, DetectMoves, 1,)
+        PARSE_MinusFlg ("--BlockRefs"       ,, BlockRefs , 1,)
+        PARSE_MinusVal ("--InlineSize"      ,"%u", &InlineSize,)
+        PARSE_MinusVal ("--MemBudget"       ,"%u", &MemBudgetMiB,)
+        PARSE_MinusFlg ("--NoCompProbe"     ,, CompProbe , 0,)
+        PARSE_MinusVal ("--DictBelow"       ,"%u", &DictBelow,)
         PARSE_MinusVal ("--BlockNumModulus" ,"%d", &BlockNumModulus,)
         PARSE_MinusFlg ("--rebase"          ,, Rebase    , 1,)
         PARSE_MinusStr ("--BaseArchive"     ,  BaseArchive,  )
@@ -214,6 +267,16 @@ void Opts::ParseCmdLine (const int argc, const char *argv[]) {
         ArgError(arg);
     }
 
+    // cdc sizes have to bracket the average
+    if (ChunkMinSize() > ChunkSize || ChunkMaxSize() < ChunkSize) {
+        fprintf (stderr, "ERROR: --ChunkMin and --ChunkMax must bracket --ChunkSize\n");
+        PrintHelp(1);
+    }
+
+    // single-threaded mode walks in the main thread too
+    if (NumThreads == 0 || WalkThreads < 1)
+        WalkThreads = 1;
+
     // first remaining arg is the repo/archive name
     if (argidx >= argc) {
         printf ("No Repo::Archive argument given\n");
@@ -272,9 +335,23 @@ string Opts::OptsString () {
     F << "   BaseArchive     = " << BaseArchive                     << endl;
     F << "   BlockNumModulus = " << BlockNumModulus                 << endl;
     F << "   ChunkSize       = " << ChunkSize                       << endl;
+    F << "   Chunking        = " << (CDC ? "cdc" : "fixed")         << endl;
+    F << "   ChunkMin        = " << ChunkMinSize()                  << endl;
+    F << "   ChunkMax        = " << ChunkMaxSize()                  << endl;
+    F << "   Dedup           = " << Dedup                           << endl;
+    F << "   DetectMoves     = " << DetectMoves                     << endl;
+    F << "   BlockRefs       = " << BlockRefs                       << endl;
+    F << "   InlineSize      = " << InlineSize                      << endl;
+    F << "   MemBudget       = " << MemBudgetMiB                    << endl;
+    F << "   CompProbe       = " << CompProbe                       << endl;
+    F << "   DictBelow       = " << DictBelow                       << endl;
     F << "   HashType        = " << HashNames[HashType]             << endl;
     F << "   CompType        = " << CompNames[CompType]             << endl;
     F << "   CompLevel       = " << CompLevel                       << endl;
+    F << "   AdaptLevel      = " << AdaptMin << ":" << AdaptMax     << endl;
+    F << "   DeltaDepth      = " << DeltaDepth                      << endl;
+    F << "   ListFrame       = " << ListFrame                       << endl;
+    F << "   DeferComp       = " << DeferComp                       << endl;
     F << "   ShowFiles       = " << ShowFiles                       << endl;
     F << "   DebugPrint      = " << DebugPrint                      << endl;
     return F.str();
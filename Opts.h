@@ -27,18 +27,42 @@ class Opts {
     string    RepoDirName;      // Repository dir for archives
     string    ArchDirName;      // Archive directory withing the repo
     int       BlockNumModulus;  // Amount by which divide block indices to create block levels
-    unsigned  ChunkSize;        // Max size of data blocks into which file data are stored
+    unsigned  ChunkSize;        // Max size of data blocks into which file data are stored (average size for cdc)
+    bool      CDC;              // cut file data at content-defined boundaries instead of every ChunkSize bytes
+    unsigned  ChunkMin;         // smallest cdc chunk (0 for ChunkSize/4)
+    unsigned  ChunkMax;         // largest cdc chunk (0 for ChunkSize*4)
+    bool      Dedup;            // reuse stored chunks with the same hash from any file
+    bool      DetectMoves;      // find base files that were moved or renamed by size and mtime (and inode)
+    bool      BlockRefs;        // refer to blocks of earlier archives instead of hard-linking them
+    unsigned  InlineSize;       // regular files up to this size are kept in the List itself (0 for none, InlineUnset to take the base's)
+    unsigned  MemBudgetMiB;     // limit on chunk data in flight during create (MiB, 0 for none)
+    bool      CompProbe;        // skip compressing chunks that look incompressible
+    unsigned  DictBelow;        // compress blocks smaller than this with a trained dictionary (0 for none)
     eHashType HashType;         // hash algorithm
+    unsigned  HashWait;         // usec a chunk may wait for others to hash alongside it (0 to hash each alone)
     eCompType CompType;         // type of per-file-block compression to use
     bool      ShowFiles;        // Show file names as they are archived or extracted
     bool      ArchDiag;         // Show diagnostic for archive file blocks in Test mode
+    bool      QuickTest;        // test checks stored blocks against their checksums instead of unpacking them
     int       NumThreads;       // number of helper threads to launch
+    int       WalkThreads;      // number of threads walking the directory tree during create
+    bool      FdWalk;           // walk with open directory fds (getdents64/fstatat) instead of full paths
+    bool      StatURing;        // stat each batch of directory entries with io_uring instead of one fstatat per file
     int       CompLevel;        // compression effort
+    int       AdaptMin;         // bounds for the zstd level of new chunks, adapted during create
+    int       AdaptMax;         // ... (0 for a fixed CompLevel)
+    unsigned  DeltaDepth;       // store changed chunks as deltas against the base chunk, at most this many deep (0 for none)
+    unsigned  ListFrame;        // List entries per zstd frame (0 for a plain text List)
+    bool      DeferComp;        // store new blocks uncompressed during create, for a later recompress
+    unsigned  RecompRate;       // limit on data read by recompress (MiB/s, 0 for none)
+    bool      CompGiven;        // --CompType or --CompLevel was on the command line
     string    ExtractTarget;    // directory into which to place files extracted from an Archive
     bool      Rebase;           // true to force a new base archive on create
     string    BaseArchive;      // user-specified base archive
     bool      DebugPrint;       // true output trace info for debug
 
+    static const unsigned InlineUnset = ~0u;  // no --InlineSize given
+
     enum OpEnum { DoUndef = 0
                  ,DoInit
                  ,DoCreate
@@ -48,11 +72,16 @@ class Opts {
                  ,DoList
                  ,DoShowLatest
                  ,DoVersion
+                 ,DoRecompress
+                 ,DoDiff
                  ,DoVoid  // marks end of operations
                 } Operation; // what to do
 
     Opts ();
 
+    unsigned ChunkMinSize () const {return ChunkMin ? ChunkMin : ChunkSize / 4;}
+    unsigned ChunkMaxSize () const {return ChunkMax ? ChunkMax : ChunkSize * 4;}
+
     void ParseCmdLine (const int argc, const char *argv[]);
 
     string OpText (OpEnum Op = DoUndef) {
@@ -67,6 +96,8 @@ class Opts {
                Op == DoList       ? "list"    :
                Op == DoShowLatest ? "latest"  :
                Op == DoVersion    ? "version" :
+               Op == DoRecompress ? "recompress" :
+               Op == DoDiff       ? "diff"    :
                                     "illegal" ;
     }
 
@@ -43,8 +43,13 @@ int main (int argc, const char **argv) {
             assert (ArchName != "");
             cout << "Testing integrity of " << Repo->Name << "::" << ArchName << endl;
 
+            // paths to test (the archive's options replace the command line's)
+            vecstr Scope;
+            for (auto &FileArg : O.FileArgs)
+                Scope.push_back (Utils::CanonizeFileName (FileArg, O.CWD));
+
             auto Arch = new ArchiveRead (Repo, ArchName);
-            Arch->DoTest();
+            Arch->DoTest(Scope);
 
             delete Arch;
             delete Repo;
@@ -63,6 +68,40 @@ int main (int argc, const char **argv) {
 
             delete Arch;
             delete Repo;
+        } else if (O.Operation == Opts::DoRecompress) {
+            auto Repo = new RepoInfo (O.RepoDirName);
+
+            // archive name defaults to latest found by RepoInfo
+            string ArchName = O.ArchDirName;
+            if (ArchName == "")
+                ArchName = Repo->LatestArchName;
+            assert (ArchName != "");
+            cout << "Recompressing " << Repo->Name << "::" << ArchName << endl;
+
+            auto Arch = new ArchiveRead (Repo, ArchName);
+            Arch->DoRecompress();
+
+            delete Arch;
+            delete Repo;
+        } else if (O.Operation == Opts::DoDiff) {
+            auto Repo = new RepoInfo (O.RepoDirName);
+
+            // first file arg is the archive to compare against, the rest are paths to compare
+            if (O.ArchDirName == "" || !O.FileArgs.size())
+                ERROR ("diff needs two archives: <Repo>::<Archive> <Archive> [paths]\n");
+            string ToName = O.FileArgs[0];
+            vecstr Scope;
+            for (unsigned i = 1; i < O.FileArgs.size(); i++)
+                Scope.push_back (Utils::CanonizeFileName (O.FileArgs[i], O.CWD));
+            cout << "Changes from " << Repo->Name << "::" << O.ArchDirName << " to " << ToName << endl;
+
+            auto From = new ArchiveRead (Repo, O.ArchDirName);
+            auto To   = new ArchiveRead (Repo, ToName);
+            From->DoDiff (To, Scope);
+
+            delete To;
+            delete From;
+            delete Repo;
         } else if (O.Operation == Opts::DoShowLatest) {
             auto Repo = new RepoInfo (O.RepoDirName);
             cout << Repo->LatestArchName << endl;
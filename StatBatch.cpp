@@ -0,0 +1,245 @@
+#include "StatBatch.h"
+#include "Logging.h"
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <string.h>
+#include <atomic>
+#include <memory>
+using namespace std;
+
+// whether io_uring statx works here: 0 = not known yet, 1 = yes, -1 = no
+static atomic <int> URingState (0);
+
+// minimal raw io_uring ring (no liburing dependency)
+// just enough to push batches of statx/openat and wait for them all
+class URing {
+    public:
+    int           Fd;
+    unsigned      Entries;
+    unsigned     *SqHead, *SqTail, *SqMask, *SqArray;
+    unsigned     *CqHead, *CqTail, *CqMask;
+    io_uring_sqe *Sqes;
+    io_uring_cqe *Cqes;
+    void         *SqRing, *CqRing;
+    size_t        SqRingSize, CqRingSize, SqesSize;
+
+     URing (unsigned entries);
+    ~URing ();
+    bool Ok () const {return Fd >= 0;}
+    bool Run (unsigned Count);  // submit Count sqes and wait for all completions
+};
+
+URing::URing (unsigned entries) {
+    SqRing = CqRing = MAP_FAILED;
+    Sqes   = (io_uring_sqe *) MAP_FAILED;
+
+    io_uring_params Params;
+    memset (&Params, 0, sizeof(Params));
+    Fd = syscall (__NR_io_uring_setup, entries, &Params);
+    if (Fd < 0)
+        return;
+    Entries = Params.sq_entries;
+
+    // map the rings
+    SqRingSize = Params.sq_off.array + Params.sq_entries * sizeof(unsigned);
+    CqRingSize = Params.cq_off.cqes  + Params.cq_entries * sizeof(io_uring_cqe);
+    if (Params.features & IORING_FEAT_SINGLE_MMAP)
+        SqRingSize = CqRingSize = max (SqRingSize, CqRingSize);
+    SqRing = mmap (0, SqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Fd, IORING_OFF_SQ_RING);
+    if (Params.features & IORING_FEAT_SINGLE_MMAP)
+        CqRing = SqRing;
+    else
+        CqRing = mmap (0, CqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Fd, IORING_OFF_CQ_RING);
+    SqesSize = Params.sq_entries * sizeof(io_uring_sqe);
+    Sqes = (io_uring_sqe *) mmap (0, SqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Fd, IORING_OFF_SQES);
+    if (SqRing == MAP_FAILED || CqRing == MAP_FAILED || Sqes == MAP_FAILED) {
+        close (Fd);
+        Fd = -1;
+        return;
+    }
+
+    char *Sq = (char *) SqRing;
+    char *Cq = (char *) CqRing;
+    SqHead  = (unsigned *) (Sq + Params.sq_off.head);
+    SqTail  = (unsigned *) (Sq + Params.sq_off.tail);
+    SqMask  = (unsigned *) (Sq + Params.sq_off.ring_mask);
+    SqArray = (unsigned *) (Sq + Params.sq_off.array);
+    CqHead  = (unsigned *) (Cq + Params.cq_off.head);
+    CqTail  = (unsigned *) (Cq + Params.cq_off.tail);
+    CqMask  = (unsigned *) (Cq + Params.cq_off.ring_mask);
+    Cqes    = (io_uring_cqe *) (Cq + Params.cq_off.cqes);
+}
+
+URing::~URing () {
+    if (Sqes != MAP_FAILED)
+        munmap (Sqes, SqesSize);
+    if (CqRing != MAP_FAILED && CqRing != SqRing)
+        munmap (CqRing, CqRingSize);
+    if (SqRing != MAP_FAILED)
+        munmap (SqRing, SqRingSize);
+    if (Fd >= 0)
+        close (Fd);
+}
+
+// on an error, what the kernel hasn't taken yet is taken back and what it has is waited for
+// as it writes into the caller's buffers, so nothing is left in flight when this returns
+bool URing::Run (unsigned Count) {
+    unsigned Head = *SqHead;
+    __atomic_store_n (SqTail, *SqTail + Count, __ATOMIC_RELEASE);
+
+    unsigned Submitted = 0;
+    bool     Ok        = true;
+    while (1) {
+        unsigned Ready = __atomic_load_n (CqTail, __ATOMIC_ACQUIRE) - *CqHead;
+        if (Ok ? (Submitted == Count && Ready >= Count) : Ready >= Submitted)
+            return Ok;
+        int Res = syscall (__NR_io_uring_enter, Fd, Ok ? Count - Submitted : 0, (Ok ? Count : Submitted) - Ready, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (Res >= 0) {
+            Submitted += Res;
+        } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            if (Ok) {
+                int Err = errno;
+                Ok        = false;
+                Submitted = __atomic_load_n (SqHead, __ATOMIC_ACQUIRE) - Head;
+                __atomic_store_n (SqTail, Head + Submitted, __ATOMIC_RELEASE);
+                errno     = Err;
+            } else {
+                // the kernel won't wait either, poll until the rest are done
+                usleep (100);
+            }
+        }
+    }
+}
+
+// one ring per thread
+static URing *GetRing () {
+    static const unsigned RingEntries = 256;
+    thread_local unique_ptr <URing> Ring;
+    if (!Ring) {
+        Ring.reset (new URing (RingEntries));
+        if (!Ring->Ok()) {
+            DBG ("StatBatch: io_uring setup failed: %s\n", strerror(errno));
+            URingState = -1;
+        }
+    }
+    return Ring->Ok() ? Ring.get() : NULL;
+}
+
+static void StatxToStat (const struct statx &Stx, struct stat &St) {
+    memset (&St, 0, sizeof(St));
+    St.st_dev          = makedev (Stx.stx_dev_major , Stx.stx_dev_minor );
+    St.st_rdev         = makedev (Stx.stx_rdev_major, Stx.stx_rdev_minor);
+    St.st_ino          = Stx.stx_ino;
+    St.st_mode         = Stx.stx_mode;
+    St.st_nlink        = Stx.stx_nlink;
+    St.st_uid          = Stx.stx_uid;
+    St.st_gid          = Stx.stx_gid;
+    St.st_size         = Stx.stx_size;
+    St.st_blksize      = Stx.stx_blksize;
+    St.st_blocks       = Stx.stx_blocks;
+    St.st_atim.tv_sec  = Stx.stx_atime.tv_sec;
+    St.st_atim.tv_nsec = Stx.stx_atime.tv_nsec;
+    St.st_mtim.tv_sec  = Stx.stx_mtime.tv_sec;
+    St.st_mtim.tv_nsec = Stx.stx_mtime.tv_nsec;
+    St.st_ctim.tv_sec  = Stx.stx_ctime.tv_sec;
+    St.st_ctim.tv_nsec = Stx.stx_ctime.tv_nsec;
+}
+
+bool StatBatch::Available () {
+    if (URingState == 0)
+        GetRing ();
+    return URingState >= 0;
+}
+
+bool StatBatch::Stat (int DirFd, const vecstr &Names, const vector <u8> &Types, vector <StatResult> &Results) {
+    if (URingState < 0)
+        return false;
+    URing *Ring = GetRing();
+    if (!Ring)
+        return false;
+
+    // one statx per name plus an openat for each directory
+    // user_data is the name index * 2 (+1 for the open)
+    size_t N = Names.size();
+    Results.resize (N);
+    vector <struct statx> Stx (N);
+    vector <u64>          Ops;
+    for (size_t i = 0; i < N; i++) {
+        Results[i].Err   = 0;
+        Results[i].DirFd = -1;
+        Ops.push_back (i << 1);
+        if (Types.size() && Types[i] == DT_DIR)
+            Ops.push_back ((i << 1) | 1);
+    }
+
+    bool Ok = true;
+    for (size_t Start = 0; Ok && Start < Ops.size(); Start += Ring->Entries) {
+        unsigned Count = min ((size_t) Ring->Entries, Ops.size() - Start);
+
+        // fill in the submission queue
+        unsigned Tail = *Ring->SqTail;
+        for (unsigned i = 0; i < Count; i++) {
+            u64           Op   = Ops [Start + i];
+            size_t        Idx  = Op >> 1;
+            unsigned      Slot = (Tail + i) & *Ring->SqMask;
+            io_uring_sqe *Sqe  = &Ring->Sqes [Slot];
+            memset (Sqe, 0, sizeof(*Sqe));
+            Sqe->fd        = DirFd;
+            Sqe->addr      = (u64) Names[Idx].c_str();
+            Sqe->user_data = Op;
+            if (Op & 1) {
+                Sqe->opcode      = IORING_OP_OPENAT;
+                Sqe->open_flags  = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+            } else {
+                Sqe->opcode      = IORING_OP_STATX;
+                Sqe->len         = STATX_BASIC_STATS;
+                Sqe->off         = (u64) &Stx [Idx];
+                Sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+            }
+            Ring->SqArray [Slot] = Slot;
+        }
+
+        if (!Ring->Run (Count)) {
+            DBG ("StatBatch: io_uring_enter failed: %s\n", strerror(errno));
+            URingState = -1;
+            Ok = false;
+        }
+
+        // harvest completions
+        unsigned Head = *Ring->CqHead;
+        unsigned CTail = __atomic_load_n (Ring->CqTail, __ATOMIC_ACQUIRE);
+        for (; Head != CTail; Head++) {
+            io_uring_cqe *Cqe = &Ring->Cqes [Head & *Ring->CqMask];
+            size_t Idx = Cqe->user_data >> 1;
+            if (Cqe->user_data & 1) {
+                Results[Idx].DirFd = Cqe->res; // failed opens are retried synchronously by the caller
+            } else if (Cqe->res == -EINVAL || Cqe->res == -EOPNOTSUPP) {
+                // kernel doesn't know statx through io_uring
+                URingState = -1;
+                Ok = false;
+            } else if (Cqe->res < 0) {
+                Results[Idx].Err = -Cqe->res;
+            }
+        }
+        __atomic_store_n (Ring->CqHead, Head, __ATOMIC_RELEASE);
+    }
+
+    if (!Ok) {
+        for (auto &Res : Results)
+            if (Res.DirFd >= 0)
+                close (Res.DirFd);
+        return false;
+    }
+
+    URingState = 1;
+    for (size_t i = 0; i < N; i++)
+        if (!Results[i].Err)
+            StatxToStat (Stx[i], Results[i].Stats);
+    return true;
+}
@@ -0,0 +1,29 @@
+#ifndef STATBATCH_H
+#define STATBATCH_H
+
+#include "Types.h"
+
+#include <vector>
+#include <sys/stat.h>
+using namespace std;
+
+// metadata for one name of a batch
+class StatResult {
+    public:
+    struct stat Stats;
+    int         Err;    // errno from the stat, 0 if ok
+    int         DirFd;  // open fd if the name is a directory opened along with the stat, else -1
+};
+
+// batched metadata harvesting through io_uring
+// each thread gets its own ring on first use
+namespace StatBatch {
+    // true if io_uring statx works in this process
+    bool Available ();
+
+    // stat names relative to an open directory and open the ones d_type says are directories
+    // returns false if io_uring can't be used - caller should fall back to fstatat
+    bool Stat (int DirFd, const vecstr &Names, const vector <u8> &Types, vector <StatResult> &Results);
+}
+
+#endif // STATBATCH_H
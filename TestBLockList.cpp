@@ -6,6 +6,8 @@
 #include <random>
 #include <iterator>
 #include <inttypes.h>
+#include <chrono>
+#include <thread>
 
 BlockList                     List ("Test");
 map <i64, bool>               Allocated, UnAllocated;
@@ -67,11 +69,64 @@ void DoTestSize () {
         THROW_PBEXCEPTION ("Allocation counts don't match:  Found:%" PRId64 " Expected:%" PRId64, ListSize, AllocSize);
 }
 
+// Ops allocs and frees from each of Threads threads at once, a third of them frees of a random block the thread holds
+// afterwards every block held must have its own index, all counted, and the indices must stay dense
+void Bench (int Threads, int Ops) {
+    BlockList               Shared ("Bench");
+    vector <vector <i64>>   Held (Threads);
+    vector <thread>         Workers;
+
+    auto Start = chrono::steady_clock::now();
+    for (int t = 0; t < Threads; t++) {
+        Workers.emplace_back ([&, t]() {
+            default_random_engine         Gen (t);
+            uniform_int_distribution<int> Op (0,2);
+            auto &Mine = Held [t];
+            for (int i = 0; i < Ops; i++) {
+                if (Mine.size() && !Op (Gen)) {
+                    uniform_int_distribution<size_t> Pick (0, Mine.size()-1);
+                    size_t ToFree = Pick (Gen);
+                    Shared.Free (Mine [ToFree]);
+                    Mine [ToFree] = Mine.back();
+                    Mine.pop_back();
+                } else {
+                    Mine.push_back (Shared.Alloc());
+                }
+            }
+        });
+    }
+    for (auto &W : Workers)
+        W.join();
+    double Secs = chrono::duration <double> (chrono::steady_clock::now() - Start).count();
+
+    map <i64, bool> All;
+    i64 Highest = -1;
+    for (auto &Mine : Held) {
+        for (auto Idx : Mine) {
+            if (All.count (Idx))
+                THROW_PBEXCEPTION ("Index allocated twice: %" PRId64, Idx);
+            All [Idx] = 1;
+            Highest = max (Highest, Idx);
+        }
+    }
+    i64 Count = Shared.CountAllocated();
+    if (Count != (i64) All.size())
+        THROW_PBEXCEPTION ("Allocation counts don't match:  Found:%" PRId64 " Expected:%zu", Count, All.size());
+
+    // the only holes are what the threads had reserved or kept from their frees when they stopped
+    i64 Slack = Threads * (BlockList::ReserveSize + BlockList::FreedKeep);
+    if (Highest >= (i64) All.size() + Slack)
+        THROW_PBEXCEPTION ("Indices not dense: highest %" PRId64 " for %zu held", Highest, All.size());
+
+    printf ("%3d threads: %6.1f M ops/s, %zu held, highest index %" PRId64 "\n", Threads, Threads * Ops / Secs / 1e6, All.size(), Highest);
+}
+
 int main (int argc, char **argv) {
     O.BlockNumModulus = 100;
     O.DebugPrint = 0;
 
     int count = 1000000;
+    int Threads = 0, Ops = 1000000;
     for (int i = 1; i < argc; i++) {
         if (string ("-c") == argv[i])
             count = stoi (string (argv[++i]), NULL, 10);
@@ -81,6 +136,10 @@ int main (int argc, char **argv) {
             PreAllocMax = stoi (string (argv[++i]), NULL, 10);
         else if (string ("-d") == argv[i])
             O.DebugPrint = 1;
+        else if (string ("-t") == argv[i])
+            Threads = stoi (string (argv[++i]), NULL, 10);
+        else if (string ("-o") == argv[i])
+            Ops = stoi (string (argv[++i]), NULL, 10);
     }
 
     generator.seed (1234);
@@ -104,6 +163,24 @@ int main (int argc, char **argv) {
 
             DoTestSize ();
         }
+
+        // freeing an index twice is caught before it can be handed out twice
+        if (Allocated.size()) {
+            i64  Idx    = Allocated.begin()->first;
+            bool Caught = false;
+            List.Free (Idx);
+            try {
+                List.Free (Idx);
+            } catch (PB_Exception &PBE) {
+                Caught = true;
+            }
+            if (!Caught)
+                THROW_PBEXCEPTION ("Double free of index not caught: %" PRId64, Idx);
+        }
+
+        // with -t, the concurrent benchmark from 1 thread up to that many
+        for (int t = 1; Threads && t <= Threads; t *= 2)
+            Bench (t, Ops);
     }
 
     // handle exceptions
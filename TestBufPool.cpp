@@ -0,0 +1,100 @@
+#include "BufPool.h"
+#include "Logging.h"
+#include "Opts.h"
+
+#include <chrono>
+#include <thread>
+#include <functional>
+#include <inttypes.h>
+
+// chunk buffer benchmark: pooled buffers against fresh strings
+// each thread fills a chunk, hands it on by reference and drops it
+// (the read then hash/compress/write pattern of create)
+
+int NumChunks  = 20000;
+int NumWorkers = 8;
+int ChunkSize  = 1 << 20;
+
+double RunThreads (function <void(int)> Func) {
+    auto Start = chrono::steady_clock::now();
+    vector <thread> Threads;
+    for (int t = 0; t < NumWorkers; t++)
+        Threads.emplace_back (Func, t);
+    for (auto &Thr : Threads)
+        Thr.join();
+    return chrono::duration <double> (chrono::steady_clock::now() - Start).count();
+}
+
+int main (int argc, char **argv) {
+    O.DebugPrint = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (string ("-c") == argv[i])
+            NumChunks = stoi (string (argv[++i]), NULL, 10);
+        else if (string ("-t") == argv[i])
+            NumWorkers = stoi (string (argv[++i]), NULL, 10);
+        else if (string ("-s") == argv[i])
+            ChunkSize = stoi (string (argv[++i]), NULL, 10);
+        else if (string ("-d") == argv[i])
+            O.DebugPrint = 1;
+    }
+    printf ("%d chunks of %d bytes, %d threads\n", NumChunks, ChunkSize, NumWorkers);
+
+    try {
+        // size classes must cover every size with less than 25% slack
+        for (size_t Size = 1; Size < ((size_t) 1 << 30); Size += Size / 7 + 1) {
+            u32    Class = BufPool_t::SizeClass (Size);
+            size_t Cap   = BufPool_t::ClassSize (Class);
+            if (Cap < Size || (Class && BufPool_t::ClassSize (Class - 1) >= Size) || (Size > 4096 && Cap > Size + Size / 4))
+                THROW_PBEXCEPTION ("Bad size class %u (%lu bytes) for %lu bytes", Class, Cap, Size);
+        }
+
+        // references share one buffer, the last one gives it back
+        {
+            BufRef A (100);
+            A.Assign ("chunk", 5);
+            BufRef B = A;
+            A.Clear();
+            if (!B.Equals ("chunk", 5))
+                THROW_PBEXCEPTION ("Shared buffer lost its data");
+            B.Resize (3 * ChunkSize);
+            if (B.Size() != (size_t) 3 * ChunkSize || memcmp (B.Data(), "chunk", 5))
+                THROW_PBEXCEPTION ("Grown buffer lost its data");
+        }
+
+        // fresh string for every chunk, the way chunks used to be held
+        double StrSecs = RunThreads ([&](int t) {
+            for (int i = t; i < NumChunks; i += NumWorkers) {
+                string Chunk (ChunkSize, (char) i);
+                string Held = move (Chunk);
+                if (Held [ChunkSize - 1] != (char) i)
+                    THROW_PBEXCEPTION ("Bad string data");
+            }
+        });
+
+        // pooled buffer for every chunk
+        double PoolSecs = RunThreads ([&](int t) {
+            for (int i = t; i < NumChunks; i += NumWorkers) {
+                BufRef Chunk (ChunkSize);
+                Chunk.Resize (ChunkSize);
+                memset (Chunk.Data(), (char) i, ChunkSize);
+                BufRef Held = move (Chunk);
+                if (Held.Data() [ChunkSize - 1] != (char) i)
+                    THROW_PBEXCEPTION ("Bad pooled data");
+            }
+        });
+
+        printf ("string: %7.3f sec %10.0f chunks/sec\n", StrSecs,  NumChunks / StrSecs);
+        printf ("pooled: %7.3f sec %10.0f chunks/sec   %" PRIu64 " allocated, %" PRIu64 " reused\n", PoolSecs, NumChunks / PoolSecs,
+                (u64) BufPool.Allocs, (u64) BufPool.Reuses);
+    }
+
+    // handle exceptions
+    catch (const char *msg) {
+        fprintf (stderr, "Exception: %s\n", msg);
+        return 1;
+    }
+    catch (PB_Exception &PBE) {
+        PBE.Handle();
+    }
+}
@@ -0,0 +1,221 @@
+#include "Comp.h"
+#include "Logging.h"
+#include "Opts.h"
+#include "BufPool.h"
+
+#include <zstd.h>
+#include <chrono>
+#include <functional>
+
+// per-call cost of zstd compress and decompress:
+// a fresh context on every call (the way Comp used to work) against the per-thread contexts
+// run for a full chunk and for a small finfo sized block
+
+int Calls     = 10000;
+int ChunkSize = 256 << 10;
+int SmallSize = 200;
+
+double Time (function <void()> Func) {
+    auto Start = chrono::steady_clock::now();
+    for (int i = 0; i < Calls; i++)
+        Func();
+    return chrono::duration <double> (chrono::steady_clock::now() - Start).count() * 1e6 / Calls;
+}
+
+// fill with text that compresses about as well as typical files
+string MakeData (int Size) {
+    string Data;
+    u64    Seed = 1;
+    while ((int) Data.size() < Size) {
+        Seed = Seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        Data += "line " + to_string (Seed >> 44) + " of some sample text\n";
+    }
+    Data.resize (Size);
+    return Data;
+}
+
+void Bench (int Size) {
+    string Data = MakeData (Size);
+    string Comp, DeComp;
+
+    // fresh contexts
+    double OldComp = Time ([&]() {
+        Comp.resize (ZSTD_COMPRESSBOUND (Data.size()));
+        Comp.resize (ZSTD_compress (Comp.data(), Comp.size(), Data.data(), Data.size(), O.CompLevel));
+    });
+    double OldDeComp = Time ([&]() {
+        ZSTD_DStream *ZSTD = ZSTD_createDStream();
+        ZSTD_initDStream (ZSTD);
+        unsigned TotalAlloc = O.ChunkSize;
+        unsigned TotalOut   = 0;
+        ZSTD_inBuffer  in_buf = {Comp.data(), Comp.size(), 0};
+        ZSTD_outBuffer out_buf;
+        do {
+            DeComp.resize (TotalAlloc);
+            out_buf = {DeComp.data(), TotalAlloc, TotalOut};
+            ZSTD_decompressStream (ZSTD, &out_buf, &in_buf);
+            TotalOut    = out_buf.pos;
+            TotalAlloc += O.ChunkSize;
+        } while (in_buf.pos < in_buf.size || out_buf.pos >= out_buf.size);
+        DeComp.resize (TotalOut);
+        ZSTD_freeDStream (ZSTD);
+    });
+    if (DeComp != Data)
+        THROW_PBEXCEPTION ("Fresh context round trip failed");
+
+    // per-thread contexts
+    double NewComp   = Time ([&]() {Comp::Compress_ZSTD   (Data, Comp);});
+    double NewDeComp = Time ([&]() {Comp::DeCompress_ZSTD (Comp, DeComp);});
+    if (DeComp != Data)
+        THROW_PBEXCEPTION ("Cached context round trip failed");
+
+    printf ("%7d bytes  compress: %9.2f -> %9.2f usec   decompress: %9.2f -> %9.2f usec\n",
+            Size, OldComp, NewComp, OldDeComp, NewDeComp);
+
+    // lz4 for comparison
+    double LZ4Comp   = Time ([&]() {Comp::Compress_LZ4   (Data.data(), Data.size(), Comp);});
+    size_t LZ4Size   = Comp.size();
+    double LZ4DeComp = Time ([&]() {Comp::DeCompress_LZ4 (Comp, DeComp);});
+    if (DeComp != Data)
+        THROW_PBEXCEPTION ("LZ4 round trip failed");
+    Comp::Compress_ZSTD (Data, Comp);
+    printf ("%7d bytes  zstd: %7lu bytes   lz4: %7lu bytes, compress: %9.2f usec   decompress: %9.2f usec\n",
+            Size, Comp.size(), LZ4Size, LZ4Comp, LZ4DeComp);
+}
+
+// the compressibility probe against compressing the chunk to find out
+// text must look compressible and random bytes must not
+void BenchProbe () {
+    string Text = MakeData (ChunkSize);
+    string Rand (ChunkSize, 0);
+    u64    Seed = 1;
+    for (auto &c : Rand) {
+        Seed = Seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        c    = Seed >> 56;
+    }
+    if (!Comp::Compressible (Text.data(), Text.size()))
+        THROW_PBEXCEPTION ("Probe rejected text");
+    if (Comp::Compressible (Rand.data(), Rand.size()))
+        THROW_PBEXCEPTION ("Probe accepted random data");
+
+    string Comp;
+    double CompRand  = Time ([&]() {Comp::Compress_ZSTD (Rand, Comp);});
+    double ProbeRand = Time ([&]() {Comp::Compressible (Rand.data(), Rand.size());});
+    printf ("%7d random bytes  compress: %9.2f usec   probe: %9.2f usec\n", ChunkSize, CompRand, ProbeRand);
+}
+
+// small blocks with and without a trained dictionary
+// finfo records of a few chunks, and small config files
+void BenchDict () {
+    vector <string> Blocks;
+    u64 Seed = 1;
+    auto Rand = [&]() {
+        Seed = Seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        return Seed >> 33;
+    };
+    for (int i = 0; i < 4000; i++) {
+        string Block;
+        if (i & 1) {
+            for (int c = 0; c < 3; c++) {
+                char Line [80];
+                snprintf (Line, sizeof Line, "C-%lu %08lx%08lx%08lx%08lx\n", Rand() % 1000000, Rand(), Rand(), Rand(), Rand());
+                Block += Line;
+            }
+        } else {
+            Block = "# config " + to_string (Rand() % 1000) + "\nname = value" + to_string (Rand() % 100)
+                  + "\npath = /srv/data/d" + to_string (Rand() % 50) + "/f" + to_string (Rand() % 1000)
+                  + "\nowner = user" + to_string (Rand() % 10) + "\nenabled = true\n";
+        }
+        Blocks.push_back (Block);
+    }
+
+    // train on the first half, measure the second
+    string          Samples;
+    vector <size_t> SampleSizes;
+    for (unsigned i = 0; i < Blocks.size() / 2; i++) {
+        Samples += Blocks[i];
+        SampleSizes.push_back (Blocks[i].size());
+    }
+    string Dict = Comp::TrainDict (Samples, SampleSizes, 112 << 10);
+    if (!Dict.size())
+        THROW_PBEXCEPTION ("Dictionary training failed");
+
+    u64    RawBytes = 0, PlainBytes = 0, DictBytes = 0;
+    string Comp, DeComp;
+    for (unsigned i = Blocks.size() / 2; i < Blocks.size(); i++) {
+        RawBytes += Blocks[i].size();
+        Comp::Compress_ZSTD (Blocks[i], Comp);
+        PlainBytes += min (Comp.size(), Blocks[i].size());
+    }
+    Comp::UseDict (Dict);
+    O.DictBelow = 1 << 14;
+    for (unsigned i = Blocks.size() / 2; i < Blocks.size(); i++) {
+        Comp::Compress_ZSTD   (Blocks[i], Comp);
+        Comp::DeCompress_ZSTD (Comp, DeComp);
+        if (DeComp != Blocks[i])
+            THROW_PBEXCEPTION ("Dictionary round trip failed");
+        DictBytes += min (Comp.size(), Blocks[i].size());
+    }
+    double DictComp = Time ([&]() {Comp::Compress_ZSTD (Blocks.back(), Comp);});
+    O.DictBelow = 0;
+
+    printf ("%lu small blocks, %lu bytes  stored: %lu plain, %lu with a %lu byte dictionary (%.2f usec per block)\n",
+            Blocks.size() / 2, RawBytes, PlainBytes, DictBytes, Dict.size(), DictComp);
+}
+
+// a random chunk with a few bytes changed, stored whole and as a delta against the old one
+void BenchDelta () {
+    BufRef Old, New, Comp, Delta, DeComp;
+    Old.Resize (ChunkSize);
+    u64 Seed = 1;
+    for (int i = 0; i < ChunkSize; i++) {
+        Seed = Seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        ((char *) Old.Data()) [i] = Seed >> 56;
+    }
+    New.Assign (Old.Data(), Old.Size());
+    for (int i = 0; i < ChunkSize; i += ChunkSize / 8)
+        ((char *) New.Data()) [i] ^= 0x55;
+
+    double Whole = Time ([&]() {Comp::Compress_ZSTD  (New, Comp);});
+    double Diff  = Time ([&]() {Comp::Compress_Delta (New, Old, Delta, O.CompLevel);});
+    double Back  = Time ([&]() {Comp::DeCompress_Delta (Delta, Old, DeComp);});
+    if (DeComp != New)
+        THROW_PBEXCEPTION ("Delta round trip failed");
+    printf ("%7d bytes, 8 changed  whole: %9.2f usec %7lu bytes   delta: %9.2f usec %7lu bytes   decode: %9.2f usec\n",
+            ChunkSize, Whole, Comp.Size(), Diff, Delta.Size(), Back);
+}
+
+int main (int argc, char **argv) {
+    O.DebugPrint = 0;
+    O.CompLevel  = 2;
+
+    for (int i = 1; i < argc; i++) {
+        if (string ("-c") == argv[i])
+            Calls = stoi (string (argv[++i]), NULL, 10);
+        else if (string ("-s") == argv[i])
+            ChunkSize = stoi (string (argv[++i]), NULL, 10);
+        else if (string ("-l") == argv[i])
+            O.CompLevel = stoi (string (argv[++i]), NULL, 10);
+        else if (string ("-d") == argv[i])
+            O.DebugPrint = 1;
+    }
+    printf ("%d calls each, level %d\n", Calls, O.CompLevel);
+
+    try {
+        O.ChunkSize = ChunkSize;
+        Bench (ChunkSize);
+        Bench (SmallSize);
+        BenchProbe ();
+        BenchDict ();
+        BenchDelta ();
+    }
+
+    // handle exceptions
+    catch (const char *msg) {
+        fprintf (stderr, "Exception: %s\n", msg);
+        return 1;
+    }
+    catch (PB_Exception &PBE) {
+        PBE.Handle();
+    }
+}
@@ -0,0 +1,125 @@
+#include "ConcMap.h"
+#include "Logging.h"
+#include "Opts.h"
+
+#include <map>
+#include <chrono>
+#include <thread>
+#include <inttypes.h>
+
+// contention benchmark: ConcMap against a std::map behind one mutex
+// each thread inserts its share of the keys, then every thread looks up all of them
+// (the insert-once, look-up-many pattern of the hard link and base file maps)
+
+int NumKeys    = 1000000;
+int NumWorkers = 8;
+int Passes     = 4;
+
+double RunThreads (function <void(int)> Func) {
+    auto Start = chrono::steady_clock::now();
+    vector <thread> Threads;
+    for (int t = 0; t < NumWorkers; t++)
+        Threads.emplace_back (Func, t);
+    for (auto &Thr : Threads)
+        Thr.join();
+    return chrono::duration <double> (chrono::steady_clock::now() - Start).count();
+}
+
+void Report (const char *Name, double InsSecs, double FindSecs) {
+    printf ("%-10s insert: %7.3f sec %12.0f ops/sec   lookup: %7.3f sec %12.0f ops/sec\n", Name,
+            InsSecs, NumKeys / InsSecs, FindSecs, (double) NumKeys * NumWorkers * Passes / FindSecs);
+}
+
+int main (int argc, char **argv) {
+    O.DebugPrint = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (string ("-c") == argv[i])
+            NumKeys = stoi (string (argv[++i]), NULL, 10);
+        else if (string ("-t") == argv[i])
+            NumWorkers = stoi (string (argv[++i]), NULL, 10);
+        else if (string ("-l") == argv[i])
+            Passes = stoi (string (argv[++i]), NULL, 10);
+        else if (string ("-d") == argv[i])
+            O.DebugPrint = 1;
+    }
+    printf ("%d keys, %d threads, %d lookup passes\n", NumKeys, NumWorkers, Passes);
+
+    try {
+        // mutex protected map, the way the shared maps used to be
+        {
+            map <i64, i64> Map;
+            mutex          MapMtx;
+            double InsSecs = RunThreads ([&](int t) {
+                for (i64 k = t; k < NumKeys; k += NumWorkers) {
+                    MapMtx.lock();
+                    if (!Map.count (k))
+                        Map [k] = k;
+                    MapMtx.unlock();
+                }
+            });
+            atomic <i64> Missing (0);
+            double FindSecs = RunThreads ([&](int t) {
+                for (int l = 0; l < Passes; l++) {
+                    for (i64 k = 0; k < NumKeys; k++) {
+                        MapMtx.lock();
+                        if (!Map.count (k))
+                            Missing ++;
+                        MapMtx.unlock();
+                    }
+                }
+            });
+            if (Missing)
+                THROW_PBEXCEPTION ("map: %" PRId64 " keys missing", (i64) Missing);
+            Report ("map+mutex", InsSecs, FindSecs);
+        }
+
+        // sharded concurrent map
+        {
+            ConcMap <i64, i64> Map;
+            atomic <i64> Missing (0);
+            double InsSecs = RunThreads ([&](int t) {
+                for (i64 k = t; k < NumKeys; k += NumWorkers)
+                    if (!Map.Insert (k, k))
+                        Missing ++;
+            });
+            double FindSecs = RunThreads ([&](int t) {
+                for (int l = 0; l < Passes; l++) {
+                    for (i64 k = 0; k < NumKeys; k++) {
+                        i64 *Val = Map.Find (k);
+                        if (!Val || *Val != k)
+                            Missing ++;
+                    }
+                }
+            });
+            if (Missing)
+                THROW_PBEXCEPTION ("ConcMap: %" PRId64 " keys missing", (i64) Missing);
+            if (Map.Size() != (u64) NumKeys)
+                THROW_PBEXCEPTION ("ConcMap: size %" PRIu64 " expected %d", Map.Size(), NumKeys);
+            Report ("ConcMap", InsSecs, FindSecs);
+        }
+
+        // racing inserts of the same keys: exactly one winner per key
+        {
+            ConcMap <i64, i64> Map;
+            atomic <i64> Wins (0);
+            RunThreads ([&](int t) {
+                for (i64 k = 0; k < NumKeys / 10; k++)
+                    if (Map.Insert (k, t))
+                        Wins ++;
+            });
+            if (Wins != NumKeys / 10)
+                THROW_PBEXCEPTION ("ConcMap: %" PRId64 " winning inserts for %d keys", (i64) Wins, NumKeys / 10);
+            printf ("racing inserts ok\n");
+        }
+    }
+
+    // handle exceptions
+    catch (const char *msg) {
+        fprintf (stderr, "Exception: %s\n", msg);
+        return 1;
+    }
+    catch (PB_Exception &PBE) {
+        PBE.Handle();
+    }
+}
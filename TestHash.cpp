@@ -0,0 +1,149 @@
+#include "Hash.h"
+#include "HashBatch.h"
+#include "Logging.h"
+#include "Opts.h"
+
+#include <mhash.h>
+#include <chrono>
+#include <functional>
+#include <thread>
+
+// throughput of each hash type on chunk sized buffers, with the implementation picked for this cpu
+// sha256 is also run through mhash directly to check the native code gets the same answers
+// then md5 of chunks from several threads at once, each alone and batched into simd lanes
+
+int    Calls     = 2000;
+int    ChunkSize = 256 << 10;
+int    Threads   = 8;
+
+double Time (function <void()> Func) {
+    auto Start = chrono::steady_clock::now();
+    for (int i = 0; i < Calls; i++)
+        Func();
+    return chrono::duration <double> (chrono::steady_clock::now() - Start).count();
+}
+
+string MakeData (int Size) {
+    string Data (Size, 0);
+    u64    Seed = 1;
+    for (auto &C : Data) {
+        Seed = Seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        C    = Seed >> 56;
+    }
+    return Data;
+}
+
+string MHashStr (const char *Buf, size_t Size) {
+    MHASH Hasher = mhash_init (MHASH_SHA256);
+    mhash (Hasher, Buf, Size);
+    unsigned char *Bin = (unsigned char *)mhash_end_m (Hasher, (void * (*)(unsigned int)) malloc);
+    string Hex;
+    for (int i = 0; i < 32; i++) {
+        char H [3];
+        snprintf (H, 3, "%02x", Bin[i]);
+        Hex.append (H);
+    }
+    free (Bin);
+    return Hex;
+}
+
+void Print (const char *Name, const char *Impl, double Secs) {
+    printf ("%-7s %-7s %9.1f MiB/s\n", Name, Impl, (double) Calls * ChunkSize / Secs / (1 << 20));
+}
+
+// every length around the 64 byte block boundaries, split across updates
+void CheckSha256 (const string &Data) {
+    for (int Len = 0; Len < 300; Len++) {
+        for (int Split = 0; Split <= Len; Split += 7) {
+            Hash Hasher (HashType_SHA256);
+            Hasher.Update (Data.data(), Split);
+            Hasher.Update (Data.data() + Split, Len - Split);
+            if (Hasher.GetHash() != MHashStr (Data.data(), Len))
+                THROW_PBEXCEPTION ("sha256 mismatch at length %d split %d", Len, Split);
+        }
+    }
+    if (HashStr (HashType_SHA256, Data) != MHashStr (Data.data(), Data.size()))
+        THROW_PBEXCEPTION ("sha256 mismatch on chunk");
+}
+
+// Threads threads hash Calls chunks between them, all of a different length
+// to check each lane against the scalar md5 while lanes finish at different blocks
+double BenchBatch (const string &Data, bool Check) {
+    BufRef Full;
+    Full.Assign (Data.data(), Data.size());
+    vector <thread> Workers;
+    auto Start = chrono::steady_clock::now();
+    for (int t = 0; t < Threads; t++) {
+        Workers.emplace_back ([&, t]() {
+            for (int i = t; i < Calls; i += Threads) {
+                size_t Len = Check ? i * 37 % ChunkSize : ChunkSize;
+                BufRef Part;
+                if (Check)
+                    Part.Assign (Data.data(), Len);
+                string Out = HashStr (HashType_MD5, Check ? Part : Full);
+                if (Check) {
+                    Hash Hasher (HashType_MD5);
+                    if (Out != Hasher.HashStr (Data.data(), Len))
+                        THROW_PBEXCEPTION ("batched md5 mismatch at length %zu", Len);
+                }
+            }
+        });
+    }
+    for (auto &W : Workers)
+        W.join();
+    return chrono::duration <double> (chrono::steady_clock::now() - Start).count();
+}
+
+int main (int argc, char **argv) {
+    O.DebugPrint = 0;
+    O.HashWait   = 50;
+
+    for (int i = 1; i < argc; i++) {
+        if (string ("-c") == argv[i])
+            Calls = stoi (string (argv[++i]), NULL, 10);
+        else if (string ("-s") == argv[i])
+            ChunkSize = stoi (string (argv[++i]), NULL, 10);
+        else if (string ("-t") == argv[i])
+            Threads = stoi (string (argv[++i]), NULL, 10);
+        else if (string ("-w") == argv[i])
+            O.HashWait = stoi (string (argv[++i]), NULL, 10);
+        else if (string ("-d") == argv[i])
+            O.DebugPrint = 1;
+    }
+    printf ("%d calls each, %d bytes, %d threads\n", Calls, ChunkSize, Threads);
+
+    try {
+        string Data = MakeData (ChunkSize);
+        CheckSha256 (Data);
+
+        for (int T = 0; T < HashType_Null; T++) {
+            string Out;
+            double Secs = Time ([&]() {Out = HashStr ((eHashType) T, Data);});
+            Print (HashNames [T], HashImplName ((eHashType) T), Secs);
+        }
+        if (HashImplOf (HashType_SHA256) != HashImpl_MHash)
+            Print ("SHA256", "mhash", Time ([&]() {MHashStr (Data.data(), Data.size());}));
+
+        if (!HashBatch.Usable (HashType_MD5)) {
+            printf ("md5 batching not available (needs avx2 and -w above 0)\n");
+            return 0;
+        }
+        BenchBatch (Data, true);
+        u32 Wait   = O.HashWait;
+        O.HashWait = 0;
+        Print ("MD5", "threads", BenchBatch (Data, false));
+        O.HashWait = Wait;
+        u64 Batches = HashBatch.Batches, Batched = HashBatch.Batched;
+        Print ("MD5", "batched", BenchBatch (Data, false));
+        printf ("%lu chunks in %lu batches, %lu alone\n", HashBatch.Batched - Batched, HashBatch.Batches - Batches, HashBatch.Alone.load());
+    }
+
+    // handle exceptions
+    catch (const char *msg) {
+        fprintf (stderr, "Exception: %s\n", msg);
+        return 1;
+    }
+    catch (PB_Exception &PBE) {
+        PBE.Handle();
+    }
+}
@@ -0,0 +1,70 @@
+#include "Logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <fstream>
+#include <filesystem>
+using namespace std;
+namespace fs = std::filesystem;
+
+// files kept in the List by one create must come back from archives based on it
+// first with --InlineSize inherited from the base, then with a limit the files no longer fit, then with none
+// runs the PhatBak binary (-p, default ./PhatBak) in a scratch dir (-w, default /tmp/TestInline)
+
+string PhatBak = "./PhatBak";
+string Work    = "/tmp/TestInline";
+
+void Run (const string &Cmd) {
+    if (system (("cd " + Work + " && (" + Cmd + ") >/dev/null").c_str()))
+        THROW_PBEXCEPTION ("Failed: %s", Cmd.c_str());
+}
+
+// extract an archive and compare it with the source files
+void Check (const string &Arch) {
+    fs::remove_all (Work + "/ex");
+    fs::create_directories (Work + "/ex");
+    Run ("cd ex && " + PhatBak + " extract " + Work + "/repo::" + Arch);
+    Run ("diff -r src $(find ex -name src -type d | head -1)");
+    printf ("%s ok\n", Arch.c_str());
+}
+
+int main (int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (string ("-p") == argv[i])
+            PhatBak = argv[++i];
+        else if (string ("-w") == argv[i])
+            Work = argv[++i];
+    }
+    if (PhatBak[0] != '/')
+        PhatBak = string (realpath (PhatBak.c_str(), NULL));
+
+    try {
+        fs::remove_all (Work);
+        fs::create_directories (Work + "/src");
+        for (int f = 0; f < 20; f++)
+            Run ("echo tiny file " + to_string (f) + " > src/t" + to_string (f));
+        Run ("seq 1 20000 > src/big");
+
+        Run (PhatBak + " init repo");
+        Run (PhatBak + " create --InlineSize 64 repo::2020_01_01_0000_00 src");
+        Check ("2020_01_01_0000_00");
+        Run (PhatBak + " create repo::2020_01_02_0000_00 src");
+        Check ("2020_01_02_0000_00");
+        Run (PhatBak + " create --InlineSize 8 repo::2020_01_03_0000_00 src");
+        Check ("2020_01_03_0000_00");
+        Run (PhatBak + " create --InlineSize 0 repo::2020_01_04_0000_00 src");
+        Check ("2020_01_04_0000_00");
+        Run ("grep -q 'InlineSize *= 0$' repo/2020_01_04_0000_00/Options");
+        Run (PhatBak + " test repo::2020_01_04_0000_00");
+    }
+
+    // handle exceptions
+    catch (const char *msg) {
+        fprintf (stderr, "Exception: %s\n", msg);
+        return 1;
+    }
+    catch (PB_Exception &PBE) {
+        PBE.Handle();
+    }
+}
@@ -0,0 +1,119 @@
+#include "StatBatch.h"
+#include "LiveFile.h"
+#include "Logging.h"
+#include "Opts.h"
+
+#include <chrono>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+// compare one fstatat per file against batched io_uring stats
+// over a directory of many small files
+int main (int argc, char **argv) {
+    O.DebugPrint = 0;
+
+    int    count  = 20000;
+    int    passes = 5;
+    string Dir    = "";
+    for (int i = 1; i < argc; i++) {
+        if (string ("-c") == argv[i])
+            count = stoi (string (argv[++i]), NULL, 10);
+        else if (string ("-p") == argv[i])
+            passes = stoi (string (argv[++i]), NULL, 10);
+        else if (string ("-t") == argv[i])
+            Dir = argv[++i];
+        else if (string ("-d") == argv[i])
+            O.DebugPrint = 1;
+    }
+
+    try {
+        // build the test tree unless one was given
+        bool Cleanup = Dir == "";
+        if (Cleanup) {
+            char Templ [] = "/tmp/TestStatBatch.XXXXXX";
+            if (!mkdtemp (Templ))
+                THROW_PBEXCEPTION_IO ("Can't create temp dir");
+            Dir = Templ;
+            for (int i = 0; i < count; i++) {
+                string Name = Dir + "/f" + to_string (i);
+                int Fd = open (Name.c_str(), O_CREAT | O_WRONLY, 0644);
+                if (Fd < 0)
+                    THROW_PBEXCEPTION_IO ("Can't create %s", Name.c_str());
+                if (write (Fd, "x", 1) != 1)
+                    THROW_PBEXCEPTION_IO ("Can't write %s", Name.c_str());
+                close (Fd);
+            }
+        }
+
+        int DirFd = open (Dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (DirFd < 0)
+            THROW_PBEXCEPTION_IO ("Can't open %s", Dir.c_str());
+        DirHandlePtr Handle = make_shared <DirHandle> (DirFd, Dir);
+        vecstr       Names;
+        vector <u8>  Types;
+        LiveFile::ListDir (Handle, Names, Types);
+        printf ("%zu entries in %s\n", Names.size(), Dir.c_str());
+
+        // one system call per file
+        auto Start = chrono::steady_clock::now();
+        u64  SyncSum = 0;
+        for (int p = 0; p < passes; p++) {
+            for (auto &Name : Names) {
+                struct stat Stats;
+                if (fstatat (DirFd, Name.c_str(), &Stats, AT_SYMLINK_NOFOLLOW) < 0)
+                    THROW_PBEXCEPTION_IO ("Can't stat %s", Name.c_str());
+                SyncSum += Stats.st_size;
+            }
+        }
+        double SyncSecs = chrono::duration <double> (chrono::steady_clock::now() - Start).count();
+        printf ("fstatat  : %8.3f sec  %10.0f stats/sec\n", SyncSecs, Names.size() * passes / SyncSecs);
+
+        // batched like the create walker does it
+        if (!StatBatch::Available()) {
+            printf ("io_uring : not available\n");
+        } else {
+            const size_t BatchSize = 256;
+            Start = chrono::steady_clock::now();
+            u64 URingSum = 0;
+            for (int p = 0; p < passes; p++) {
+                for (size_t b = 0; b < Names.size(); b += BatchSize) {
+                    size_t e = min (Names.size(), b + BatchSize);
+                    vecstr              BNames (Names.begin() + b, Names.begin() + e);
+                    vector <u8>         BTypes (Types.begin() + b, Types.begin() + e);
+                    vector <StatResult> Results;
+                    if (!StatBatch::Stat (DirFd, BNames, BTypes, Results))
+                        THROW_PBEXCEPTION ("Batched stat failed");
+                    for (auto &Res : Results) {
+                        if (Res.Err)
+                            THROW_PBEXCEPTION ("Batched stat error: %s", strerror (Res.Err));
+                        if (Res.DirFd >= 0)
+                            close (Res.DirFd);
+                        URingSum += Res.Stats.st_size;
+                    }
+                }
+            }
+            double URingSecs = chrono::duration <double> (chrono::steady_clock::now() - Start).count();
+            printf ("io_uring : %8.3f sec  %10.0f stats/sec\n", URingSecs, Names.size() * passes / URingSecs);
+            if (URingSum != SyncSum)
+                THROW_PBEXCEPTION ("Size totals don't match: %" PRIu64 " vs %" PRIu64, URingSum, SyncSum);
+        }
+
+        if (Cleanup) {
+            for (auto &Name : Names)
+                unlinkat (DirFd, Name.c_str(), 0);
+            rmdir (Dir.c_str());
+        }
+    }
+
+    // handle exceptions
+    catch (const char *msg) {
+        fprintf (stderr, "Exception: %s\n", msg);
+        return 1;
+    }
+    catch (PB_Exception &PBE) {
+        PBE.Handle();
+    }
+}
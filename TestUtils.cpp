@@ -20,6 +20,12 @@ int main () {
 
         printf ("sizeof(unsigned) = %lu\n", sizeof (unsigned));
 
+        vector <string> Datas = {"", "f", "fo", "foo", "foob", "fooba", "foobar", string ("\0\xff\x10", 3)};
+        for (auto Data : Datas) {
+            string Enc = Base64Encode (Data);
+            cout << "Base64:" << Enc << ": RoundTrip:" << (Base64Decode (Enc) == Data ? "ok" : "BAD") << endl;
+        }
+
         //CreateDir ("zzz");
         //CreateDir ("zzz");
         //CreateDir ("zzzz/bbb/zzz", 1);
@@ -22,6 +22,7 @@ typedef vector <string> vecstr;
 typedef enum {
     CompType_NONE = 0,
     CompType_ZTSD,
+    CompType_LZ4,
     CompType_NULL,  // marks end of list
 } eCompType;
 
@@ -31,6 +32,18 @@ typedef enum {
 
 #include <sys/stat.h>
 
+class BlockList;
+
+// an archive whose blocks are used by the List or FInfo entries of a later archive (BlockRefs)
+// also stands for the archive itself, with No == 0
+class RefArchive {
+    public:
+    string     Name;         // archive dir name within the repo
+    u32        No;           // small number to tell archives apart in block keys
+    BlockList *FInfoBlocks;
+    BlockList *ChunkBlocks;
+};
+
 // fields of "List" file
 class FileListEntry {
     public:
@@ -41,6 +54,9 @@ class FileListEntry {
     i64         FInfoIdx  ;
     u64         LineNo    ;
     string      Acl       ;
+    string      RefArch   ; // archive holding the FInfo block and its chunks, "" for this one
+    string      Inline    ; // contents of a tiny file kept in the list (compressed if CompFlag says so)
+    string      Digest    ; // hash of a regular file's chunk hashes, "" if not recorded
 
      FileListEntry() {}
     ~FileListEntry() {}
@@ -51,10 +67,14 @@ class ChunkInfo {
     char         CompFlag;
     i64          ChunkIdx;
     string       Hash;
-    ChunkInfo (char compflag, i64 idx, const string& hash) {
+    const RefArchive *Ref;  // archive holding the chunk block
+    vector <ChunkInfo> Delta;  // chunks a delta chunk is encoded against: its base, the base's base, ...
+    u64          Sum = 0;   // checksum of the block as stored, 0 if not recorded
+    ChunkInfo (char compflag, i64 idx, const string& hash, const RefArchive *ref = NULL) {
         CompFlag = compflag;
         ChunkIdx = idx;
         Hash     = hash;
+        Ref      = ref;
     }
 };
 
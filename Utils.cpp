@@ -2,6 +2,7 @@
 #include "Logging.h"
 
 #include <unistd.h>
+#include <string.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -170,6 +171,14 @@ namespace Utils {
         return Size;
     }
 
+    int ReadBinary (FILE *F, BufRef &Buf, int MaxSize) {
+        assert (F);
+        Buf.Resize (MaxSize);
+        int Size = ReadBinary (F, Buf.Data(), MaxSize);
+        Buf.Resize (Size);
+        return Size;
+    }
+
     void WriteBinary (FILE *F, const char *Buf, unsigned BufSize) {
         assert (F);
         if (fwrite (Buf, 1, BufSize, F) != BufSize)
@@ -181,6 +190,11 @@ namespace Utils {
         WriteBinary (F, Str.c_str(), Str.size());
     }
 
+    void WriteBinary (FILE *F, const BufRef &Buf) {
+        assert (F);
+        WriteBinary (F, Buf.Data(), Buf.Size());
+    }
+
     void CreateDir (const string Dir, bool CreateSubs) {
         error_code ec;
         if (CreateSubs) {
@@ -235,9 +249,18 @@ namespace Utils {
         Strm.close();
     }
 
-    void Link (const string &Name, const string &Target) {
+    void Link (const string &Name, const string &Target, bool MayExist) {
         error_code ec;
         fs::create_hard_link (Target, Name, ec);
+        // only fine if it's the same block linked again, anything else there is a stale or wrong block
+        if (ec == errc::file_exists && MayExist) {
+            struct stat NameStats, TargetStats;
+            if (stat (Name.c_str(), &NameStats) < 0 || stat (Target.c_str(), &TargetStats) < 0)
+                THROW_PBEXCEPTION_IO ("Can't stat link:%s or target:%s", Name.c_str(), Target.c_str());
+            if (NameStats.st_dev == TargetStats.st_dev && NameStats.st_ino == TargetStats.st_ino)
+                return;
+            THROW_PBEXCEPTION ("Error creating link:%s to target:%s : a different file is already there", Name.c_str(), Target.c_str());
+        }
         if (ec)
             THROW_PBEXCEPTION_IO ("Error creating link:%s to target:%s :%s", Name.c_str(), Target.c_str(), ec.message().c_str());
     }
@@ -491,4 +514,65 @@ namespace Utils {
             acl_free (acl);
         }
     }
+
+    static const char *Base64Chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    string Base64Encode (const string &Data) {
+        string Res;
+        Res.reserve ((Data.size() + 2) / 3 * 4);
+        const u8 *P = (const u8 *) Data.data();
+        size_t    i = 0;
+        for (; i + 2 < Data.size(); i += 3) {
+            u32 Bits = (P[i] << 16) | (P[i+1] << 8) | P[i+2];
+            Res += Base64Chars [(Bits >> 18) & 63];
+            Res += Base64Chars [(Bits >> 12) & 63];
+            Res += Base64Chars [(Bits >>  6) & 63];
+            Res += Base64Chars [ Bits        & 63];
+        }
+        if (i < Data.size()) {
+            u32 Bits = P[i] << 16;
+            if (i + 1 < Data.size())
+                Bits |= P[i+1] << 8;
+            Res += Base64Chars [(Bits >> 18) & 63];
+            Res += Base64Chars [(Bits >> 12) & 63];
+            Res += i + 1 < Data.size() ? Base64Chars [(Bits >> 6) & 63] : '=';
+            Res += '=';
+        }
+        return Res;
+    }
+
+    string Base64Decode (const string &Text) {
+        static i8 Lookup [256];
+        static bool Init = [](){
+            memset (Lookup, -1, sizeof(Lookup));
+            for (int i = 0; i < 64; i++)
+                Lookup [(u8) Base64Chars[i]] = i;
+            return true;
+        }();
+        (void) Init;
+
+        if (Text.size() % 4)
+            THROW_PBEXCEPTION_FMT ("Illegal base64 text: %s", Text.c_str());
+        string Res;
+        Res.reserve (Text.size() / 4 * 3);
+        for (size_t i = 0; i < Text.size(); i += 4) {
+            u32 Bits = 0;
+            int Pad  = 0;
+            for (int j = 0; j < 4; j++) {
+                u8 c = Text[i+j];
+                if (c == '=' && i + 4 == Text.size() && j >= 2) {
+                    Pad ++;
+                    Bits <<= 6;
+                    continue;
+                }
+                if (Pad || Lookup[c] < 0)
+                    THROW_PBEXCEPTION_FMT ("Illegal base64 text: %s", Text.c_str());
+                Bits = (Bits << 6) | Lookup[c];
+            }
+            Res += (char) (Bits >> 16);
+            if (Pad < 2) Res += (char) (Bits >>  8);
+            if (Pad < 1) Res += (char)  Bits;
+        }
+        return Res;
+    }
 }
@@ -3,6 +3,7 @@
 
 #include "Types.h"
 #include "BlockList.h"
+#include "BufPool.h"
 
 #include <vector>
 #include <string>
@@ -48,10 +49,12 @@ namespace Utils {
 
     // read unformatted data into string
     int ReadBinary (FILE *F, string &Str, int MaxSize);
+    int ReadBinary (FILE *F, BufRef &Buf, int MaxSize);
 
     // write unformatted data to file
     void WriteBinary (FILE *F, const char *Buf, unsigned BufSize);
     void WriteBinary (FILE *F, const string &Str);
+    void WriteBinary (FILE *F, const BufRef &Buf);
 
     // create a directory - optionally create needed subdirs
     void CreateDir (const string Dir, bool CreateSubs = false);
@@ -69,7 +72,8 @@ namespace Utils {
     void Touch (const string Name);
 
     // link a file to a new name
-    void Link (const string &Name, const string &Target);
+    // with MayExist, the name may already be a link to the same file
+    void Link (const string &Name, const string &Target, bool MayExist = false);
 
     // extract standard stat type from archive file stats header
     struct stat ParseStatsHeader (const string &Hdr);
@@ -115,5 +119,9 @@ namespace Utils {
 
     // set file acls from acrhived text string version
     void SetFileAcls (const string &Name, u16 Perm, const string &Acls);
+
+    // convert binary data to and from base64 text (to keep it in text files)
+    string Base64Encode (const string &Data);
+    string Base64Decode (const string &Text);
 }
 #endif // UTILS_H